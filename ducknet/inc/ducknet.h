@@ -26,17 +26,35 @@ typedef struct {
 	DucknetICMPConfig icmp;
 	DucknetUDPConfig udp;
 	int (*idle)();
+	int rx_burst;  // frames received per step, 0: DUCKNET_DEFAULT_RX_BURST
 } DucknetConfig;
 
+#define DUCKNET_DEFAULT_RX_BURST 32
+#define DUCKNET_MAX_RX_BURST 64
+
+// Layer idles run from ducknet_step at most this often
+#define DUCKNET_IDLE_INTERVAL_US 50
+
 int ducknet_init(const DucknetConfig *);
 
 int ducknet_flush();
 
 int ducknet_mainloop();
+
+// Runs the layer idles if their deadline has passed, handles a burst of
+// received frames, then calls the user idle
 int ducknet_step();
+
+// Runs every layer idle now
 int ducknet_idle();
+
 int ducknet_packet_handle(void *pkt, int len);
 
+// Handles n frames in order, skipping those with DUCKNET_CSUM_BAD; the
+// caller releases them
+// returns: # of frames handled
+int ducknet_packet_handle_burst(const DucknetPacketRef *pkts, int n);
+
 #ifdef __cplusplus
 }
 #endif
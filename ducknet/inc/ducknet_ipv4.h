@@ -3,6 +3,7 @@
 
 #include <ducknet_types.h>
 #include <ducknet_utils.h>
+#include <ducknet_phy.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +14,12 @@ extern "C" {
 #define DUCKNET_IPv4_UDP 17
 
 #define DUCKNET_IPv4_FLAGS_DF 0x4000
+#define DUCKNET_IPv4_FLAGS_MF 0x2000
+#define DUCKNET_IPv4_OFFSET_MASK 0x1fff  // in 8-byte units
+
+// Largest datagram, headers included; ones over the MTU are fragmented
+// on send and reassembled on receive
+#define DUCKNET_IPv4_MAX_LEN 65535
 
 typedef struct {
 	union {
@@ -27,7 +34,7 @@ typedef struct {
 	ducknet_u8 tos;
 	ducknet_u16 length;
 	ducknet_u16 id;
-	ducknet_u16 flags;  // TODO support fragmentation
+	ducknet_u16 flags;  // and fragment offset
 	ducknet_u8 ttl, protocol;
 	ducknet_u16 checksum;
 	DucknetIPv4Address src, dst;
@@ -44,8 +51,15 @@ int ducknet_ipv4_init(const DucknetIPv4Config *);
 
 void ducknet_ipv4_hton(DucknetIPv4Header *);
 
+// Fragments the payload if it does not fit in one frame
+// returns: < 0 if the datagram did not go out whole; fragments already
+//          sent by then are useless, the receiver drops them in reassembly
 int ducknet_ipv4_send(DucknetIPv4Address dst, ducknet_u8 protocol, const void *payload, int len);
 
+// pkt holds the payload, which has to fit in one frame; it is consumed
+// either way
+int ducknet_ipv4_send_pkt(DucknetIPv4Address dst, ducknet_u8 protocol, DucknetPkt *pkt);
+
 int ducknet_ipv4_idle();
 int ducknet_ipv4_packet_handle(void *pkt, int len);
 
@@ -8,9 +8,41 @@
 extern "C" {
 #endif
 
+// Checksums the NIC computes on send / verifies on receive
+#define DUCKNET_CSUM_IPv4 1u  // IPv4 header
+#define DUCKNET_CSUM_L4 2u    // TCP/UDP over IPv4
+#define DUCKNET_CSUM_BAD 4u   // receive only: the NIC found a wrong one
+
+// A received frame, in place in the driver's buffer until released
+typedef struct {
+	void *data;
+	int len;
+	unsigned csum;  // DUCKNET_CSUM_* the NIC verified, or DUCKNET_CSUM_BAD
+	ducknet_time_t rx_time;  // when the driver took it off the ring, or 0
+} DucknetPacketRef;
+
+// A frame built in place in one of the driver's TX buffers: the payload
+// goes at data (ducknet_pkt_put), then every layer pushes its header in
+// front, and the buffer itself is handed to the NIC
 typedef struct {
-	int (*send)(const void *, int);
-	int (*recv)(void *);
+	char *data;
+	int len;
+	unsigned csum;  // DUCKNET_CSUM_* for the NIC to fill in
+} DucknetPkt;
+
+// Room for the Ethernet, IPv4 and UDP headers, keeping the payload aligned
+#define DUCKNET_PKT_HEADROOM 64
+
+typedef struct {
+	// csum: DUCKNET_CSUM_* for the NIC to fill in where they apply
+	int (*send)(const void *, int, unsigned csum);
+	// Optional, for DucknetPkt: pkt_send consumes the buffer even if it fails
+	DucknetPkt *(*pkt_alloc)(int headroom);
+	int (*pkt_send)(DucknetPkt *);
+	void (*pkt_free)(DucknetPkt *);
+	unsigned tx_csum_offload;  // DUCKNET_CSUM_* send can fill in
+	int (*rx_burst)(DucknetPacketRef *, int max);
+	void (*rx_release)(int n);
 	int (*flush)();
 	int (*packet_handle)(void *, int);
 	int (*send_packet_handle)(const void *, int);
@@ -19,12 +51,38 @@ typedef struct {
 int ducknet_phy_init(const DucknetPhyConfig *);
 
 int ducknet_phy_send(const void *, int);
-int ducknet_phy_recv(void *);
+
+// headroom: bytes kept free in front of data for headers
+// returns: NULL if no buffer is free, or the PHY has no pkt_alloc
+DucknetPkt *ducknet_pkt_alloc(int headroom);
+void ducknet_pkt_free(DucknetPkt *);
+
+// returns: where the n new bytes at the end of the frame go
+inline char *ducknet_pkt_put(DucknetPkt *pkt, int n) {
+	char *p = pkt->data + pkt->len;
+	pkt->len += n;
+	return p;
+}
+
+// returns: where the n new bytes in front of the frame go
+inline char *ducknet_pkt_push(DucknetPkt *pkt, int n) {
+	pkt->data -= n;
+	pkt->len += n;
+	return pkt->data;
+}
+
+// Sends the whole frame; pkt is consumed either way
+int ducknet_phy_send_pkt(DucknetPkt *pkt);
+int ducknet_phy_rx_burst(DucknetPacketRef *, int max);
+void ducknet_phy_rx_release(int n);
 int ducknet_phy_flush();
 
 int ducknet_phy_idle();
 int ducknet_phy_packet_handle(void *pkt, int len);
 
+// rx_time of the frame being handled, for latency accounting in handlers
+ducknet_time_t ducknet_phy_rx_time();
+
 #ifdef __cplusplus
 }
 #endif
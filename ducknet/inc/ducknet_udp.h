@@ -16,7 +16,10 @@ typedef struct {
 	ducknet_u16 checksum;
 } __attribute__((packed)) DucknetUDPHeader;
 
+#define DUCKNET_UDP_MAX_PAYLOAD (DUCKNET_IPv4_MAX_LEN - 20 - 8)
+
 typedef struct {
+	// Datagrams that came in fragments are handed over reassembled
 	int (*packet_handle)(DucknetIPv4Address src, DucknetIPv4Address dst, DucknetUDPHeader *, int);
 } DucknetUDPConfig;
 
@@ -24,8 +27,14 @@ int ducknet_udp_init(const DucknetUDPConfig *);
 
 void ducknet_udp_hton(DucknetUDPHeader *);
 
+// Up to DUCKNET_UDP_MAX_PAYLOAD bytes, see ducknet_ipv4_send
 int ducknet_udp_send(DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 sport, const void *payload, int len);
 
+// Zero-copy: pkt (from ducknet_pkt_alloc with DUCKNET_PKT_HEADROOM) holds
+// the payload, the headers are pushed in front and the buffer goes to the
+// NIC as is, so it has to fit in one frame. pkt is consumed either way.
+int ducknet_udp_send_pkt(DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 sport, DucknetPkt *pkt);
+
 int ducknet_udp_idle();
 int ducknet_udp_packet_handle(DucknetIPv4Address src, DucknetIPv4Address dst, void *pkt, int len);
 
@@ -10,6 +10,7 @@ extern "C" {
 
 typedef struct {
 	ducknet_u64 tsc_freq;
+	int use_avx2;  // the CPU has AVX2 and the OS saves the YMM state
 } DucknetUtilsConfig;
 
 int ducknet_utils_init(const DucknetUtilsConfig *);
@@ -57,11 +58,30 @@ inline ducknet_u64 ducknet_htonll(ducknet_u64 x) {
 		((x & 0x00000000000000ffu) << 56);
 }
 
-// === others ===
+// === checksum ===
 
+// One's complement sums in native byte order, folded to 16 bits, so a few
+// can be added up in a ducknet_u32 and passed as start_sum
 ducknet_u16 ducknet_checksum(const void *a, int count, ducknet_u32 start_sum);
 ducknet_u32 ducknet_checksum_sum(const void *a, int count);
 
+// memcpy that also returns ducknet_checksum_sum(src, count)
+ducknet_u32 ducknet_checksum_copy(void *dst, const void *src, int count);
+
+// The checksum after a 16/32-bit field covered by it changes from old_val
+// to new_val (RFC 1624 eqn. 3), all in the byte order they are stored in
+inline ducknet_u16 ducknet_checksum_update16(ducknet_u16 check, ducknet_u16 old_val, ducknet_u16 new_val) {
+	ducknet_u32 sum = (ducknet_u16) ~check + (ducknet_u16) ~old_val + new_val;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+inline ducknet_u16 ducknet_checksum_update32(ducknet_u16 check, ducknet_u32 old_val, ducknet_u32 new_val) {
+	check = ducknet_checksum_update16(check, old_val >> 16, new_val >> 16);
+	return ducknet_checksum_update16(check, old_val & 0xffff, new_val & 0xffff);
+}
+
 
 #ifdef __cplusplus
 }
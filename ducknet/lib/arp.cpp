@@ -8,33 +8,70 @@
 
 static int (*packet_handle)(DucknetARPHeader *, int);
 
-const int ARP_TABLE_SIZE = 100;
+// Open addressing with linear probing, kept at most 3/4 full
+const int ARP_TABLE_BITS = 7;
+const int ARP_TABLE_SIZE = 1 << ARP_TABLE_BITS;
+const int ARP_TABLE_MAX_ENTRIES = ARP_TABLE_SIZE * 3 / 4;
 const int ARP_EXPIRE_TIMEOUT_MS = 30000;
 const int ARP_QUERY_TIMEOUT_MS = 1000;
 const bool ARP_NEVER_EXPIRE = true;
 
-static struct {
+typedef struct {
 	DucknetIPv4Address ip;
-	DucknetMACAddress mac;
+	DucknetMACAddress mac;  // unused in arp_query_table
+	bool used;
 	ducknet_time_t expire_time;
-} arp_table[ARP_TABLE_SIZE];
+} ArpEntry;
 
+static ArpEntry arp_table[ARP_TABLE_SIZE];
 static int n_arp_entries;
 
-static struct {
-	DucknetIPv4Address ip;
-	ducknet_time_t expire_time;
-} arp_query_table[ARP_TABLE_SIZE];
+// Slot in arp_table of the last lookup that hit, which is the gateway for
+// anything off-link; -1 after a removal may have moved it
+static int last_hit;
 
+static ArpEntry arp_query_table[ARP_TABLE_SIZE];
 static int n_arp_queries;
 
 static ducknet_time_t last_idle_time;
 static ducknet_u64 idle_delay;
 
+static inline int arp_hash(DucknetIPv4Address ip) {
+	return (ip.addr * 0x9e3779b1u) >> (32 - ARP_TABLE_BITS);
+}
+
+// The slot holding ip, or the free one it would go in
+static int arp_find(const ArpEntry *table, DucknetIPv4Address ip) {
+	int i = arp_hash(ip);
+	while (table[i].used && table[i].ip.addr != ip.addr) {
+		i = (i + 1) & (ARP_TABLE_SIZE - 1);
+	}
+	return i;
+}
+
+// Frees slot i, moving back the entries after it that probed past it
+static void arp_remove(ArpEntry *table, int i) {
+	const int mask = ARP_TABLE_SIZE - 1;
+	for (int j = (i + 1) & mask; table[j].used; j = (j + 1) & mask) {
+		int home = arp_hash(table[j].ip);
+		if (((j - i) & mask) <= ((j - home) & mask)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].used = false;
+	if (table == arp_table) {
+		last_hit = -1;
+	}
+}
+
 int ducknet_arp_init(const DucknetARPConfig *conf) {
 	packet_handle = conf->packet_handle;
+	memset(arp_table, 0, sizeof(arp_table));
+	memset(arp_query_table, 0, sizeof(arp_query_table));
 	n_arp_entries = 0;
 	n_arp_queries = 0;
+	last_hit = -1;
 	
 	last_idle_time = ducknet_currenttime;
 	idle_delay = ducknet_tsc_freq * 100 / 1000 / 1000;  // 0.1ms
@@ -69,7 +106,11 @@ int ducknet_arp_send(DucknetMACAddress dst, ducknet_u16 op, const void *payload,
 	return ducknet_phy_send(eth_hdr, len + sizeof(DucknetARPHeader) + sizeof(DucknetEtherHeader));
 }
 
+// Only unanswered queries are swept, ARP entries expire when looked up
 int ducknet_arp_idle() {
+	if (n_arp_queries == 0) {
+		return 0;
+	}
 	static int cnt = 0;
 	if (++cnt < 128 && ducknet_currenttime - last_idle_time <= idle_delay) {
 		return 0;
@@ -77,25 +118,13 @@ int ducknet_arp_idle() {
 	cnt = 0;
 	last_idle_time = ducknet_currenttime;
 	
-	int id;
-	
-	id = 0;
-	for (int i = 0; i < n_arp_entries; i++) {
-		if (!ARP_NEVER_EXPIRE && ducknet_currenttime > arp_table[i].expire_time) {
-			continue;
-		}
-		arp_table[id++] = arp_table[i];
-	}
-	n_arp_entries = id;
-	
-	id = 0;
-	for (int i = 0; i < n_arp_queries; i++) {
-		if (ducknet_currenttime > arp_query_table[i].expire_time) {
-			continue;
+	for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+		// A removal may move a later entry into slot i, so look again
+		while (arp_query_table[i].used && ducknet_currenttime > arp_query_table[i].expire_time) {
+			arp_remove(arp_query_table, i);
+			--n_arp_queries;
 		}
-		arp_query_table[id++] = arp_query_table[i];
 	}
-	n_arp_queries = id;
 	
 	return 0;
 }
@@ -146,66 +175,60 @@ int ducknet_arp_packet_handle(void *pkt, int len) {
 	return -1;
 }
 
+// Also sends whatever was waiting on ip, even if the table is full
 int ducknet_arp_update(DucknetIPv4Address ip, DucknetMACAddress mac) {
-	int l = 0, r = n_arp_entries - 1;
-	while (l < r) {
-		int mid = (l + r) >> 1;
-		if (arp_table[mid].ip.addr < ip.addr) {
-			l = mid + 1;
-		} else {
-			r = mid;
-		}
+	int q = arp_find(arp_query_table, ip);
+	if (arp_query_table[q].used) {
+		arp_remove(arp_query_table, q);
+		--n_arp_queries;
 	}
-	if (l >= n_arp_entries || arp_table[l].ip.addr != ip.addr) {
-		if (n_arp_entries == ARP_TABLE_SIZE) {
+	ducknet_ipv4_arp_resolved(ip, mac);
+	
+	int i = arp_find(arp_table, ip);
+	if (!arp_table[i].used) {
+		if (n_arp_entries == ARP_TABLE_MAX_ENTRIES) {
 			return -1;
 		}
-		memmove(arp_table + (l + 1), arp_table + l, (n_arp_entries - l) * sizeof(arp_table[0]));
 		++n_arp_entries;
 	}
-	arp_table[l] = {
+	arp_table[i] = {
 		.ip = ip,
 		.mac = mac,
+		.used = true,
 		.expire_time = ducknet_time_add_ms(ducknet_currenttime, ARP_EXPIRE_TIMEOUT_MS)
 	};
 	return 0;
 }
 
 int ducknet_arp_lookup(DucknetIPv4Address ip, DucknetMACAddress *mac) {
-	int l = 0, r = n_arp_entries - 1;
-	while (l < r) {
-		int mid = (l + r) >> 1;
-		if (arp_table[mid].ip.addr < ip.addr) {
-			l = mid + 1;
-		} else {
-			r = mid;
+	int i = last_hit;
+	if (i < 0 || arp_table[i].ip.addr != ip.addr) {
+		i = arp_find(arp_table, ip);
+		if (!arp_table[i].used) {
+			return -1;
 		}
 	}
-	if (l >= n_arp_entries || arp_table[l].ip.addr != ip.addr) {
+	if (!ARP_NEVER_EXPIRE && ducknet_currenttime > arp_table[i].expire_time) {
+		arp_remove(arp_table, i);
+		--n_arp_entries;
 		return -1;
 	}
-	*mac = arp_table[l].mac;
+	last_hit = i;
+	*mac = arp_table[i].mac;
 	return 0;
 }
 
 int ducknet_arp_query(DucknetIPv4Address ip) {
-	int l = 0, r = n_arp_queries - 1;
-	while (l < r) {
-		int mid = (l + r) >> 1;
-		if (arp_query_table[mid].ip.addr < ip.addr) {
-			l = mid + 1;
-		} else {
-			r = mid;
-		}
-	}
-	if (l >= n_arp_queries || arp_query_table[l].ip.addr != ip.addr) {
-		if (n_arp_queries == ARP_TABLE_SIZE) {
+	int i = arp_find(arp_query_table, ip);
+	if (!arp_query_table[i].used) {
+		if (n_arp_queries == ARP_TABLE_MAX_ENTRIES) {
 			return -1;
 		}
-		memmove(arp_query_table + (l + 1), arp_query_table + l, (n_arp_queries - l) * sizeof(arp_query_table[0]));
 		++n_arp_queries;
-		arp_query_table[l] = {
+		arp_query_table[i] = {
 			.ip = ip,
+			.mac = {},
+			.used = true,
 			.expire_time = ducknet_time_add_ms(ducknet_currenttime, ARP_QUERY_TIMEOUT_MS)
 		};
 		
@@ -0,0 +1,154 @@
+#include <ducknet_utils.h>
+
+#include <immintrin.h>
+
+#include "ducknet_impl.h"
+
+int ducknet_use_avx2;
+
+// Sums are kept in native byte order; since the one's complement sum is
+// byte order independent, folding a wider sum down to 16 bits gives the
+// same result as adding up 16-bit words one by one.
+
+static inline ducknet_u32 fold64(ducknet_u64 sum) {
+	sum = (sum & 0xffffffffu) + (sum >> 32);
+	sum = (sum & 0xffffffffu) + (sum >> 32);
+	ducknet_u32 s = sum;
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	return s;
+}
+
+static inline ducknet_u64 add_carry(ducknet_u64 sum, ducknet_u64 x) {
+	sum += x;
+	return sum + (sum < x);
+}
+
+static inline ducknet_u64 load64(const char *p) {
+	ducknet_u64 x;
+	memcpy(&x, p, 8);
+	return x;
+}
+
+// Sums 8 bytes at a time, copying them to dst on the way unless it is NULL.
+// Inlined into each caller so the NULL checks fold away.
+static inline __attribute__((always_inline))
+ducknet_u64 sum_scalar(char *dst, const char *src, int count, ducknet_u64 sum) {
+	ducknet_u64 s0 = 0, s1 = 0;
+	
+	for (; count >= 32; count -= 32, src += 32) {
+		ducknet_u64 x0 = load64(src), x1 = load64(src + 8);
+		ducknet_u64 x2 = load64(src + 16), x3 = load64(src + 24);
+		if (dst) {
+			memcpy(dst, &x0, 8);
+			memcpy(dst + 8, &x1, 8);
+			memcpy(dst + 16, &x2, 8);
+			memcpy(dst + 24, &x3, 8);
+			dst += 32;
+		}
+		s0 = add_carry(add_carry(s0, x0), x2);
+		s1 = add_carry(add_carry(s1, x1), x3);
+	}
+	for (; count >= 8; count -= 8, src += 8) {
+		ducknet_u64 x = load64(src);
+		if (dst) {
+			memcpy(dst, &x, 8);
+			dst += 8;
+		}
+		s0 = add_carry(s0, x);
+	}
+	
+	// Zero-padded; the odd trailing byte ends up as the low byte of a
+	// 16-bit word, as in network order it is the high one
+	if (count) {
+		ducknet_u64 x = 0;
+		memcpy(&x, src, count);
+		if (dst) {
+			memcpy(dst, src, count);
+		}
+		s0 = add_carry(s0, x);
+	}
+	
+	return add_carry(add_carry(sum, s0), s1);
+}
+
+// The low and high 16-bit halves of each 32-bit lane go to separate
+// accumulators, which take two adds of at most 0xffff per 64 bytes, so
+// they have to be widened at least every 32768 iterations
+static const int AVX2_MAX_ITERS = 32768;
+
+__attribute__((target("avx2")))
+static ducknet_u64 widen_avx2(__m256i lo, __m256i hi) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i s = _mm256_add_epi64(
+		_mm256_add_epi64(_mm256_unpacklo_epi32(lo, zero), _mm256_unpackhi_epi32(lo, zero)),
+		_mm256_add_epi64(_mm256_unpacklo_epi32(hi, zero), _mm256_unpackhi_epi32(hi, zero)));
+	__m128i t = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+	return (ducknet_u64) _mm_cvtsi128_si64(t) + (ducknet_u64) _mm_extract_epi64(t, 1);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline ducknet_u64 sum_avx2(char *dst, const char *src, int count, ducknet_u64 sum) {
+	const __m256i mask = _mm256_set1_epi32(0xffff);
+	
+	while (count >= 64) {
+		__m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+		int n = count / 64 < AVX2_MAX_ITERS ? count / 64 : AVX2_MAX_ITERS;
+		count -= n * 64;
+		
+		for (; n > 0; n--, src += 64) {
+			__m256i x0 = _mm256_loadu_si256((const __m256i *) src);
+			__m256i x1 = _mm256_loadu_si256((const __m256i *) (src + 32));
+			if (dst) {
+				_mm256_storeu_si256((__m256i *) dst, x0);
+				_mm256_storeu_si256((__m256i *) (dst + 32), x1);
+				dst += 64;
+			}
+			lo = _mm256_add_epi32(lo, _mm256_and_si256(x0, mask));
+			hi = _mm256_add_epi32(hi, _mm256_srli_epi32(x0, 16));
+			lo = _mm256_add_epi32(lo, _mm256_and_si256(x1, mask));
+			hi = _mm256_add_epi32(hi, _mm256_srli_epi32(x1, 16));
+		}
+		
+		sum = add_carry(sum, widen_avx2(lo, hi));
+	}
+	
+	return sum_scalar(dst, src, count, sum);
+}
+
+__attribute__((target("avx2")))
+static ducknet_u64 checksum_avx2(const char *a, int count) {
+	return sum_avx2(NULL, a, count, 0);
+}
+
+__attribute__((target("avx2")))
+static ducknet_u64 checksum_copy_avx2(char *dst, const char *src, int count) {
+	return sum_avx2(dst, src, count, 0);
+}
+
+// Below this the vector setup and reduction outweigh the wider loads
+static const int AVX2_MIN_BYTES = 128;
+
+ducknet_u32 ducknet_checksum_sum(const void *a, int count) {
+	if (ducknet_use_avx2 && count >= AVX2_MIN_BYTES) {
+		return fold64(checksum_avx2((const char *) a, count));
+	}
+	return fold64(sum_scalar(NULL, (const char *) a, count, 0));
+}
+
+ducknet_u32 ducknet_checksum_copy(void *dst, const void *src, int count) {
+	if (ducknet_use_avx2 && count >= AVX2_MIN_BYTES) {
+		return fold64(checksum_copy_avx2((char *) dst, (const char *) src, count));
+	}
+	return fold64(sum_scalar((char *) dst, (const char *) src, count, 0));
+}
+
+ducknet_u16 ducknet_checksum(const void *a, int count, ducknet_u32 sum) {
+	sum += ducknet_checksum_sum(a, count);
+	
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	
+	return ~sum;
+}
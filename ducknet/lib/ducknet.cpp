@@ -3,6 +3,10 @@
 #include "ducknet_impl.h"
 
 static int (*idle)();
+static int rx_burst;
+
+static ducknet_time_t next_idle_time;
+static ducknet_u64 idle_interval;
 
 int ducknet_init(const DucknetConfig *conf) {
 	int r;
@@ -28,6 +32,14 @@ int ducknet_init(const DucknetConfig *conf) {
 		return r;
 	}
 	idle = conf->idle;
+	
+	rx_burst = conf->rx_burst > 0 ? conf->rx_burst : DUCKNET_DEFAULT_RX_BURST;
+	if (rx_burst > DUCKNET_MAX_RX_BURST) {
+		rx_burst = DUCKNET_MAX_RX_BURST;
+	}
+	
+	idle_interval = ducknet_time_add_us(0, DUCKNET_IDLE_INTERVAL_US);
+	next_idle_time = ducknet_currenttime;
 	return 0;
 }
 
@@ -44,16 +56,25 @@ int ducknet_mainloop() {
 	return r;
 }
 
+// One clock read per step: frames in a burst share ducknet_currenttime,
+// and the layer idles (timeouts, retries) only run once their deadline
+// has passed instead of on every frame
 int ducknet_step() {
-	// ducknet idle
 	int r;
-	if ((r = ducknet_idle()) < 0) return r;
+	ducknet_currenttime = ducknet_gettime();
 	
-	// try receive packet
-	static char pkt[MAX_MTU + 64];
-	int len = ducknet_phy_recv(pkt);
-	if (len >= 0) {
-		ducknet_packet_handle(pkt, len);
+	// ducknet idle
+	if (ducknet_currenttime >= next_idle_time) {
+		if ((r = ducknet_idle()) < 0) return r;
+		next_idle_time = ducknet_currenttime + idle_interval;
+	}
+	
+	// receive a burst, handled in place in the driver's buffers
+	DucknetPacketRef pkts[DUCKNET_MAX_RX_BURST];
+	int n = ducknet_phy_rx_burst(pkts, rx_burst);
+	if (n > 0) {
+		ducknet_packet_handle_burst(pkts, n);
+		ducknet_phy_rx_release(n);
 	}
 	
 	// user idle
@@ -91,3 +112,24 @@ int ducknet_idle() {
 int ducknet_packet_handle(void *pkt, int len) {
 	return ducknet_phy_packet_handle(pkt, len);
 }
+
+// The next frame's headers are fetched while this one is handled
+int ducknet_packet_handle_burst(const DucknetPacketRef *pkts, int n) {
+	int handled = 0;
+	for (int i = 0; i < n; i++) {
+		if (i + 1 < n) {
+			__builtin_prefetch(pkts[i + 1].data);
+			__builtin_prefetch((const char *) pkts[i + 1].data + 64);
+		}
+		if (pkts[i].csum & DUCKNET_CSUM_BAD) {
+			continue;
+		}
+		
+		ducknet_rx_time = pkts[i].rx_time;
+		ducknet_packet_handle(pkts[i].data, pkts[i].len);
+		handled++;
+	}
+	ducknet_rx_time = 0;
+	
+	return handled;
+}
@@ -20,11 +20,22 @@ extern int ducknet_MTU;
 
 extern DucknetIPv4Address ducknet_ip;
 
+// Sends the frames waiting on ARP for ip, now that it is at mac
+void ducknet_ipv4_arp_resolved(DucknetIPv4Address ip, DucknetMACAddress mac);
+
+// DUCKNET_CSUM_* left to the NIC, their fields are sent as zero
+extern unsigned ducknet_tx_csum_offload;
+
 // === time ===
 
 extern ducknet_time_t ducknet_currenttime;
+extern ducknet_time_t ducknet_rx_time;  // see ducknet_phy_rx_time
 extern ducknet_u64 ducknet_tsc_freq;
 
+// === checksum ===
+
+extern int ducknet_use_avx2;  // see DucknetUtilsConfig
+
 // === string operations ===
 
 #include <string.h>
@@ -22,11 +22,48 @@ const int TOSEND_TIMEOUT_MS = 5000;
 static struct {
 	DucknetIPv4Address ether_dst_ip;
 	ducknet_time_t expire_time;
+	int next;  // in its pending queue, -1 at the tail
 	int pkt_len;
 	char pkt[MAX_MTU + 64];
 } tosend_table[TOSEND_TABLE_SIZE];
 
-static ducknet_u32 tosend_free[(TOSEND_TABLE_SIZE + 31) >> 5];
+static ducknet_u64 tosend_free[(TOSEND_TABLE_SIZE + 63) >> 6];
+
+// The tosend_table frames waiting on ARP for one next hop, oldest first.
+// Only the few next hops being resolved have one, so they are looked up
+// linearly.
+static struct {
+	DucknetIPv4Address ether_dst_ip;
+	int head, tail;
+} pending[TOSEND_TABLE_SIZE];
+
+static int n_pending;
+
+// Datagrams being reassembled, at most REASS_SLOTS at a time; the one
+// that would expire first makes room for a new one
+const int REASS_SLOTS = 4;
+const int REASS_TIMEOUT_MS = 2000;
+const int REASS_MAX_LEN = DUCKNET_IPv4_MAX_LEN - sizeof(DucknetIPv4Header);
+const int REASS_N_BLOCKS = (REASS_MAX_LEN + 7) / 8;
+// Handlers may write past the end of what they are handed, as there is
+// room for that after a payload in a RX frame
+const int REASS_TAIL_ROOM = 2048;
+
+static struct {
+	bool used;
+	DucknetIPv4Address src, dst;
+	ducknet_u16 id;
+	ducknet_u8 protocol;
+	int total_len;  // -1 until the last fragment is in
+	int n_blocks;   // 8-byte blocks received so far
+	ducknet_time_t expire_time;
+	ducknet_u64 has_block[(REASS_N_BLOCKS + 63) >> 6];
+	char data[REASS_MAX_LEN + REASS_TAIL_ROOM];
+} reass_table[REASS_SLOTS];
+
+static int n_reass;
+
+static ducknet_u16 next_id;
 
 static ducknet_time_t last_idle_time;
 static ducknet_u64 idle_delay;
@@ -39,8 +76,14 @@ int ducknet_ipv4_init(const DucknetIPv4Config *conf) {
 	
 	memset(tosend_free, 0, sizeof(tosend_free));
 	for (int i = 0; i < TOSEND_TABLE_SIZE; i++) {
-		tosend_free[i >> 5] |= 1u << (i & 31);
+		tosend_free[i >> 6] |= 1ull << (i & 63);
+	}
+	n_pending = 0;
+	
+	for (int i = 0; i < REASS_SLOTS; i++) {
+		reass_table[i].used = false;
 	}
+	n_reass = 0;
 	
 	last_idle_time = ducknet_currenttime;
 	idle_delay = ducknet_tsc_freq * 100 / 1000 / 1000;  // 0.1ms
@@ -54,20 +97,14 @@ void ducknet_ipv4_hton(DucknetIPv4Header *hdr) {
 	hdr->ihl = tmp;
 	hdr->length = ducknet_htons(hdr->length);
 	hdr->id = ducknet_htons(hdr->id);
-	hdr->flags = ducknet_htons(hdr->flags);  // fragmentation NOT supported yet
+	hdr->flags = ducknet_htons(hdr->flags);
 	hdr->src.addr = ducknet_htonl(hdr->src.addr);
 	hdr->dst.addr = ducknet_htonl(hdr->dst.addr);
 }
 
-static int ipv4_build_packet(void *pkt, DucknetIPv4Address dst, ducknet_u8 protocol, const void *payload, int len) {
-	if (len < 0) {
-		return -1;
-	}
-	if (len + (int) sizeof(DucknetIPv4Header) > ducknet_MTU) {
-		return -1;
-	}
-	
-	DucknetEtherHeader *eth_hdr = (DucknetEtherHeader *) pkt;
+// Ethernet and IPv4 headers for a len-byte payload right after them;
+// frag holds the flags and offset
+static void ipv4_fill_headers(DucknetEtherHeader *eth_hdr, DucknetIPv4Address dst, ducknet_u8 protocol, int len, ducknet_u16 id, ducknet_u16 frag) {
 	// Not assigning eth dst
 	eth_hdr->src = ducknet_mac;
 	eth_hdr->ethertype = ducknet_htons(DUCKNET_ETHERTYPE_IPv4);
@@ -77,8 +114,8 @@ static int ipv4_build_packet(void *pkt, DucknetIPv4Address dst, ducknet_u8 proto
 	ipv4_hdr->ihl = 5;
 	ipv4_hdr->tos = 0;
 	ipv4_hdr->length = len + sizeof(DucknetIPv4Header);
-	ipv4_hdr->id = 2333;
-	ipv4_hdr->flags = 0;
+	ipv4_hdr->id = id;
+	ipv4_hdr->flags = frag;
 	ipv4_hdr->ttl = 233;
 	ipv4_hdr->protocol = protocol;
 	ipv4_hdr->src = ducknet_ip;
@@ -86,50 +123,57 @@ static int ipv4_build_packet(void *pkt, DucknetIPv4Address dst, ducknet_u8 proto
 	ipv4_hdr->checksum = 0;
 	ducknet_ipv4_hton(ipv4_hdr);
 	
-	ipv4_hdr->checksum = ducknet_checksum(ipv4_hdr, sizeof(DucknetIPv4Header), 0);
-	
-	memcpy(ipv4_hdr + 1, payload, len);
-	
-	return 0;
+	if (!(ducknet_tx_csum_offload & DUCKNET_CSUM_IPv4)) {
+		ipv4_hdr->checksum = ducknet_checksum(ipv4_hdr, sizeof(DucknetIPv4Header), 0);
+	}
 }
 
-static int get_lower_bit_index(ducknet_u32 x) {
-	for (int i = 0; ; i++) {
-		if ((x >> i) & 1) {
-			return i;
+static int find_tosend_free() {
+	for (int i = 0; i < (int) (sizeof(tosend_free) / sizeof(tosend_free[0])); i++) {
+		if (tosend_free[i]) {
+			return (i << 6) | __builtin_ctzll(tosend_free[i]);
 		}
 	}
+	return -1;
 }
 
-static int find_tosend_free() {
+static int count_tosend_free() {
+	int n = 0;
 	for (int i = 0; i < (int) (sizeof(tosend_free) / sizeof(tosend_free[0])); i++) {
-		if (tosend_free[i]) {
-			return (i << 5) | get_lower_bit_index(tosend_free[i]);
+		n += __builtin_popcountll(tosend_free[i]);
+	}
+	return n;
+}
+
+static inline void tosend_release(int id) {
+	tosend_free[id >> 6] |= 1ull << (id & 63);
+}
+
+static int find_pending(DucknetIPv4Address ether_dst) {
+	for (int i = 0; i < n_pending; i++) {
+		if (pending[i].ether_dst_ip.addr == ether_dst.addr) {
+			return i;
 		}
 	}
 	return -1;
 }
 
+static inline void remove_pending(int q) {
+	pending[q] = pending[--n_pending];
+}
+
 static inline bool match_prefix(DucknetIPv4Address a, DucknetIPv4Address b, int prefix_len) {
 	return (ducknet_u64) (a.addr ^ b.addr) >> (32 - prefix_len) == 0;
 }
 
-int ducknet_ipv4_send(DucknetIPv4Address dst, ducknet_u8 protocol, const void *payload, int len) {
-	DucknetIPv4Address real_dst = dst, ether_dst = dst;
-	if (!match_prefix(dst, ducknet_ip, prefix_len)) {
-		ether_dst = gateway_ip;
-	}
-	
-	DucknetMACAddress ether_dst_mac;
-	if (ducknet_arp_lookup(ether_dst, &ether_dst_mac) >= 0) {
-		int r;
-		if ((r = ipv4_build_packet(ducknet_sendbuf, real_dst, protocol, payload, len)) < 0) {
-			return r;
-		}
-		DucknetEtherHeader *eth_hdr = (DucknetEtherHeader *) ducknet_sendbuf;
-		eth_hdr->dst = ether_dst_mac;
-		return ducknet_phy_send(eth_hdr, len + sizeof(DucknetIPv4Header) + sizeof(DucknetEtherHeader));
-	}
+static inline DucknetIPv4Address next_hop(DucknetIPv4Address dst) {
+	return match_prefix(dst, ducknet_ip, prefix_len) ? dst : gateway_ip;
+}
+
+// Takes a tosend_table slot for a pkt_len-byte frame waiting on ARP for
+// ether_dst, queues it behind the others for ether_dst and asks for it
+// returns: the slot, its frame is the caller's to fill in; -1 if full
+static int tosend_add(DucknetIPv4Address ether_dst, int pkt_len) {
 	int r;
 	if ((r = ducknet_arp_query(ether_dst)) < 0) {
 		// Do nothing ???
@@ -138,17 +182,123 @@ int ducknet_ipv4_send(DucknetIPv4Address dst, ducknet_u8 protocol, const void *p
 	if (id == -1) {
 		return -1;
 	}
-	if ((r = ipv4_build_packet(tosend_table[id].pkt, real_dst, protocol, payload, len)) < 0) {
-		return r;
-	}
 	tosend_table[id].ether_dst_ip = ether_dst;  // TODO routing
 	tosend_table[id].expire_time = ducknet_time_add_ms(ducknet_currenttime, TOSEND_TIMEOUT_MS);
-	tosend_table[id].pkt_len = len + sizeof(DucknetIPv4Header) + sizeof(DucknetEtherHeader);
-	tosend_free[id >> 5] &= ~(1u << (id & 31));
-	return 0;
+	tosend_table[id].next = -1;
+	tosend_table[id].pkt_len = pkt_len;
+	tosend_free[id >> 6] &= ~(1ull << (id & 63));
+	
+	int q = find_pending(ether_dst);
+	if (q == -1) {
+		q = n_pending++;
+		pending[q].ether_dst_ip = ether_dst;
+		pending[q].head = id;
+	} else {
+		tosend_table[pending[q].tail].next = id;
+	}
+	pending[q].tail = id;
+	return id;
+}
+
+void ducknet_ipv4_arp_resolved(DucknetIPv4Address ip, DucknetMACAddress mac) {
+	int q = find_pending(ip);
+	if (q == -1) {
+		return;
+	}
+	int head = pending[q].head;
+	remove_pending(q);
+	for (int id = head; id != -1; id = tosend_table[id].next) {
+		tosend_release(id);
+		DucknetEtherHeader *eth_hdr = (DucknetEtherHeader *) tosend_table[id].pkt;
+		eth_hdr->dst = mac;
+		ducknet_phy_send(eth_hdr, tosend_table[id].pkt_len);
+	}
+}
+
+int ducknet_ipv4_send(DucknetIPv4Address dst, ducknet_u8 protocol, const void *payload, int len) {
+	if (len < 0 || len + (int) sizeof(DucknetIPv4Header) > DUCKNET_IPv4_MAX_LEN) {
+		return -1;
+	}
+	DucknetIPv4Address ether_dst = next_hop(dst);
+	DucknetMACAddress ether_dst_mac;
+	bool resolved = ducknet_arp_lookup(ether_dst, &ether_dst_mac) >= 0;
+	
+	// All fragments but the last carry a multiple of 8 bytes
+	const int max_frag_len = (ducknet_MTU - (int) sizeof(DucknetIPv4Header)) & ~7;
+	const ducknet_u16 id = next_id++;
+	int r = 0;
+	
+	// Queue either all fragments or none; a part would still go out once
+	// ARP is resolved, only to be dropped by the receiver
+	const int n_frags = len == 0 ? 1 : (len + max_frag_len - 1) / max_frag_len;
+	if (!resolved && count_tosend_free() < n_frags) {
+		ducknet_arp_query(ether_dst);
+		return -1;
+	}
+	
+	for (int off = 0; off == 0 || off < len; off += max_frag_len) {
+		int frag_len = len - off < max_frag_len ? len - off : max_frag_len;
+		ducknet_u16 frag = (off >> 3) | (off + frag_len < len ? DUCKNET_IPv4_FLAGS_MF : 0);
+		int pkt_len = frag_len + sizeof(DucknetIPv4Header) + sizeof(DucknetEtherHeader);
+		
+		char *pkt = ducknet_sendbuf;
+		if (!resolved) {
+			int slot = tosend_add(ether_dst, pkt_len);
+			if (slot == -1) {
+				return -1;
+			}
+			pkt = tosend_table[slot].pkt;
+		}
+		
+		DucknetEtherHeader *eth_hdr = (DucknetEtherHeader *) pkt;
+		ipv4_fill_headers(eth_hdr, dst, protocol, frag_len, id, frag);
+		memcpy(pkt + sizeof(DucknetEtherHeader) + sizeof(DucknetIPv4Header), (const char *) payload + off, frag_len);
+		
+		if (resolved) {
+			eth_hdr->dst = ether_dst_mac;
+			if ((r = ducknet_phy_send(eth_hdr, pkt_len)) < 0) {
+				return r;
+			}
+		}
+	}
+	return r;
+}
+
+// The headers go in front of the payload in place; only a frame that has
+// to wait on ARP is copied, into tosend_table
+int ducknet_ipv4_send_pkt(DucknetIPv4Address dst, ducknet_u8 protocol, DucknetPkt *pkt) {
+	int len = pkt->len;
+	if (len + (int) sizeof(DucknetIPv4Header) > ducknet_MTU) {
+		ducknet_pkt_free(pkt);
+		return -1;
+	}
+	
+	DucknetEtherHeader *eth_hdr = (DucknetEtherHeader *) ducknet_pkt_push(pkt,
+		sizeof(DucknetEtherHeader) + sizeof(DucknetIPv4Header));
+	ipv4_fill_headers(eth_hdr, dst, protocol, len, next_id++, 0);
+	
+	DucknetIPv4Address ether_dst = next_hop(dst);
+	DucknetMACAddress ether_dst_mac;
+	if (ducknet_arp_lookup(ether_dst, &ether_dst_mac) >= 0) {
+		eth_hdr->dst = ether_dst_mac;
+		return ducknet_phy_send_pkt(pkt);
+	}
+	
+	int id = tosend_add(ether_dst, pkt->len);
+	if (id != -1) {
+		memcpy(tosend_table[id].pkt, pkt->data, pkt->len);
+	}
+	ducknet_pkt_free(pkt);
+	return id == -1 ? -1 : 0;
 }
 
+// Frames are sent as soon as their ARP reply comes in, see
+// ducknet_ipv4_arp_resolved; this drops the ones that waited too long and
+// asks again for the rest, and drops stale partial datagrams
 int ducknet_ipv4_idle() {
+	if (n_pending == 0 && n_reass == 0) {
+		return 0;
+	}
 	static int cnt = 0;
 	if (++cnt < 1024 && ducknet_currenttime - last_idle_time <= idle_delay) {
 		return 0;
@@ -156,27 +306,131 @@ int ducknet_ipv4_idle() {
 	cnt = 0;
 	last_idle_time = ducknet_currenttime;
 	
-	for (int i = 0; i < TOSEND_TABLE_SIZE; i++) {
-		if (tosend_free[i >> 5] & (1u << (i & 31))) {
-			continue;
+	for (int q = n_pending - 1; q >= 0; q--) {
+		// Queued in order with the same timeout, so they expire in order
+		int id = pending[q].head;
+		while (id != -1 && ducknet_currenttime > tosend_table[id].expire_time) {
+			tosend_release(id);
+			id = tosend_table[id].next;
 		}
-		if (ducknet_currenttime > tosend_table[i].expire_time) {
-			tosend_free[i >> 5] |= 1u << (i & 31);
-			continue;
-		}
-		DucknetMACAddress ether_dst_mac;
-		if (ducknet_arp_lookup(tosend_table[i].ether_dst_ip, &ether_dst_mac) >= 0) {
-			tosend_free[i >> 5] |= 1u << (i & 31);
-			DucknetEtherHeader *eth_hdr = (DucknetEtherHeader *) tosend_table[i].pkt;
-			eth_hdr->dst = ether_dst_mac;
-			ducknet_phy_send(eth_hdr, tosend_table[i].pkt_len);
+		pending[q].head = id;
+		if (id == -1) {
+			remove_pending(q);
 		} else {
-			ducknet_arp_query(tosend_table[i].ether_dst_ip);
+			ducknet_arp_query(pending[q].ether_dst_ip);
+		}
+	}
+	
+	for (int i = 0; i < REASS_SLOTS; i++) {
+		if (reass_table[i].used && ducknet_currenttime > reass_table[i].expire_time) {
+			reass_table[i].used = false;
+			--n_reass;
 		}
 	}
 	return 0;
 }
 
+// The slot for hdr's datagram, a fresh one if it is the first fragment seen
+static int reass_find(const DucknetIPv4Header *hdr) {
+	int victim = -1;
+	for (int i = 0; i < REASS_SLOTS; i++) {
+		if (!reass_table[i].used) {
+			if (victim == -1 || reass_table[victim].used) {
+				victim = i;
+			}
+			continue;
+		}
+		if (reass_table[i].id == hdr->id && reass_table[i].protocol == hdr->protocol
+			&& reass_table[i].src.addr == hdr->src.addr && reass_table[i].dst.addr == hdr->dst.addr) {
+			return i;
+		}
+		if (victim == -1 || (reass_table[victim].used && reass_table[i].expire_time < reass_table[victim].expire_time)) {
+			victim = i;
+		}
+	}
+	
+	if (!reass_table[victim].used) {
+		++n_reass;
+	}
+	reass_table[victim].used = true;
+	reass_table[victim].src = hdr->src;
+	reass_table[victim].dst = hdr->dst;
+	reass_table[victim].id = hdr->id;
+	reass_table[victim].protocol = hdr->protocol;
+	reass_table[victim].total_len = -1;
+	reass_table[victim].n_blocks = 0;
+	reass_table[victim].expire_time = ducknet_time_add_ms(ducknet_currenttime, REASS_TIMEOUT_MS);
+	memset(reass_table[victim].has_block, 0, sizeof(reass_table[victim].has_block));
+	return victim;
+}
+
+// Whether any block from b on was received
+static bool reass_has_blocks_from(int i, int b) {
+	const int n_words = sizeof(reass_table[i].has_block) / sizeof(reass_table[i].has_block[0]);
+	for (int w = b >> 6; w < n_words; w++) {
+		ducknet_u64 bits = reass_table[i].has_block[w];
+		if (w == b >> 6) {
+			bits &= ~0ull << (b & 63);
+		}
+		if (bits) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Puts a len-byte fragment in place, overlaps overwrite what came before
+// returns: the slot holding the whole datagram once this completes it,
+//          the caller frees it; -1 otherwise
+static int reass_add(const DucknetIPv4Header *hdr, const char *payload, int len) {
+	int off = (hdr->flags & DUCKNET_IPv4_OFFSET_MASK) << 3;
+	bool more = hdr->flags & DUCKNET_IPv4_FLAGS_MF;
+	if (more && (len == 0 || (len & 7))) return -1;
+	if (off + len > REASS_MAX_LEN) return -1;
+	
+	int i = reass_find(hdr);
+	if (!more) {
+		if (reass_table[i].total_len != -1 && reass_table[i].total_len != off + len) return -1;
+		// A fragment that came earlier lies past the end, and its blocks
+		// would count towards the ones the datagram needs
+		if (reass_table[i].total_len == -1 && reass_has_blocks_from(i, (off + len + 7) >> 3)) {
+			reass_table[i].used = false;
+			--n_reass;
+			return -1;
+		}
+		reass_table[i].total_len = off + len;
+	} else if (reass_table[i].total_len != -1 && off + len > reass_table[i].total_len) {
+		return -1;
+	}
+	
+	memcpy(reass_table[i].data + off, payload, len);
+	for (int b = off >> 3; b < (off + len + 7) >> 3; b++) {
+		ducknet_u64 bit = 1ull << (b & 63);
+		if (!(reass_table[i].has_block[b >> 6] & bit)) {
+			reass_table[i].has_block[b >> 6] |= bit;
+			++reass_table[i].n_blocks;
+		}
+	}
+	
+	if (reass_table[i].total_len == -1 || reass_table[i].n_blocks < (reass_table[i].total_len + 7) >> 3) {
+		return -1;
+	}
+	return i;
+}
+
+static int ipv4_deliver(DucknetIPv4Address src, DucknetIPv4Address dst, ducknet_u8 protocol, void *payload, int len) {
+	switch (protocol) {
+		case DUCKNET_IPv4_ICMP:
+			return ducknet_icmp_packet_handle(src, dst, payload, len);
+		case DUCKNET_IPv4_UDP:
+			return ducknet_udp_packet_handle(src, dst, payload, len);
+		// case DUCKNET_IPv4_TCP:
+		// 	return ducknet_tcp_packet_handle(src, dst, payload, len);
+		default:
+			return -1;
+	}
+}
+
 int ducknet_ipv4_packet_handle(void *pkt, int len) {
 	if (len < (int) sizeof(DucknetIPv4Header)) return -1;
 	DucknetIPv4Header *hdr = (DucknetIPv4Header *) pkt;
@@ -189,21 +443,25 @@ int ducknet_ipv4_packet_handle(void *pkt, int len) {
 	if (hdr->ihl != 5) return -1;  // TODO support ihl > 5
 	// No tos checking
 	if (hdr->length > (unsigned) len) return -1;
-	if ((hdr->flags & ~DUCKNET_IPv4_FLAGS_DF) != 0) return -1;  // TODO support fragmentation
+	if (hdr->length < sizeof(DucknetIPv4Header)) return -1;
+	if (hdr->flags & ~(DUCKNET_IPv4_FLAGS_DF | DUCKNET_IPv4_FLAGS_MF | DUCKNET_IPv4_OFFSET_MASK)) return -1;
 	if (!(~hdr->dst.addr == 0 || hdr->dst.addr == ducknet_ip.addr)) {
 		return -1;
 	}
 	int content_len = hdr->length - (int) sizeof(DucknetIPv4Header);
-	switch (hdr->protocol) {
-		case DUCKNET_IPv4_ICMP:
-			return ducknet_icmp_packet_handle(hdr->src, hdr->dst, hdr + 1, content_len);
-		case DUCKNET_IPv4_UDP:
-			return ducknet_udp_packet_handle(hdr->src, hdr->dst, hdr + 1, content_len);
-		// case DUCKNET_IPv4_TCP:
-		// 	return ducknet_tcp_packet_handle(hdr->src, hdr->dst, hdr + 1, content_len);
-		default:
+	
+	if (hdr->flags & (DUCKNET_IPv4_FLAGS_MF | DUCKNET_IPv4_OFFSET_MASK)) {
+		int i = reass_add(hdr, (const char *) (hdr + 1), content_len);
+		if (i == -1) {
 			return -1;
+		}
+		int r = ipv4_deliver(hdr->src, hdr->dst, hdr->protocol, reass_table[i].data, reass_table[i].total_len);
+		reass_table[i].used = false;
+		--n_reass;
+		return r;
 	}
+	
+	return ipv4_deliver(hdr->src, hdr->dst, hdr->protocol, hdr + 1, content_len);
 }
 
 int ducknet_parse_ipv4(const char *s, DucknetIPv4Address *addr) {
@@ -2,8 +2,12 @@
 #include <ducknet_ether.h>
 #include "ducknet_impl.h"
 
-static int (*send)(const void *, int);
-static int (*recv)(void *);
+static int (*send)(const void *, int, unsigned);
+static DucknetPkt *(*pkt_alloc)(int);
+static int (*pkt_send)(DucknetPkt *);
+static void (*pkt_free)(DucknetPkt *);
+static int (*rx_burst)(DucknetPacketRef *, int);
+static void (*rx_release)(int);
 static int (*flush)();
 static int (*packet_handle)(void *, int);
 static int (*send_packet_handle)(const void *, int);
@@ -12,9 +16,17 @@ static bool flushed;
 static ducknet_time_t last_flush_time;
 static ducknet_u64 flush_delay;
 
+unsigned ducknet_tx_csum_offload;
+ducknet_time_t ducknet_rx_time;
+
 int ducknet_phy_init(const DucknetPhyConfig *conf) {
 	send = conf->send;
-	recv = conf->recv;
+	pkt_alloc = conf->pkt_alloc;
+	pkt_send = conf->pkt_send;
+	pkt_free = conf->pkt_free;
+	ducknet_tx_csum_offload = conf->tx_csum_offload;
+	rx_burst = conf->rx_burst;
+	rx_release = conf->rx_release;
 	flush = conf->flush;
 	flushed = false;
 	last_flush_time = ducknet_currenttime;
@@ -31,11 +43,37 @@ int ducknet_phy_send(const void *a, int len) {
 	}
 	
 	flushed = false;
-	return send ? send(a, len) : -1;
+	return send ? send(a, len, ducknet_tx_csum_offload) : -1;
+}
+
+DucknetPkt *ducknet_pkt_alloc(int headroom) {
+	return pkt_alloc ? pkt_alloc(headroom) : NULL;
 }
 
-int ducknet_phy_recv(void *a) {
-	return recv ? recv(a) : -1;
+void ducknet_pkt_free(DucknetPkt *pkt) {
+	pkt_free(pkt);
+}
+
+int ducknet_phy_send_pkt(DucknetPkt *pkt) {
+	int r;
+	if (send_packet_handle && (r = send_packet_handle(pkt->data, pkt->len)) < 0) {
+		pkt_free(pkt);
+		return r;
+	}
+	
+	flushed = false;
+	pkt->csum = ducknet_tx_csum_offload;
+	return pkt_send(pkt);
+}
+
+int ducknet_phy_rx_burst(DucknetPacketRef *pkts, int max) {
+	return rx_burst ? rx_burst(pkts, max) : 0;
+}
+
+void ducknet_phy_rx_release(int n) {
+	if (rx_release) {
+		rx_release(n);
+	}
 }
 
 int ducknet_phy_flush() {
@@ -60,6 +98,10 @@ int ducknet_phy_idle() {
 	return 0;
 }
 
+ducknet_time_t ducknet_phy_rx_time() {
+	return ducknet_rx_time;
+}
+
 int ducknet_phy_packet_handle(void *pkt, int len) {
 	int r;
 	if (packet_handle && (r = packet_handle(pkt, len)) < 0) {
@@ -1,5 +1,6 @@
 #include <ducknet_udp.h>
 #include <ducknet_ipv4.h>
+#include <ducknet_phy.h>
 
 #include "ducknet_impl.h"
 
@@ -16,21 +17,26 @@ void ducknet_udp_hton(DucknetUDPHeader *hdr) {
 	hdr->length = ducknet_htons(hdr->length);
 }
 
-int ducknet_udp_send(DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 sport, const void *payload, int len) {
-	if (len < 0) {
-		return -1;
-	}
-	if (len + (int) sizeof(DucknetUDPHeader) + (int) sizeof(DucknetIPv4Header) > ducknet_MTU) {
-		return -1;
-	}
-	static char buf[MAX_MTU + 64];
-	DucknetUDPHeader *hdr = (DucknetUDPHeader *) buf;
+// The NIC can only fill in the checksum of a datagram that fits in one
+// frame, as it covers all of the fragments
+static inline bool udp_csum_offload(int len) {
+	return (ducknet_tx_csum_offload & DUCKNET_CSUM_L4)
+		&& len + (int) sizeof(DucknetUDPHeader) + (int) sizeof(DucknetIPv4Header) <= ducknet_MTU;
+}
+
+// The header in front of a len-byte payload summing to payload_sum (see
+// ducknet_checksum_sum), checksum included unless the NIC fills it in
+static void udp_fill_header(DucknetUDPHeader *hdr, DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 sport, int len, ducknet_u32 payload_sum) {
 	hdr->sport = sport;
 	hdr->dport = dport;
 	hdr->length = len + sizeof(DucknetUDPHeader);
 	hdr->checksum = 0;
 	ducknet_udp_hton(hdr);
-	memcpy(hdr + 1, payload, len);
+	
+	int udp_len = len + sizeof(DucknetUDPHeader);
+	if (udp_csum_offload(len)) {
+		return;
+	}
 	
 	struct {
 		DucknetIPv4Address src, dst;
@@ -39,18 +45,53 @@ int ducknet_udp_send(DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 spor
 		ducknet_u16 length;
 	} __attribute__((packed)) ph;
 	
-	int udp_len = len + sizeof(DucknetUDPHeader);
-	
 	ph.src.addr = ducknet_htonl(ducknet_ip.addr);
 	ph.dst.addr = ducknet_htonl(dst.addr);
 	ph.zeros = 0;
 	ph.protocol = DUCKNET_IPv4_UDP;
 	ph.length = ducknet_htons(udp_len);
 	
-	ducknet_u32 tmp_sum = ducknet_checksum_sum(&ph, sizeof(ph));
-	hdr->checksum = ducknet_checksum(hdr, udp_len, tmp_sum);
+	ducknet_u32 tmp_sum = ducknet_checksum_sum(&ph, sizeof(ph)) + payload_sum;
+	hdr->checksum = ducknet_checksum(hdr, sizeof(DucknetUDPHeader), tmp_sum);
+	if (hdr->checksum == 0) {
+		hdr->checksum = 0xffff;  // zero means none was computed
+	}
+}
+
+int ducknet_udp_send(DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 sport, const void *payload, int len) {
+	if (len < 0) {
+		return -1;
+	}
+	if (len > DUCKNET_UDP_MAX_PAYLOAD) {
+		return -1;
+	}
+	static char buf[sizeof(DucknetUDPHeader) + DUCKNET_UDP_MAX_PAYLOAD];
+	DucknetUDPHeader *hdr = (DucknetUDPHeader *) buf;
+	ducknet_u32 payload_sum = 0;
+	if (udp_csum_offload(len)) {
+		memcpy(hdr + 1, payload, len);
+	} else {
+		payload_sum = ducknet_checksum_copy(hdr + 1, payload, len);
+	}
+	udp_fill_header(hdr, dst, dport, sport, len, payload_sum);
+	
+	return ducknet_ipv4_send(dst, DUCKNET_IPv4_UDP, hdr, len + sizeof(DucknetUDPHeader));
+}
+
+int ducknet_udp_send_pkt(DucknetIPv4Address dst, ducknet_u16 dport, ducknet_u16 sport, DucknetPkt *pkt) {
+	int len = pkt->len;
+	if (len + (int) sizeof(DucknetUDPHeader) + (int) sizeof(DucknetIPv4Header) > ducknet_MTU) {
+		ducknet_pkt_free(pkt);
+		return -1;
+	}
+	ducknet_u32 payload_sum = 0;
+	if (!udp_csum_offload(len)) {
+		payload_sum = ducknet_checksum_sum(pkt->data, len);
+	}
+	DucknetUDPHeader *hdr = (DucknetUDPHeader *) ducknet_pkt_push(pkt, sizeof(DucknetUDPHeader));
+	udp_fill_header(hdr, dst, dport, sport, len, payload_sum);
 	
-	return ducknet_ipv4_send(dst, DUCKNET_IPv4_UDP, hdr, udp_len);
+	return ducknet_ipv4_send_pkt(dst, DUCKNET_IPv4_UDP, pkt);
 }
 
 int ducknet_udp_idle() {
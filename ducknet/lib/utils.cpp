@@ -9,6 +9,7 @@ int ducknet_utils_init(const DucknetUtilsConfig *conf) {
 		return -1;
 	}
 	tsc_freq = conf->tsc_freq;
+	ducknet_use_avx2 = conf->use_avx2;
 	ducknet_tsc_freq = tsc_freq;
 	ducknet_currenttime = ducknet_gettime();
 	return 0;
@@ -20,9 +21,9 @@ int ducknet_utils_idle() {
 }
 
 ducknet_time_t ducknet_gettime() {
-	ducknet_u64 ret;
-	__asm__ volatile ("rdtsc" : "=A"(ret));
-	return ret;
+	ducknet_u32 lo, hi;
+	__asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((ducknet_u64) hi << 32) | lo;
 }
 
 static inline ducknet_u64 mul_div(ducknet_u64 a, ducknet_u64 b, ducknet_u64 d) {
@@ -64,29 +65,3 @@ ducknet_u64 ducknet_time_to_ms(ducknet_time_t t) {
 ducknet_u64 ducknet_time_to_sec(ducknet_time_t t) {
 	return t / tsc_freq;
 }
-
-ducknet_u32 ducknet_checksum_sum(const void *a, int count) {
-	ducknet_u32 sum = 0;
-	
-	while (count > 1) {
-		sum += *(ducknet_u16 *) a;
-		a = ((char *) a) + 2;
-		count -= 2;
-	}
-	
-	if (count) {
-		sum += *(ducknet_u8 *) a;
-	}
-	
-	return sum;
-}
-
-ducknet_u16 ducknet_checksum(const void *a, int count, ducknet_u32 sum) {
-	sum += ducknet_checksum_sum(a, count);
-	
-	while (sum >> 16) {
-		sum = (sum & 0xffff) + (sum >> 16);
-	}
-	
-	return ~sum;
-}
@@ -0,0 +1,35 @@
+#ifndef DUCK_CONSOLE_RING_H
+#define DUCK_CONSOLE_RING_H
+
+#include <stdint.h>
+
+// Deferred console output: producers push binary records, and the slow
+// part (formatting, VGA / serial) runs later from drain_one(), when the
+// main loop has nothing better to do.
+namespace ConsoleRing {
+	// Renders one record; tsc is when it was pushed
+	typedef void (*Formatter)(uint64_t tsc, const void *data, int len);
+	
+	struct Stats {
+		uint64_t size;        // ring bytes
+		uint64_t used;        // bytes waiting to be drained
+		uint64_t high_water;  // max of used
+		uint64_t n_records;   // pushed
+		uint64_t n_dropped;   // ring full
+	};
+	
+	// Off by default: push() then formats right away
+	void set_deferred(bool deferred);
+	
+	// Copies data into the ring; false (and counted) if it is full
+	bool push(Formatter format, const void *data, int len);
+	
+	// Formats the oldest record, if any
+	bool drain_one();
+	
+	void flush();
+	
+	Stats get_stats();
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef DUCK_CPU_H
+#define DUCK_CPU_H
+
+namespace CPU {
+	extern bool has_avx2;
+	extern bool has_avx512f;
+	
+	// Detect CPU features, and enable AVX / AVX-512 state in XCR0 if present
+	void init();
+}
+
+#endif
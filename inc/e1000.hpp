@@ -3,17 +3,34 @@
 
 #include <stdint.h>
 
+#include <inc/network_driver.hpp>
+
 namespace e1000 {
 	bool init(uint8_t mac[6]);
 	
+	// returns: NetworkDriver::CSUM_* the NIC offloads, both ways
+	uint32_t csum_offload();
+	
 	// returns: # of bytes sent
-	int send(const void *buf, int len);
+	int send_sg(const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	
+	// returns: # of frames
+	int rx_burst(NetworkDriver::PacketRef *pkts, int max);
 	
-	// returns: # of bytes received
-	int receive(void *buf);
+	void rx_release(int n);
 	
 	// returns: zero
 	int flush();
+	
+	// Whether the NIC got an MSI/MSI-X to Trap::TRAP_WAKEUP, see
+	// NetworkDriver::rx_wakeup_arm
+	bool has_rx_wakeup();
+	bool rx_wakeup_arm();
+	void rx_wakeup_disarm();
+	
+	// See NetworkDriver::rx_wait_addr
+	const volatile uint32_t *rx_wait_addr();
 }
 
 #endif
@@ -0,0 +1,56 @@
+#ifndef DUCK_HISTOGRAM_H
+#define DUCK_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Log-linear histogram of TSC deltas, HDR style: values below 2^SUB_BITS
+// get a bucket each, above that every power of two is split into
+// 2^SUB_BITS linear buckets (~6% relative error). Fixed memory, and
+// recording is a clz and an increment.
+struct Histogram {
+	static const int SUB_BITS = 4;
+	static const int SUB_COUNT = 1 << SUB_BITS;
+	static const int N_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+	
+	uint32_t counts[N_BUCKETS];
+	uint64_t total, max;
+	
+	static int bucket_of(uint64_t v) {
+		if (v < (uint64_t) SUB_COUNT) return v;
+		int e = 63 - __builtin_clzll(v);
+		return (e - SUB_BITS + 1) * SUB_COUNT + ((v >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+	}
+	
+	// Largest value that lands in bucket b
+	static uint64_t bucket_high(int b) {
+		if (b < SUB_COUNT) return b;
+		int e = b / SUB_COUNT + SUB_BITS - 1;
+		uint64_t low = (uint64_t) (SUB_COUNT + b % SUB_COUNT) << (e - SUB_BITS);
+		return low + (1ull << (e - SUB_BITS)) - 1;
+	}
+	
+	void add(uint64_t v) {
+		counts[bucket_of(v)]++;
+		total++;
+		if (v > max) max = v;
+	}
+	
+	uint64_t percentile(double q) const {
+		if (total == 0) return 0;
+		
+		uint64_t rank = (uint64_t) (q * total);
+		if (rank >= total) rank = total - 1;
+		
+		uint64_t seen = 0;
+		for (int b = 0; b < N_BUCKETS; b++) {
+			seen += counts[b];
+			if (seen > rank) {
+				uint64_t v = bucket_high(b);
+				return v < max ? v : max;
+			}
+		}
+		return max;
+	}
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef DUCK_IGB_H
+#define DUCK_IGB_H
+
+#include <stdint.h>
+
+#include <inc/network_driver.hpp>
+
+// Intel 82576 (QEMU's -device igb)
+namespace igb {
+	bool init(uint8_t mac[6]);
+	
+	// returns: NetworkDriver::CSUM_* the NIC offloads, both ways
+	uint32_t csum_offload();
+	
+	// # of RX/TX queue pairs in use
+	int n_queue_pairs();
+	
+	// returns: # of bytes sent
+	int send_sg_q(int queue, const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	
+	// returns: # of frames
+	int rx_burst_q(int queue, NetworkDriver::PacketRef *pkts, int max);
+	
+	void rx_release_q(int queue, int n);
+	
+	// returns: false if the filters for this kind of match are used up
+	bool steer(const NetworkDriver::FlowMatch &match, int queue);
+	
+	// The calls above on queue 0
+	int send_sg(const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	int rx_burst(NetworkDriver::PacketRef *pkts, int max);
+	void rx_release(int n);
+	
+	// Pushes out every TX queue
+	// returns: zero
+	int flush();
+	
+	// Whether the NIC got an MSI/MSI-X to Trap::TRAP_WAKEUP, see
+	// NetworkDriver::rx_wakeup_arm
+	bool has_rx_wakeup();
+	bool rx_wakeup_arm();
+	void rx_wakeup_disarm();
+	
+	// See NetworkDriver::rx_wait_addr
+	const volatile uint32_t *rx_wait_addr();
+}
+
+#endif
@@ -10,6 +10,9 @@ namespace LAPIC {
 	void timer_single_shot_ns(uint64_t ns);
 	void timer_periodic_ns(uint64_t ns, uint64_t cnt);
 	void eoi();
+	
+	// returns: APIC ID of this CPU, where MSIs are sent
+	uint8_t id();
 }
 
 #endif
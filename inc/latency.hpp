@@ -0,0 +1,34 @@
+#ifndef DUCK_LATENCY_H
+#define DUCK_LATENCY_H
+
+#include <stdint.h>
+
+// Where an answered frame's time goes, from the driver taking it off the
+// RX ring to the NIC being told about the answer. Each stage is recorded
+// by whoever sees both of its ends, in TSC ticks.
+namespace Latency {
+	enum Stage {
+		DRIVER,    // PacketRef::rx_tsc -> the stack gets the frame
+		STACK,     // -> the application gets the payload
+		APP,       // -> the application hands over its answer
+		TX_BUILD,  // -> the answer's descriptors are in the TX ring
+		DOORBELL,  // -> the NIC is told
+		TOTAL,     // PacketRef::rx_tsc -> the NIC is told
+		N_STAGES
+	};
+	
+	void add(Stage stage, uint64_t tsc);
+	
+	// Records TX_BUILD, DOORBELL and TOTAL from NetworkDriver::last_tx, for
+	// an answer to a frame stamped rx_tsc that was handed over at send_tsc.
+	// Nothing is recorded if it did not reach the TX ring.
+	void add_tx(uint64_t rx_tsc, uint64_t send_tsc);
+	
+	// One line per stage with its percentiles in us, NUL-terminated
+	// returns: the length written
+	int format(char *buf, int size);
+	
+	void reset();
+}
+
+#endif
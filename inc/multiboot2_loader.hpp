@@ -1,10 +1,22 @@
 #ifndef MULTIBOOT2_LOADER_H
 #define MULTIBOOT2_LOADER_H
 
+#include <stdint.h>
+
 namespace Multiboot2_Loader {
 	extern const char *command_line;
 	
+	// GRUB "module2 <file> <cmdline>", physical addresses [start, end),
+	// access the content through Memory::remap()
+	struct Module {
+		uint64_t start, end;
+		char cmdline[64];
+	};
+	
 	void load();
+	
+	// Returns NULL if no module has this word in its cmdline
+	const Module * find_module(const char *cmdline);
 }
 
 #endif
@@ -13,14 +13,152 @@ namespace NetworkDriver {
 	
 	void init();
 	
+	// ===== Checksum offload =====
+	const uint32_t CSUM_IPv4 = 1u << 0;  // IPv4 header checksum
+	const uint32_t CSUM_L4 = 1u << 1;    // TCP/UDP checksum over IPv4
+	const uint32_t CSUM_BAD = 1u << 2;   // RX only: the NIC found a wrong one
+	
+	// CSUM_* the NIC fills in on send / verifies on receive, set by init
+	extern uint32_t tx_csum_offload;
+	extern uint32_t rx_csum_offload;
+	
+	// A received frame, in place in the driver's receive buffer
+	struct PacketRef {
+		void *data;
+		int len;
+		uint32_t csum;  // CSUM_* the NIC verified to be correct, or CSUM_BAD
+		uint64_t rx_tsc;  // Timer::get_tsc() when rx_burst took it off the ring
+	};
+	
+	// A piece of a frame the NIC reads in place. Kernel memory is identity
+	// mapped, so the pointer is also the DMA address.
+	struct Fragment {
+		const void *data;
+		int len;
+	};
+	
+	const int MAX_FRAGMENTS = 8;
+	const int MAX_FRAME_LEN = 1514;
+	
+	// Sends one frame gathered from n fragments without copying them.
+	// done(arg) runs once the NIC has read them, from a later send or flush;
+	// it is not called when the send fails.
+	// csum asks the NIC to fill in those of tx_csum_offload that apply to
+	// the frame; the headers up to the TCP/UDP one must be in frags[0].
+	// returns: # of bytes sent, -1 if the TX ring is full
+	extern int (*send_sg)(const Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	
+	// When the last send put its descriptors in a TX ring, and when the NIC
+	// was last told about new ones (tail write or kick; a kick that virtio
+	// event suppression skips counts too), in Timer::get_tsc() ticks
+	struct TxStamps {
+		uint64_t post_tsc;
+		uint64_t doorbell_tsc;
+	};
+	
+	extern TxStamps last_tx;
+	
+	// ===== TX buffers =====
+	// Frames are built back to front: alloc with enough headroom, write the
+	// payload at data, then every layer push()es its header in front.
+	const int TX_BUFFER_SIZE = 2048;
+	
+	// data, len and csum lead, so ducknet's DucknetPkt can view the buffer
+	struct TxBuffer {
+		char *data;
+		int len;
+		uint32_t csum;  // passed to send_sg, zero after tx_alloc
+		TxBuffer *next_free;
+		char mem[TX_BUFFER_SIZE] __attribute__((aligned(64)));
+		
+		// returns: where the n new bytes in front of the frame go
+		char *push(int n) {
+			data -= n;
+			len += n;
+			return data;
+		}
+		
+		// returns: where the n new bytes at the end of the frame go
+		char *put(int n) {
+			char *p = data + len;
+			len += n;
+			return p;
+		}
+	} __attribute__((aligned(64)));
+	
+	// returns: NULL if every buffer is in flight
+	TxBuffer *tx_alloc(int headroom);
+	void tx_free(TxBuffer *buf);
+	
+	// Sends data[0 .. len). The buffer goes back to the pool once the NIC
+	// is done with it, or right away if the send fails.
+	// returns: # of bytes sent
+	int tx_send(TxBuffer *buf);
+	
+	// Copies buf into a TX buffer and sends it, see send_sg for csum
 	// returns: # of bytes sent
-	extern int (*send)(const void *buf, int len);
+	int send(const void *buf, int len, uint32_t csum);
+	
+	// Fills up to max refs with the frames waiting in the RX ring, oldest
+	// first. They stay valid (and writable) until handed back with
+	// rx_release.
+	// returns: # of frames
+	extern int (*rx_burst)(PacketRef *pkts, int max);
 	
-	// returns: # of bytes received
-	extern int (*receive)(void *buf);
+	// Hands the n oldest frames from rx_burst back to the NIC
+	extern void (*rx_release)(int n);
 	
+	// Pushes out queued descriptors and reclaims finished sends
 	// returns: zero
 	extern int (*flush)();
+	
+	// ===== Queue pairs =====
+	// NICs with several RX/TX queue pairs (virtio-net with MQ, igb) let each
+	// flow own one, so traffic on one cannot hold up another. virtio-net
+	// steers a flow's RX to the queue its TX last went out on, igb needs a
+	// filter from steer(). The calls above use pair 0, which is the only one
+	// on other NICs and where everything unsteered arrives.
+	extern int n_queue_pairs;
+	
+	extern int (*send_sg_q)(int queue, const Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	extern int (*rx_burst_q)(int queue, PacketRef *pkts, int max);
+	extern void (*rx_release_q)(int queue, int n);
+	
+	// returns: # of bytes sent
+	int tx_send_q(int queue, TxBuffer *buf);
+	
+	// Received frames a steering filter picks; zero fields match anything.
+	// An ethertype alone makes an EtherType filter, anything else matches
+	// IPv4 packets. Ports are in host byte order.
+	struct FlowMatch {
+		uint16_t ethertype;
+		uint8_t proto;
+		uint8_t src_ip[4];
+		uint16_t src_port;
+		uint16_t dst_port;
+	};
+	
+	// Delivers frames that match to RX queue queue
+	// returns: false if the NIC has no (more) filters for it
+	extern bool (*steer)(const FlowMatch &match, int queue);
+	
+	// ===== RX wakeups =====
+	// NICs that can raise Trap::TRAP_WAKEUP (MSI/MSI-X) when a frame
+	// arrives let an idle sleep end right then instead of on the timer.
+	// The interrupt is only unmasked between arm and disarm.
+	extern bool has_rx_wakeup;
+	
+	// returns: false if frames are already waiting, so do not sleep
+	bool rx_wakeup_arm();
+	
+	void rx_wakeup_disarm();
+	
+	// The dword the NIC writes when the next frame lands in RX queue 0 (in
+	// its descriptor or used ring), to MONITOR/MWAIT on while idle
+	// returns: NULL if the NIC has none
+	extern const volatile uint32_t *(*rx_wait_addr)();
 }
 
 #endif
@@ -18,7 +18,7 @@ namespace PCI {
 		uint32_t dev_id;
 		uint32_t dev_class;
 		
-		uint32_t reg_base[6];
+		uint64_t reg_base[6];
 		uint32_t reg_size[6];
 		bool reg_is_io[6];
 		uint8_t irq_line;
@@ -38,6 +38,26 @@ namespace PCI {
 	uint64_t map_device(uint32_t key1, uint32_t key2, uint64_t addr, uint64_t maxlen, uint32_t bar = 0);
 	
 	uint64_t get_device_reg_base(uint32_t key1, uint32_t key2, uint32_t bar = 0);
+	
+	// Config space dword at off (dword aligned) of the device
+	// returns: 0xffffffff if there is no such device
+	uint32_t read_config(uint32_t key1, uint32_t key2, uint32_t off);
+	
+	// Walks the capability list, starting after the capability at offset
+	// after (or from the head if zero)
+	// returns: config space offset of the next capability with id cap_id,
+	// zero if there is none
+	uint32_t find_capability(uint32_t key1, uint32_t key2, uint8_t cap_id, uint32_t after = 0);
+	
+	void write_config(uint32_t key1, uint32_t key2, uint32_t off, uint32_t value);
+	
+	// Routes the device's MSI to vector on this CPU and turns off INTx
+	// returns: false if it has no MSI capability
+	bool enable_msi(uint32_t key1, uint32_t key2, uint8_t vector);
+	
+	// Same with MSI-X, every table entry gets vector
+	// returns: false if it has no MSI-X capability or the table is out of reach
+	bool enable_msix(uint32_t key1, uint32_t key2, uint8_t vector);
 }
 
 #endif
\ No newline at end of file
@@ -1,13 +1,32 @@
 #ifndef DUCK_SCHEDULER_H
 #define DUCK_SCHEDULER_H
 
+#include <stdint.h>
+
+// Decides how the idle loop waits for traffic: spin (with pause) while the
+// next frame is likely close, given the gaps seen so far, and sleep until a
+// frame or the timer wakes us once it is not
 namespace Scheduler {
 	void init();
 	
 	void set_active();
 	void set_idle();
 	bool can_sleep();
+	
+	// One wait in the idle loop when not sleeping
+	void spin();
 	void sleep();
+	
+	// Time in each state since init
+	struct Stats {
+		uint64_t busy_ns;
+		uint64_t spin_ns;
+		uint64_t sleep_ns;
+		uint64_t n_sleeps;
+		uint64_t avg_gap_ns;  // between bursts of traffic
+	};
+	
+	Stats get_stats();
 }
 
 #endif
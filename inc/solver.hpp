@@ -3,9 +3,26 @@
 
 namespace Solver {
 	void init(void (*send)(const char *, int));
-	void recv_input(const char *buf, int len);
+	// Takes buf only if it is all '0'..'9': returns len, or else the offset
+	// of the first other byte
+	int recv_input(const char *buf, int len);
 	void print_stat(int bytes_processed);
+	
+	// Make room for the next recv_input (cheap unless the buffer is full)
 	void prepare();
+	
+	// For offline replay: swap the submission callback, and put the window
+	// back to its state after init() with no pending stats
+	void set_send(void (*send)(const char *, int));
+	void reset();
+	
+	// Longest buf accepted by recv_input
+	int max_batch_size();
+	
+	// Packet/byte/report counters and per-modulus latency percentiles as
+	// text, NUL-terminated; returns the length written
+	int format_stats(char *buf, int size);
+	void reset_stats();
 }
 
 #endif
@@ -54,6 +54,13 @@ namespace Timer {
 	
 	void powersave_sleep(uint64_t ns);
 	
+	// Whether the CPU has MONITOR/MWAIT, see powersave_wait
+	extern bool has_mwait;
+	
+	// Like powersave_sleep, but also ends as soon as *addr no longer reads
+	// value, e.g. once a NIC writes back the descriptor at addr
+	void powersave_wait(uint64_t ns, const volatile uint32_t *addr, uint32_t value);
+	
 	void reset_performance_counters();
 	void read_performance_counters(uint64_t &inst,
 		uint64_t &clk_thread, uint64_t &clk_ref_tsc);
@@ -4,6 +4,11 @@
 #include <inc/x86_64.hpp>
 
 namespace Trap {
+	// Device interrupts (MSI/MSI-X) come in here. They only end a hlt in
+	// Timer::powersave_sleep early; drivers keep them masked otherwise, and
+	// one that still arrives in user code is dropped.
+	const uint8_t TRAP_WAKEUP = 64;
+	
 	void init();
 	void run_user_64(uint64_t entry, uint64_t rsp, uint64_t time_limit_ns,
 		uint64_t &tsc, uint8_t &trap_num, int32_t &return_code);
@@ -3,17 +3,44 @@
 
 #include <stdint.h>
 
+#include <inc/network_driver.hpp>
+
 namespace virtio_net {
 	bool init(uint8_t mac[6]);
 	
 	// returns: # of bytes sent
-	int send(const void *buf, int len);
+	// csum is ignored: no checksum offload is negotiated
+	int send_sg(const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	
+	// returns: # of frames
+	int rx_burst(NetworkDriver::PacketRef *pkts, int max);
 	
-	// returns: # of bytes received
-	int receive(void *buf);
+	void rx_release(int n);
 	
 	// returns: zero
 	int flush();
+	
+	// # of RX/TX queue pairs in use, the calls above are for pair 0
+	int n_queue_pairs();
+	
+	int send_sg_q(int queue, const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	
+	int rx_burst_q(int queue, NetworkDriver::PacketRef *pkts, int max);
+	
+	void rx_release_q(int queue, int n);
+	
+	int flush_q(int queue);
+	
+	// Whether the NIC got an MSI/MSI-X to Trap::TRAP_WAKEUP, see
+	// NetworkDriver::rx_wakeup_arm
+	bool has_rx_wakeup();
+	bool rx_wakeup_arm();
+	void rx_wakeup_disarm();
+	
+	// See NetworkDriver::rx_wait_addr
+	const volatile uint32_t *rx_wait_addr();
 }
 
 #endif
@@ -74,6 +74,21 @@ namespace x86_64 {
 		__asm__ volatile ("hlt");
 	}
 	
+	static inline void pause() {
+		__asm__ volatile ("pause");
+	}
+	
+	// Arms monitoring of the cache line with p for mwait
+	static inline void monitor(const volatile void *p) {
+		__asm__ volatile ("monitor" : : "a" (p), "c" (0), "d" (0));
+	}
+	
+	// Like sti; hlt, but a write to the monitored line also wakes us.
+	// IF stays set when that is what did.
+	static inline void sti_mwait(uint32_t hint) {
+		__asm__ volatile ("sti; mwait" : : "a" (hint), "c" (0) : "memory");
+	}
+	
 	static inline uint64_t rdtsc() {
 		return __rdtsc();
 	}
@@ -90,6 +105,29 @@ namespace x86_64 {
 		if (edxp) *edxp = edx;
 	}
 	
+	static inline void cpuid_count(uint32_t info, uint32_t subleaf,
+		uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp) {
+		uint32_t eax, ebx, ecx, edx;
+		asm volatile("cpuid"
+			: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			: "a" (info), "c" (subleaf));
+		if (eaxp) *eaxp = eax;
+		if (ebxp) *ebxp = ebx;
+		if (ecxp) *ecxp = ecx;
+		if (edxp) *edxp = edx;
+	}
+	
+	static inline uint64_t xgetbv(uint32_t xcr) {
+		uint32_t hi, lo;
+		__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (xcr));
+		return ((uint64_t) hi << 32) | lo;
+	}
+	
+	static inline void xsetbv(uint32_t xcr, uint64_t val) {
+		uint32_t hi = val >> 32, lo = val;
+		__asm__ volatile ("xsetbv" : : "a" (lo), "d" (hi), "c" (xcr));
+	}
+	
 	static inline uint64_t read_rflags() {
 		uint64_t rflags;
 		__asm__ volatile ("pushfq; popq %0" : "=r" (rflags));
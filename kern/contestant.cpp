@@ -1,9 +1,15 @@
 #include <string.h>
 #include <assert.h>
 
+#include <algorithm>
+
 #include <inc/contestant.hpp>
 #include <inc/solver.hpp>
 #include <inc/logger.hpp>
+#include <inc/console_ring.hpp>
+#include <inc/latency.hpp>
+#include <inc/memory.hpp>
+#include <inc/multiboot2_loader.hpp>
 #include <inc/network_driver.hpp>
 #include <inc/timer.hpp>
 #include <inc/utils.hpp>
@@ -15,6 +21,11 @@
 #include <lwip/dhcp.h>
 #include <lwip/timeouts.h>
 #include <lwip/tcp.h>
+#include <lwip/udp.h>
+#include <lwip/prot/ethernet.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+#include <lwip/priv/tcp_priv.h>
 
 using NetworkDriver::mac;
 using NetworkDriver::ip;
@@ -28,6 +39,9 @@ u32_t sys_now() {
 	return Timer::ns_since_epoch() / 1000000ull;
 }
 
+// lwip/core/inet_chksum.c, not in a public header
+extern "C" u16_t lwip_standard_chksum(const void *dataptr, int len);
+
 static const char *invalid_buffer =
 	"9999999999999999999999999999999999999999999999999999999999999999"
 	"9999999999999999999999999999999999999999999999999999999999999999"
@@ -55,6 +69,17 @@ namespace Contestant {
 	
 	static struct tcp_pcb *conn_10001, *conn_10002;
 	
+	// With several NIC queue pairs, ARP, DHCP and broadcasts stay on pair 0,
+	// out of the way of the server connections. With three or more, the
+	// 10001 market data and the 10002 orders each get a pair of their own;
+	// with two they share pair 1.
+	static int queue_10001, queue_10002;
+	
+	// Sequence number of the first 10001 byte the Solver has not seen yet.
+	// early_demux() feeds in-order segments before lwIP does, so lwIP may
+	// later deliver bytes below this that must not be fed again.
+	static u32_t solver_rcv_nxt;
+	
 	static void tcp_err_fn_10001(void *, err_t) {
 		conn_10001 = NULL;
 		state = S_ABORT_NEXT_TICK;
@@ -65,7 +90,19 @@ namespace Contestant {
 		state = S_ABORT_NEXT_TICK;
 	}
 	
+	// Adds both 16-bit halves of a field as laid out in memory
+	static inline uint32_t sum32(uint32_t v) {
+		return (v >> 16) + (v & 0xffff);
+	}
+	
+	static inline uint16_t fold(uint32_t sum) {
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum = (sum >> 16) + (sum & 0xffff);
+		return sum;
+	}
+	
 	static void start_connecting_10001();
+	static void fast_tx_prepare(struct tcp_pcb *pcb);
 	
 	static err_t tcp_connected_fn(void *, struct tcp_pcb *, err_t) {
 		if (state == S_CONNECTING_10002) {
@@ -76,6 +113,9 @@ namespace Contestant {
 		assert(state == S_CONNECTING_10001);
 		state = S_CONNECTED;
 		
+		fast_tx_prepare(conn_10002);
+		solver_rcv_nxt = conn_10001->rcv_nxt;
+		
 		Solver::recv_input(invalid_buffer, invalid_buffer_len);
 		Solver::print_stat(0);
 		
@@ -84,6 +124,33 @@ namespace Contestant {
 	
 	static int last_recv_len = 0;
 	
+	// Stamps of the frame being handled, for Latency. lwIP 2.1.3 pbufs have
+	// no room for them, but netif.input runs to completion, so they need not
+	// travel with the pbuf: whatever lwIP delivers meanwhile (out-of-order
+	// data included) is charged to the frame that made it deliverable.
+	static struct {
+		uint64_t rx_tsc;     // from the driver
+		uint64_t stack_tsc;  // handed to early_demux / lwIP
+		uint64_t app_tsc;    // handed to the Solver
+	} in_flight;
+	
+	static void feed_solver(const char *buf, int len) {
+		const uint64_t tsc = Timer::get_tsc();
+		if (in_flight.stack_tsc) {
+			Latency::add(Latency::STACK, tsc - in_flight.stack_tsc);
+		}
+		in_flight.app_tsc = tsc;
+		
+		// printf("data:\n");
+		// fwrite(buf, 1, len, stdout);
+		// putchar('\n');
+		
+		if (Solver::recv_input(buf, len) == len) {
+			last_recv_len = len;
+			Solver::print_stat(last_recv_len);
+		}
+	}
+	
 	static err_t tcp_recv_fn_10001(void *, struct tcp_pcb *pcb, struct pbuf *p, err_t) {
 		if (p == NULL) {
 			state = S_ABORT_NEXT_TICK;
@@ -92,32 +159,81 @@ namespace Contestant {
 		
 		tcp_recved(pcb, p->tot_len);
 		
-		static char buf[MTU];
+		// p holds [rcv_nxt - tot_len, rcv_nxt), skip what early_demux fed
 		int len = p->tot_len;
-		pbuf_copy_partial(p, buf, len, 0);
-		
-		// printf("data:\n");
-		// fwrite(buf, 1, len, stdout);
-		// putchar('\n');
-		
-		bool has_non_digits = false;
-		for (int i = 0; i < len; i++) {
-			if (!(buf[i] >= '0' && buf[i] <= '9')) {
-				has_non_digits = true;
-				break;
-			}
+		u32_t start = pcb->rcv_nxt - len;
+		int skip = 0;
+		if (TCP_SEQ_LT(start, solver_rcv_nxt)) {
+			skip = LWIP_MIN((u32_t) len, solver_rcv_nxt - start);
 		}
 		
-		if (!has_non_digits) {
-			Solver::recv_input(buf, len);
-			last_recv_len = len;
-			Solver::print_stat(last_recv_len);
+		if (skip < len) {
+			static char buf[MTU];
+			pbuf_copy_partial(p, buf, len - skip, skip);
+			feed_solver(buf, len - skip);
+			solver_rcv_nxt = pcb->rcv_nxt;
 		}
 		
 		pbuf_free(p);
 		return ERR_OK;
 	}
 	
+	// Picks in-order data segments of the established 10001 connection out
+	// of a received frame and feeds them to the Solver straight from pkt.
+	// The frame still goes through lwIP afterwards for the ACK and window.
+	// Anything else (options in IP, fragments, flags other than ACK/PSH,
+	// out-of-order or retransmitted data, bad checksums) is left to lwIP.
+	// csum tells which checksums the NIC has already verified.
+	static void early_demux(const char *pkt, int len, uint32_t csum) {
+		if (state != S_CONNECTED || conn_10001 == NULL) return;
+		
+		struct tcp_pcb *pcb = conn_10001;
+		if (pcb->state != ESTABLISHED) return;
+		
+		const int hdr_len = SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN;
+		if (len < hdr_len) return;
+		
+		const struct eth_hdr *eth = (const struct eth_hdr *) pkt;
+		const struct ip_hdr *iph = (const struct ip_hdr *) (pkt + SIZEOF_ETH_HDR);
+		if (eth->type != PP_HTONS(ETHTYPE_IP)) return;
+		if (IPH_V(iph) != 4 || IPH_HL_BYTES(iph) != IP_HLEN) return;
+		if (IPH_PROTO(iph) != IP_PROTO_TCP) return;
+		if ((IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK | IP_MF)) != 0) return;
+		if (iph->src.addr != ip_2_ip4(&pcb->remote_ip)->addr) return;
+		if (iph->dest.addr != ip_2_ip4(&pcb->local_ip)->addr) return;
+		
+		const int ip_len = lwip_ntohs(IPH_LEN(iph));
+		if (ip_len > len - SIZEOF_ETH_HDR || ip_len < IP_HLEN + TCP_HLEN) return;
+		
+		const struct tcp_hdr *tcph = (const struct tcp_hdr *) (iph + 1);
+		if (tcph->src != lwip_htons(pcb->remote_port)) return;
+		if (tcph->dest != lwip_htons(pcb->local_port)) return;
+		if ((TCPH_FLAGS(tcph) & ~(TCP_ACK | TCP_PSH)) != 0) return;
+		
+		const int tcp_hdr_len = TCPH_HDRLEN_BYTES(tcph);
+		const int data_len = ip_len - IP_HLEN - tcp_hdr_len;
+		if (tcp_hdr_len < TCP_HLEN || data_len <= 0) return;
+		if (data_len > Solver::max_batch_size()) return;
+		
+		const u32_t seqno = lwip_ntohl(tcph->seqno);
+		if (seqno != pcb->rcv_nxt || seqno != solver_rcv_nxt) return;
+		
+		if (csum & NetworkDriver::CSUM_BAD) return;
+		
+		if (!(csum & NetworkDriver::CSUM_IPv4)
+			&& fold(lwip_standard_chksum(iph, IP_HLEN)) != 0xffff) return;
+		
+		if (!(csum & NetworkDriver::CSUM_L4)) {
+			const uint32_t tcp_sum = sum32(iph->src.addr) + sum32(iph->dest.addr)
+				+ PP_HTONS(IP_PROTO_TCP) + lwip_htons(ip_len - IP_HLEN)
+				+ lwip_standard_chksum(tcph, ip_len - IP_HLEN);
+			if (fold(tcp_sum) != 0xffff) return;
+		}
+		
+		solver_rcv_nxt = seqno + data_len;
+		feed_solver((const char *) tcph + tcp_hdr_len, data_len);
+	}
+	
 	static err_t tcp_recv_fn_10002(void *, struct tcp_pcb *pcb, struct pbuf *p, err_t) {
 		if (p == NULL) {
 			state = S_ABORT_NEXT_TICK;
@@ -129,6 +245,210 @@ namespace Contestant {
 		return ERR_OK;
 	}
 	
+	// ===== Direct submission on 10002 =====
+	// Answers skip tcp_write/tcp_output: the Ethernet/IP/TCP headers are
+	// built once per connection, and per answer we only patch the lengths,
+	// seq/ack/window and the checksums before handing the frame to the NIC.
+	// The same bytes are then queued to lwIP as an already-sent segment, so
+	// ACK processing and retransmission work as before. Checksums are left
+	// to the NIC when it offloads them. Anything unusual
+	// (queued data, closed window, no ARP entry, NIC ring full) takes the
+	// regular lwIP path instead.
+	
+	struct TxHeaders {
+		struct eth_hdr eth;
+		struct ip_hdr ip;
+		struct tcp_hdr tcp;
+	} __attribute__((packed));
+	
+	static struct {
+		bool ready;
+		TxHeaders hdrs;
+		uint32_t ip_sum;   // IP header with zero length, id and checksum
+		uint32_t tcp_sum;  // pseudo header without length, fixed TCP fields
+		uint16_t ip_id;
+		uint64_t n_sent, n_fallback;
+	} fast_tx;
+	
+	static void fast_tx_prepare(struct tcp_pcb *pcb) {
+		fast_tx.ready = false;
+		
+		const ip4_addr_t *remote_ip = ip_2_ip4(&pcb->remote_ip);
+		const ip4_addr_t *next_hop = remote_ip;
+		if (!ip4_addr_netcmp(remote_ip, netif_ip4_addr(&netif), netif_ip4_netmask(&netif))) {
+			next_hop = netif_ip4_gw(&netif);
+		}
+		
+		struct eth_addr *dst_mac;
+		const ip4_addr_t *entry_ip;
+		if (etharp_find_addr(&netif, next_hop, &dst_mac, &entry_ip) < 0) {
+			LWARN("fast tx: no ARP entry for the next hop, using lwIP");
+			return;
+		}
+		
+		TxHeaders &f = fast_tx.hdrs;
+		memset(&f, 0, sizeof(f));
+		
+		SMEMCPY(&f.eth.dest, dst_mac, ETH_HWADDR_LEN);
+		SMEMCPY(&f.eth.src, netif.hwaddr, ETH_HWADDR_LEN);
+		f.eth.type = PP_HTONS(ETHTYPE_IP);
+		
+		IPH_VHL_SET(&f.ip, 4, IP_HLEN / 4);
+		IPH_TOS_SET(&f.ip, pcb->tos);
+		IPH_OFFSET_SET(&f.ip, PP_HTONS(IP_DF));
+		IPH_TTL_SET(&f.ip, pcb->ttl);
+		IPH_PROTO_SET(&f.ip, IP_PROTO_TCP);
+		ip4_addr_copy(f.ip.src, *ip_2_ip4(&pcb->local_ip));
+		ip4_addr_copy(f.ip.dest, *remote_ip);
+		
+		f.tcp.src = lwip_htons(pcb->local_port);
+		f.tcp.dest = lwip_htons(pcb->remote_port);
+		TCPH_HDRLEN_FLAGS_SET(&f.tcp, TCP_HLEN / 4, TCP_ACK | TCP_PSH);
+		
+		fast_tx.ip_sum = lwip_standard_chksum(&f.ip, IP_HLEN);
+		fast_tx.tcp_sum = sum32(f.ip.src.addr) + sum32(f.ip.dest.addr)
+			+ PP_HTONS(IP_PROTO_TCP) + lwip_standard_chksum(&f.tcp, TCP_HLEN);
+		fast_tx.ready = true;
+	}
+	
+	// Hands the bytes to lwIP as if tcp_output had just sent them
+	static bool fast_tx_commit(struct tcp_pcb *pcb, const char *buf, int len) {
+		const u32_t seqno = pcb->snd_nxt;
+		
+		if (tcp_write(pcb, buf, len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+			return false;
+		}
+		
+		struct tcp_seg *seg = pcb->unsent;
+		if (seg == NULL || seg->next != NULL || lwip_ntohl(seg->tcphdr->seqno) != seqno) {
+			return false;
+		}
+		
+		pcb->unsent = NULL;
+#if TCP_OVERSIZE
+		pcb->unsent_oversize = 0;
+#endif
+		
+		if (pcb->unacked == NULL) {
+			pcb->unacked = seg;
+		} else {
+			struct tcp_seg *last = pcb->unacked;
+			while (last->next != NULL) last = last->next;
+			last->next = seg;
+		}
+		
+		pcb->snd_nxt = seqno + len;
+		
+		if (pcb->rtime < 0) {
+			pcb->rtime = 0;
+		}
+		if (pcb->rttest == 0) {
+			pcb->rttest = tcp_ticks;
+			pcb->rtseq = seqno;
+		}
+		
+		// our segment carried the ACK
+		tcp_clear_flags(pcb, TF_ACK_DELAY | TF_ACK_NOW);
+		pcb->rcv_ann_right_edge = pcb->rcv_nxt + pcb->rcv_ann_wnd;
+		
+		return true;
+	}
+	
+	static bool fast_tx_send(const char *buf, int len) {
+		struct tcp_pcb *pcb = conn_10002;
+		
+		if (!fast_tx.ready || pcb->state != ESTABLISHED) return false;
+		if (pcb->unsent != NULL || pcb->snd_nxt != pcb->snd_lbb) return false;
+		if (len > pcb->mss || len > (int) tcp_sndbuf(pcb)) return false;
+		if (tcp_sndqueuelen(pcb) + 1 >= TCP_SND_QUEUELEN) return false;
+		
+		const u32_t wnd = LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
+		if (pcb->snd_nxt - pcb->lastack + len > wnd) return false;
+		
+		// Built in place in a DMA buffer: payload first, headers in front
+		NetworkDriver::TxBuffer *tx = NetworkDriver::tx_alloc(sizeof(TxHeaders));
+		if (tx == NULL) return false;
+		
+		char *payload = tx->put(len);
+		memcpy(payload, buf, len);
+		
+		TxHeaders &f = * (TxHeaders *) tx->push(sizeof(TxHeaders));
+		memcpy(&f, &fast_tx.hdrs, sizeof(f));
+		
+		const u16_t ip_len = lwip_htons(IP_HLEN + TCP_HLEN + len);
+		const u16_t ip_id = lwip_htons(fast_tx.ip_id++);
+		IPH_LEN_SET(&f.ip, ip_len);
+		IPH_ID_SET(&f.ip, ip_id);
+		
+		f.tcp.seqno = lwip_htonl(pcb->snd_nxt);
+		f.tcp.ackno = lwip_htonl(pcb->rcv_nxt);
+		f.tcp.wnd = lwip_htons(TCPWND_MIN16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
+		
+		tx->csum = NetworkDriver::tx_csum_offload;
+		if (!(tx->csum & NetworkDriver::CSUM_IPv4)) {
+			IPH_CHKSUM_SET(&f.ip, ~fold(fast_tx.ip_sum + ip_len + ip_id));
+		}
+		if (!(tx->csum & NetworkDriver::CSUM_L4)) {
+			const uint32_t tcp_sum = fast_tx.tcp_sum + lwip_htons(TCP_HLEN + len)
+				+ sum32(f.tcp.seqno) + sum32(f.tcp.ackno) + f.tcp.wnd
+				+ lwip_standard_chksum(payload, len);
+			f.tcp.chksum = ~fold(tcp_sum);
+		}
+		
+		if (NetworkDriver::tx_send_q(queue_10002, tx) < 0) {
+			return false;
+		}
+		
+		if (!fast_tx_commit(pcb, buf, len)) {
+			// The peer has bytes lwIP does not know about, the stream is lost
+			LERROR("fast tx: lwIP did not take the sent segment, reconnecting");
+			state = S_ABORT_NEXT_TICK;
+		}
+		
+		return true;
+	}
+	
+	// Any datagram to STATS_PORT gets the Solver stats and the latency
+	// breakdown back (and echoed to the console); a payload starting with
+	// "reset" clears them afterwards
+	static const uint16_t STATS_PORT = 23580;
+	static struct udp_pcb *stats_pcb;
+	
+	static void stats_recv_fn(void *, struct udp_pcb *pcb, struct pbuf *p,
+		const ip_addr_t *addr, u16_t port) {
+		
+		char cmd[8] = {0};
+		pbuf_copy_partial(p, cmd, sizeof(cmd) - 1, 0);
+		pbuf_free(p);
+		
+		static char buf[2048];
+		int len = Solver::format_stats(buf, sizeof(buf));
+		
+		ConsoleRing::Stats ring = ConsoleRing::get_stats();
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"console ring: %lu / %lu bytes used, high water %lu, %lu records, %lu dropped\n",
+			ring.used, ring.size, ring.high_water, ring.n_records, ring.n_dropped);
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"fast tx: %lu sent, %lu via lwIP\n", fast_tx.n_sent, fast_tx.n_fallback);
+		if (len < (int) sizeof(buf)) {
+			len += Latency::format(buf + len, sizeof(buf) - len);
+		}
+		if (len >= (int) sizeof(buf)) len = sizeof(buf) - 1;
+		printf("%s", buf);
+		
+		struct pbuf *r = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+		if (r != NULL) {
+			pbuf_take(r, buf, len);
+			udp_sendto(pcb, r, addr, port);
+			pbuf_free(r);
+		}
+		
+		if (strncmp(cmd, "reset", 5) == 0) {
+			Solver::reset_stats();
+			Latency::reset();
+		}
+	}
+	
 	static void start_connecting_10001() {
 		LINFO("start_connecting 10001 (2/2)!");
 		
@@ -171,6 +491,7 @@ namespace Contestant {
 				conn_10002 = NULL;
 			}
 			
+			fast_tx.ready = false;
 			state = S_NOT_CONNECTED;
 		}
 	}
@@ -180,9 +501,20 @@ namespace Contestant {
 		
 		(void)(buf), (void)(len);
 		
+		const uint64_t send_tsc = Timer::get_tsc();
+		if (in_flight.app_tsc) {
+			Latency::add(Latency::APP, send_tsc - in_flight.app_tsc);
+		}
+		
 		if (!NetworkDriver::do_not_send_answer) {
-			tcp_write(conn_10002, buf, len, TCP_WRITE_FLAG_COPY);
-			tcp_output(conn_10002);
+			if (fast_tx_send(buf, len)) {
+				fast_tx.n_sent++;
+			} else {
+				fast_tx.n_fallback++;
+				tcp_write(conn_10002, buf, len, TCP_WRITE_FLAG_COPY);
+				tcp_output(conn_10002);
+			}
+			Latency::add_tx(in_flight.rx_tsc, send_tsc);
 		}
 	}
 	
@@ -218,6 +550,99 @@ namespace Contestant {
 		);
 	}
 	
+	// ===== Offline replay =====
+	// A "solver_trace" boot module holds the captured 10001 payloads as
+	// records of { uint16_t len (little endian); char payload[len]; }.
+	// Each one is fed through the Solver the way tcp_recv_fn_10001 does, and
+	// we report cycle percentiles for recv_input, prepare and each answer.
+	
+	static const int MAX_N_SAMPLES = 65536;
+	
+	struct Samples {
+		uint32_t v[MAX_N_SAMPLES];
+		int n;
+		
+		void add(uint64_t cycles) {
+			if (n < MAX_N_SAMPLES) {
+				v[n++] = cycles > UINT32_MAX ? UINT32_MAX : cycles;
+			}
+		}
+		
+		void print(const char *name) {
+			if (n == 0) {
+				LINFO("replay: %-10s n 0", name);
+				return;
+			}
+			
+			std::sort(v, v + n);
+			LINFO(
+				"replay: %-10s n %d  p50 %u  p99 %u  p99.9 %u  max %u cycles",
+				name, n, v[n / 2], v[n * 99ll / 100], v[n * 999ll / 1000], v[n - 1]
+			);
+		}
+	};
+	
+	static Samples replay_recv, replay_prepare, replay_answer;
+	static uint64_t replay_packet_tsc;
+	
+	static void replay_send(const char *, int) {
+		replay_answer.add(__rdtsc() - replay_packet_tsc);
+	}
+	
+	static void replay_trace() {
+		const Multiboot2_Loader::Module *mod = Multiboot2_Loader::find_module("solver_trace");
+		if (mod == NULL) return;
+		
+		const uint8_t *data = Memory::remap((const uint8_t *) mod->start);
+		const uint64_t size = mod->end - mod->start;
+		
+		replay_recv.n = replay_prepare.n = replay_answer.n = 0;
+		Solver::set_send(replay_send);
+		Solver::reset();
+		
+		int n_packets = 0, n_skipped = 0;
+		uint64_t bytes = 0, off = 0;
+		
+		while (off + 2 <= size) {
+			int len = data[off] | (data[off + 1] << 8);
+			const char *buf = (const char *) data + off + 2;
+			off += 2 + len;
+			
+			if (off > size) {
+				LWARN("replay: truncated record at packet %d", n_packets + n_skipped);
+				break;
+			}
+			
+			if (len == 0 || len > Solver::max_batch_size()) {
+				n_skipped++;
+				continue;
+			}
+			
+			replay_packet_tsc = __rdtsc();
+			if (Solver::recv_input(buf, len) != len) {
+				n_skipped++;
+				continue;
+			}
+			uint64_t t1 = __rdtsc();
+			Solver::prepare();
+			uint64_t t2 = __rdtsc();
+			
+			replay_recv.add(t1 - replay_packet_tsc);
+			replay_prepare.add(t2 - t1);
+			
+			n_packets++;
+			bytes += len;
+		}
+		
+		LINFO("replay: %d packets (%lu bytes), %d skipped", n_packets, bytes, n_skipped);
+		replay_recv.print("recv_input");
+		replay_prepare.print("prepare");
+		replay_answer.print("answer");
+		
+		Solver::set_send(contestant_send);
+		Solver::reset();
+	}
+	
 	static void enable_turbo_boost() {
 		const uint32_t IA32_MISC_ENABLE = 416;
 		const uint64_t TURBO_MODE_DISABLE = 1ul << 38;
@@ -238,6 +663,7 @@ namespace Contestant {
 		benchmark();
 		enable_turbo_boost();
 		benchmark();
+		replay_trace();
 		
 		// INIT_SERVER_IP;
 		const uint8_t *ip = NetworkDriver::server_ip;
@@ -245,6 +671,51 @@ namespace Contestant {
 		
 		LINFO("server_ip %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
 		LINFO("do_not_send_answer: %s", NetworkDriver::do_not_send_answer ? "yes" : "no");
+		
+		// virtio-net follows our TX, igb needs a filter per server port
+		const int n_pairs = NetworkDriver::n_queue_pairs;
+		queue_10001 = n_pairs > 1 ? 1 : 0;
+		queue_10002 = n_pairs > 2 ? 2 : queue_10001;
+		if (queue_10001 != 0) {
+			NetworkDriver::FlowMatch match;
+			memset(&match, 0, sizeof(match));
+			match.proto = IP_PROTO_TCP;
+			memcpy(match.src_ip, ip, sizeof(match.src_ip));
+			
+			const struct { uint16_t port; int queue; } flows[] = {
+				{ 10001, queue_10001 },
+				{ 10002, queue_10002 },
+			};
+			bool steered = true;
+			for (const auto &flow : flows) {
+				match.src_port = flow.port;
+				steered &= NetworkDriver::steer(match, flow.queue);
+			}
+			LINFO("10001 on queue pair %d, 10002 on queue pair %d%s",
+				queue_10001, queue_10002, steered ? ", steered by the NIC" : "");
+		}
+	}
+	
+	// lwIP leaves to the NIC what it offloads on send, and skips checking
+	// what the NIC has verified in the frame at hand (rx_csum)
+	static void netif_set_csum_flags(uint32_t rx_csum) {
+		const uint32_t tx_csum = NetworkDriver::tx_csum_offload;
+		u16_t flags = NETIF_CHECKSUM_ENABLE_ALL;
+		if (tx_csum & NetworkDriver::CSUM_IPv4) {
+			flags &= ~NETIF_CHECKSUM_GEN_IP;
+		}
+		if (tx_csum & NetworkDriver::CSUM_L4) {
+			flags &= ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_GEN_UDP);
+		}
+		if (rx_csum & NetworkDriver::CSUM_IPv4) {
+			flags &= ~NETIF_CHECKSUM_CHECK_IP;
+		}
+		if (rx_csum & NetworkDriver::CSUM_L4) {
+			flags &= ~(NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP);
+		}
+		if (netif.chksum_flags != flags) {
+			NETIF_SET_CHECKSUM_CTRL(&netif, flags);
+		}
 	}
 	
 	void run() {
@@ -252,44 +723,130 @@ namespace Contestant {
 		
 		contestant_init();
 		
+		// From here on console output waits in ConsoleRing until we are idle
+		ConsoleRing::set_deferred(true);
+		
 		while (1) {
-			static char pkt[MTU + 64];
-			int len = NetworkDriver::receive(pkt);
+			const int RX_BURST = 16;
+			NetworkDriver::PacketRef pkts[RX_BURST];
+			int n_total = 0;
 			
-			// check "udp and dport 23579"
-			if (len >= 14 + 20 + 8
-				&& * (uint16_t *) (pkt + 14 + 20 + 2) == htons(23579)) {
-				Utils::GG_reboot();
-			}
-			
-			if (len > 0) {
-				struct pbuf* p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+			for (int q = 0; q < NetworkDriver::n_queue_pairs; q++) {
+				int n = NetworkDriver::rx_burst_q(q, pkts, RX_BURST);
+				n_total += n;
 				
-				if (p != NULL) {
-					pbuf_take(p, pkt, len);
+				for (int i = 0; i < n; i++) {
+					const char *pkt = (const char *) pkts[i].data;
+					int len = pkts[i].len;
+					
+					// check "udp and dport 23579"
+					if (len >= 14 + 20 + 8
+						&& * (uint16_t *) (pkt + 14 + 20 + 2) == htons(23579)) {
+						Utils::GG_reboot();
+					}
+					
+					if (pkts[i].csum & NetworkDriver::CSUM_BAD) {
+						continue;
+					}
+					
+					in_flight.rx_tsc = pkts[i].rx_tsc;
+					in_flight.stack_tsc = Timer::get_tsc();
+					Latency::add(Latency::DRIVER, in_flight.stack_tsc - in_flight.rx_tsc);
+					
+					early_demux(pkt, len, pkts[i].csum);
 					
-					if (netif.input(p, &netif) != ERR_OK) {
-						pbuf_free(p);
+					// lwIP may hold on to input pbufs (ooseq), so it gets a copy
+					struct pbuf* p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+					
+					if (p != NULL) {
+						pbuf_take(p, pkt, len);
+						
+						netif_set_csum_flags(pkts[i].csum);
+						if (netif.input(p, &netif) != ERR_OK) {
+							pbuf_free(p);
+						}
 					}
+					
+					memset(&in_flight, 0, sizeof(in_flight));
 				}
+				
+				NetworkDriver::rx_release_q(q, n);
 			}
 			
+			// Pushes out what is pending and runs done() for what the NIC
+			// has sent, dropping netif_output's pbuf references: lwIP will
+			// not retransmit a segment it still sees as busy
+			NetworkDriver::flush();
+			
 			// lwip timers check
 			sys_check_timeouts();
 			
 			// your application here
 			contestant_tick();
+			
+			// RX queues were empty and answers go out synchronously from
+			// recv_input, so nothing is waiting on us: print one record
+			if (n_total == 0) {
+				ConsoleRing::drain_one();
+			}
+		}
+	}
+	
+	static void netif_output_done(void *p) {
+		pbuf_free((struct pbuf *) p);
+	}
+	
+	// The NIC reads the pbuf chain in place, one fragment per pbuf; we hold
+	// a reference until it is done (tcp_output_segment_busy() keeps lwIP
+	// from rewriting segments that are still in flight)
+	// Frames of the server connections (lwIP's ACKs and retransmissions
+	// too) leave on their queue pair, so virtio-net keeps steering them there
+	static int output_queue(const struct pbuf *p) {
+		if (queue_10001 == 0) return 0;
+		if (p->len < SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN) return 0;
+		
+		const struct eth_hdr *eth = (const struct eth_hdr *) p->payload;
+		const struct ip_hdr *iph = (const struct ip_hdr *) (eth + 1);
+		if (eth->type != PP_HTONS(ETHTYPE_IP)) return 0;
+		if (IPH_HL_BYTES(iph) != IP_HLEN || IPH_PROTO(iph) != IP_PROTO_TCP) return 0;
+		
+		const struct tcp_hdr *tcph = (const struct tcp_hdr *) (iph + 1);
+		if (conn_10001 && tcph->src == lwip_htons(conn_10001->local_port)) {
+			return queue_10001;
+		}
+		if (conn_10002 && tcph->src == lwip_htons(conn_10002->local_port)) {
+			return queue_10002;
 		}
+		return 0;
 	}
 	
 	static err_t netif_output(struct netif *, struct pbuf *p) {
 		// no link stats
 		
-		static char buf[MTU];
-		pbuf_copy_partial(p, buf, p->tot_len, 0);
+		const int queue = output_queue(p);
+		
+		NetworkDriver::Fragment frags[NetworkDriver::MAX_FRAGMENTS];
+		int n = 0;
+		for (struct pbuf *q = p; q != NULL; q = q->next) {
+			if (q->len == 0) continue;
+			
+			if (n == NetworkDriver::MAX_FRAGMENTS) {
+				if (p->tot_len > NetworkDriver::MAX_FRAME_LEN) return ERR_IF;
+				NetworkDriver::TxBuffer *tx = NetworkDriver::tx_alloc(0);
+				if (tx == NULL) return ERR_IF;
+				pbuf_copy_partial(p, tx->put(p->tot_len), p->tot_len, 0);
+				tx->csum = NetworkDriver::tx_csum_offload;
+				return NetworkDriver::tx_send_q(queue, tx) < 0 ? ERR_IF : ERR_OK;
+			}
+			
+			frags[n++] = (NetworkDriver::Fragment) { q->payload, q->len };
+		}
 		
-		// TODO: return value
-		NetworkDriver::send(buf, p->tot_len);
+		pbuf_ref(p);
+		if (NetworkDriver::send_sg_q(queue, frags, n, NetworkDriver::tx_csum_offload, netif_output_done, p) < 0) {
+			pbuf_free(p);
+			return ERR_IF;
+		}
 		
 		return ERR_OK;
 	}
@@ -316,6 +873,8 @@ namespace Contestant {
 		netif.name[0] = 'e';
 		netif.name[1] = '0';
 		
+		netif_set_csum_flags(0);
+		
 		// no status callback
 		
 		netif_set_default(&netif);
@@ -325,6 +884,11 @@ namespace Contestant {
 		
 		dhcp_start(&netif);
 		
+		stats_pcb = udp_new();
+		assert(stats_pcb != NULL);
+		udp_bind(stats_pcb, IP4_ADDR_ANY, STATS_PORT);
+		udp_recv(stats_pcb, stats_recv_fn, NULL);
+		
 		// ip4_addr ip;
 		
 		// IP4_ADDR(&ip, 10, 0, 2, 111);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <algorithm>
 
@@ -9,7 +10,9 @@
 #include <inc/utils.hpp>
 #include <inc/x86_64.hpp>
 #include <inc/scheduler.hpp>
+#include <inc/latency.hpp>
 #include <inc/judger.hpp>
+#include <inc/cpu.hpp>
 #include <ducknet.h>
 
 using NetworkDriver::mac;
@@ -37,6 +40,94 @@ namespace DuckServer {
 		return len1 == len2 && memcmp(s1, s2, len2) == 0;
 	}
 	
+	// When the frame being handled reached ducknet and the handler, for
+	// Latency
+	static uint64_t stack_tsc, app_tsc;
+	
+	// Where the answer to the frame being handled goes
+	static DucknetIPv4Address reply_ip;
+	static uint16_t reply_port;
+	
+	// For answers built in place with ducknet_pkt_alloc instead of in res
+	static void send_reply_pkt(DucknetPkt *pkt) {
+		const uint64_t send_tsc = Timer::get_tsc();
+		Latency::add(Latency::APP, send_tsc - app_tsc);
+		ducknet_udp_send_pkt(reply_ip, reply_port, DUCK_UDP_PORT, pkt);
+		Latency::add_tx(ducknet_phy_rx_time(), send_tsc);
+	}
+	
+	// ===== checksum-bench =====
+	// ducknet's checksums against the 16-bit loop they replaced: first
+	// for equal results over every length and alignment up to a frame,
+	// then ns per read-buffer sized payload
+	
+	static uint32_t checksum_sum_ref(const void *a, int count) {
+		uint32_t sum = 0;
+		for (; count > 1; count -= 2, a = (const char *) a + 2) {
+			sum += *(const uint16_t *) a;
+		}
+		if (count) {
+			sum += *(const uint8_t *) a;
+		}
+		return sum;
+	}
+	
+	static uint16_t fold_sum(uint32_t sum) {
+		while (sum >> 16) {
+			sum = (sum & 0xffff) + (sum >> 16);
+		}
+		return sum;
+	}
+	
+	static char checksum_bench_src[1600], checksum_bench_dst[1600];
+	static volatile uint32_t checksum_bench_sink;
+	
+	static bool checksum_bench_check() {
+		for (int i = 0; i < (int) sizeof(checksum_bench_src); i++) {
+			checksum_bench_src[i] = i * 131 + (i >> 3);
+		}
+		for (int off = 0; off < 8; off++) {
+			for (int len = 0; len + off <= 1514; len++) {
+				const char *src = checksum_bench_src + off;
+				uint16_t ref = fold_sum(checksum_sum_ref(src, len));
+				if (fold_sum(ducknet_checksum_sum(src, len)) != ref) return false;
+				if (fold_sum(ducknet_checksum_copy(checksum_bench_dst, src, len)) != ref) return false;
+				if (memcmp(checksum_bench_dst, src, len) != 0) return false;
+			}
+		}
+		return true;
+	}
+	
+	template <typename F>
+	static uint64_t checksum_bench_ps(F f) {
+		const int N_ROUNDS = 100000;
+		uint64_t t0 = Timer::get_tsc();
+		for (int i = 0; i < N_ROUNDS; i++) {
+			f();
+			__asm__ volatile ("" : : : "memory");
+		}
+		return Timer::tsc_to_ns(Timer::get_tsc() - t0) / (N_ROUNDS / 1000);
+	}
+	
+	// returns: # of chars written to res
+	static int checksum_bench(char *res) {
+		const int LEN = 1400;
+		bool ok = checksum_bench_check();
+		
+		const char *src = checksum_bench_src;
+		char *dst = checksum_bench_dst;
+		uint64_t ref_ps = checksum_bench_ps([&] { checksum_bench_sink = checksum_sum_ref(src, LEN); });
+		uint64_t sum_ps = checksum_bench_ps([&] { checksum_bench_sink = ducknet_checksum_sum(src, LEN); });
+		uint64_t memcpy_ps = checksum_bench_ps([&] { memcpy(dst, src, LEN); });
+		uint64_t copy_ps = checksum_bench_ps([&] { checksum_bench_sink = ducknet_checksum_copy(dst, src, LEN); });
+		
+		// ps per payload, printed as ns
+		return sprintf(res, "checksum-bench %s ref %lu.%03lu sum %lu.%03lu memcpy %lu.%03lu copy %lu.%03lu",
+			ok ? "ok" : "mismatch",
+			ref_ps / 1000, ref_ps % 1000, sum_ps / 1000, sum_ps % 1000,
+			memcpy_ps / 1000, memcpy_ps % 1000, copy_ps / 1000, copy_ps % 1000);
+	}
+	
 	static bool process_controls(char *content, int len, char *&res, int &res_len) {
 		res = NULL;
 		res_len = -1;
@@ -61,6 +152,21 @@ namespace DuckServer {
 			
 			res = content;
 			sprintf(res, "cpu-temp %lu", temp);
+		} else if (equals_to(content, len, "scheduler")) {
+			auto stat = Scheduler::get_stats();
+			res = content;
+			sprintf(res, "scheduler %lu %lu %lu %lu %lu",
+				stat.busy_ns, stat.spin_ns, stat.sleep_ns, stat.n_sleeps, stat.avg_gap_ns);
+		} else if (equals_to(content, len, "latency")) {
+			res = content;
+			Latency::format(res, 1024);
+		} else if (equals_to(content, len, "latency-reset")) {
+			Latency::reset();
+			res = content;
+			sprintf(res, "ok-latency-reset");
+		} else if (equals_to(content, len, "checksum-bench")) {
+			res = content;
+			res_len = checksum_bench(res);
 		} else if (equals_to(content, len, "sysinfo")) {
 			uint32_t rev = x86_64::get_microcode_revision();
 			res = content;
@@ -85,8 +191,13 @@ namespace DuckServer {
 		content[len] = 0;
 		
 		uint64_t q_off, q_off2, q_len;
-		const uint64_t MAX_QUERY_LEN = 1400;
-		static char q_res[2048];
+		const char read_prefix[] = "ok-read-buffer";
+		const uint64_t READ_HEADER_LEN = sizeof(read_prefix) - 1 + 8;
+		// Replies past one frame go out as IPv4 fragments, those that fit
+		// in one are built in place
+		const uint64_t MAX_QUERY_LEN = DUCKNET_UDP_MAX_PAYLOAD - READ_HEADER_LEN;
+		const uint64_t MAX_PKT_QUERY_LEN = 1400;
+		static char q_res[DUCKNET_UDP_MAX_PAYLOAD];
 		
 		if (equals_to(content, len, "query-buffer-size")) {
 			uint64_t buffer_size = Judger::query_buffer_size();
@@ -99,13 +210,26 @@ namespace DuckServer {
 			}
 		} else if (2 == sscanf(content, "read-buffer %lu %lu", &q_off, &q_len)) {
 			if (q_len > MAX_QUERY_LEN) return true;
-			if (Judger::read_buffer(q_off, q_len, q_res)) {
-				res = content;
-				res_len = sprintf(res, "ok-read-buffer");
-				* (uint64_t *) (res + res_len) = q_off;
-				res_len += 8;
-				memcpy(res + res_len, q_res, q_len);
-				res_len += q_len;
+			
+			// Straight from the Judger buffer into the frame that goes out
+			DucknetPkt *pkt = q_len <= MAX_PKT_QUERY_LEN ? ducknet_pkt_alloc(DUCKNET_PKT_HEADROOM) : NULL;
+			if (pkt) {
+				char *p = ducknet_pkt_put(pkt, READ_HEADER_LEN + q_len);
+				memcpy(p, read_prefix, sizeof(read_prefix) - 1);
+				memcpy(p + sizeof(read_prefix) - 1, &q_off, 8);
+				if (Judger::read_buffer(q_off, q_len, p + READ_HEADER_LEN)) {
+					send_reply_pkt(pkt);
+				} else {
+					ducknet_pkt_free(pkt);
+				}
+				return true;
+			}
+			
+			if (Judger::read_buffer(q_off, q_len, q_res + READ_HEADER_LEN)) {
+				res = q_res;
+				memcpy(res, read_prefix, sizeof(read_prefix) - 1);
+				memcpy(res + sizeof(read_prefix) - 1, &q_off, 8);
+				res_len = READ_HEADER_LEN + q_len;
 			}
 		} else if (starts_with(content, len, "write-buffer")) {
 			uint64_t tmp_len = strlen("write-buffer");
@@ -269,6 +393,7 @@ namespace DuckServer {
 			//   info-cache elf
 			//   info-cache data
 			//   cpu-temp
+			//   scheduler
 			
 			res = content;
 			res_len = 0;
@@ -295,6 +420,9 @@ namespace DuckServer {
 			process_controls(QUERY("cpu-temp"));
 			APPEND_RESULT();
 			
+			process_controls(QUERY("scheduler"));
+			APPEND_RESULT();
+			
 			#undef QUERY
 			#undef APPEND_RESULT
 		} else {
@@ -311,6 +439,11 @@ namespace DuckServer {
 		uint16_t sport, char *content, int content_len) {
 		// TODO: handle seq-num
 		
+		app_tsc = Timer::get_tsc();
+		Latency::add(Latency::STACK, app_tsc - stack_tsc);
+		reply_ip = src;
+		reply_port = sport;
+		
 		if (equals_to(content, content_len, "reboot")) {
 			Utils::GG_reboot();
 		} else {
@@ -326,7 +459,10 @@ namespace DuckServer {
 			#undef args
 			
 			if (to_send) {
+				const uint64_t send_tsc = Timer::get_tsc();
+				Latency::add(Latency::APP, send_tsc - app_tsc);
 				ducknet_udp_send(src, sport, DUCK_UDP_PORT, to_send, to_send_len);
+				Latency::add_tx(ducknet_phy_rx_time(), send_tsc);
 			}
 		}
 		
@@ -348,8 +484,41 @@ namespace DuckServer {
 		return -1;
 	}
 	
+	static_assert(sizeof(DucknetPacketRef) == sizeof(NetworkDriver::PacketRef),
+		"ducknet hands its refs straight to the driver");
+	static_assert(DUCKNET_CSUM_IPv4 == NetworkDriver::CSUM_IPv4
+		&& DUCKNET_CSUM_L4 == NetworkDriver::CSUM_L4
+		&& DUCKNET_CSUM_BAD == NetworkDriver::CSUM_BAD,
+		"ducknet passes checksum flags straight to the driver");
+	
+	static_assert(offsetof(DucknetPkt, data) == offsetof(NetworkDriver::TxBuffer, data)
+		&& offsetof(DucknetPkt, len) == offsetof(NetworkDriver::TxBuffer, len)
+		&& offsetof(DucknetPkt, csum) == offsetof(NetworkDriver::TxBuffer, csum),
+		"a DucknetPkt is a view of a TX buffer");
+	
+	static DucknetPkt *phy_pkt_alloc(int headroom) {
+		return (DucknetPkt *) NetworkDriver::tx_alloc(headroom);
+	}
+	
+	static int phy_pkt_send(DucknetPkt *pkt) {
+		return NetworkDriver::tx_send((NetworkDriver::TxBuffer *) pkt);
+	}
+	
+	static void phy_pkt_free(DucknetPkt *pkt) {
+		NetworkDriver::tx_free((NetworkDriver::TxBuffer *) pkt);
+	}
+	
+	static int phy_rx_burst(DucknetPacketRef *pkts, int max) {
+		return NetworkDriver::rx_burst((NetworkDriver::PacketRef *) pkts, max);
+	}
+	
 	static int phy_recv_packet_handle(void *, int) {
 		Scheduler::set_active();
+		
+		stack_tsc = Timer::get_tsc();
+		if (ducknet_phy_rx_time()) {
+			Latency::add(Latency::DRIVER, stack_tsc - ducknet_phy_rx_time());
+		}
 		return 0;
 	}
 	
@@ -364,6 +533,8 @@ namespace DuckServer {
 		if (Scheduler::can_sleep()) {
 			ducknet_flush();
 			Scheduler::sleep();
+		} else {
+			Scheduler::spin();
 		}
 		
 		return 0;
@@ -409,6 +580,7 @@ namespace DuckServer {
 		
 		init_microcode();
 		enable_turbo_boost();
+		Scheduler::init();
 		
 		my_mac = (DucknetMACAddress) {
 			.a = { mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] }
@@ -423,10 +595,16 @@ namespace DuckServer {
 		DucknetConfig conf = {
 			.utils = {
 				.tsc_freq = Timer::tsc_freq,
+				.use_avx2 = CPU::has_avx2,
 			},
 			.phy = {
 				.send = NetworkDriver::send,
-				.recv = NetworkDriver::receive,
+				.pkt_alloc = phy_pkt_alloc,
+				.pkt_send = phy_pkt_send,
+				.pkt_free = phy_pkt_free,
+				.tx_csum_offload = NetworkDriver::tx_csum_offload,
+				.rx_burst = phy_rx_burst,
+				.rx_release = NetworkDriver::rx_release,
 				.flush = NetworkDriver::flush,
 				.packet_handle = phy_recv_packet_handle,
 				.send_packet_handle = phy_send_packet_handle,
@@ -451,6 +629,7 @@ namespace DuckServer {
 				.packet_handle = udp_packet_handle,
 			},
 			.idle = idle,
+			.rx_burst = DUCKNET_DEFAULT_RX_BURST,
 		};
 		
 		if (ducknet_init(&conf) < 0) {
@@ -19,6 +19,7 @@
 #include <inc/judger.hpp>
 #include <inc/abi.hpp>
 #include <inc/contestant.hpp>
+#include <inc/cpu.hpp>
 
 static void print_hello() {
 	printf("Hello world!\n");
@@ -91,6 +92,7 @@ int main() {
 	
 	PIC::init();
 	Timer::init();
+	CPU::init();
 	LAPIC::init();
 	
 	Memory::init();
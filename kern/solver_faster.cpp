@@ -3,11 +3,17 @@
 #include <stdint.h>
 #include <assert.h>
 #include <x86intrin.h>
+#include <type_traits>
+#include <initializer_list>
 
 #include <inc/solver.hpp>
 #include <inc/timer.hpp>
+#include <inc/cpu.hpp>
+#include <inc/logger.hpp>
+#include <inc/console_ring.hpp>
+#include <inc/multiboot2_loader.hpp>
+#include <inc/histogram.hpp>
 
-// #pragma GCC target("avx2,avx512f")
 #pragma GCC optimize("Ofast")
 
 #define SERVER_ADDR "59.110.124.141"
@@ -20,219 +26,787 @@ static uint64_t tsc_freq_us = 0;
 namespace Reporter {
     const int MAX_N_STATS = 10;
     static struct Stat {
+        uint64_t seq;  // n_reports when it came in
         double local_latency;
         int n_digits;
         int m_number;
     } stats[MAX_N_STATS];
     static int n_stats = 0;
     
-    static double sum_latency = 0;
-    static int n_total_stats = 0;
+    // recv->send TSC deltas per modulus, reports are tagged M1..M4
+    const int MAX_M_NUMBER = 4;
+    static Histogram latency[MAX_M_NUMBER];
+    static uint64_t n_packets, n_bytes, n_reports;
+    
+    // Printed later by ConsoleRing::drain_one, off the receive path
+    static void format_stat(uint64_t, const void *data, int) {
+        const Stat *stat = (const Stat *) data;
+        printf(" #%lu: %d digits (M%d), local_lat %.2lf us\n",
+            stat->seq, stat->n_digits, stat->m_number,
+            stat->local_latency);
+    }
+    
+    static void format_progress(uint64_t, const void *, int) {
+        printf(".");fflush(stdout);
+    }
     
     static void print_stat(int bytes_processed) {
         for (int i = 0; i < n_stats; i++) {
-            sum_latency += stats[i].local_latency;
-            n_total_stats++;
-            
-            printf(" #%d: %d digits (M%d), local_lat %.0lf, avg %.2lf us\n",
-                n_total_stats,
-                stats[i].n_digits, stats[i].m_number,
-                stats[i].local_latency,
-                sum_latency / n_total_stats);
+            ConsoleRing::push(format_stat, &stats[i], sizeof(stats[i]));
         }
-        printf(".");fflush(stdout);
+        ConsoleRing::push(format_progress, NULL, 0);
         (void)(bytes_processed);
         n_stats = 0;
     }
     
-    static void add_stat(double local_latency, int n_digits, int m_number) {
+    static void reset_stat() {
+        n_stats = 0;
+    }
+    
+    static void reset_counters() {
+        memset(latency, 0, sizeof(latency));
+        n_packets = n_bytes = n_reports = 0;
+    }
+    
+    static void add_stat(uint64_t cycles, int n_digits, int m_number) {
+        n_reports++;
+        if (m_number >= 1 && m_number <= MAX_M_NUMBER) {
+            latency[m_number - 1].add(cycles);
+        }
+        
         if (n_stats >= MAX_N_STATS) return;
         stats[n_stats++] = (Stat) {
-            local_latency, n_digits, m_number
+            n_reports, cycles / (double) tsc_freq_us, n_digits, m_number
         };
     }
     
-    const char *header_format =
+    static int format_counters(char *buf, int size) {
+        int len = snprintf(buf, size, "packets %lu, bytes %lu, reports %lu\n",
+            n_packets, n_bytes, n_reports);
+        
+        for (int i = 0; i < MAX_M_NUMBER && len < size; i++) {
+            const Histogram &h = latency[i];
+            const double f = tsc_freq_us;
+            len += snprintf(buf + len, size - len,
+                "M%d: n %lu, p50 %.2lf, p99 %.2lf, p99.9 %.2lf, max %.2lf us\n",
+                i + 1, h.total,
+                h.percentile(0.5) / f, h.percentile(0.99) / f,
+                h.percentile(0.999) / f, h.max / f);
+        }
+        
+        return len < size ? len : size - 1;
+    }
+    
+    // The request header with Content-Length split out: everything before
+    // the number never changes and sits in request[] from the first report on
+    const char *header_prefix =
     "POST /submit"  " HTTP/1.1\r\n"
     "Host: " SERVER_ADDR ":10002\r\n"
     "User-Agent: curl/7.68.0\r\n"
     "Accept: */*\r\n"
-    "Content-Length: %d\r\n"
+    "Content-Length: ";
+    
+    const char header_suffix[] =
+    "\r\n"
     "Content-Type: application/x-www-form-urlencoded\r\n"
     "\r\n";
     
+    static char request[1024];
+    static int header_prefix_len = 0;
+    
+    // Writes the header for a len-byte body, returns where the body goes
+    static char *begin_request(int len) {
+        if (header_prefix_len == 0) {
+            header_prefix_len = strlen(header_prefix);
+            memcpy(request, header_prefix, header_prefix_len);
+        }
+        
+        char num[12];
+        int n_num = 0;
+        do {
+            num[n_num++] = '0' + len % 10;
+            len /= 10;
+        } while (len);
+        
+        char *p = request + header_prefix_len;
+        while (n_num) *p++ = num[--n_num];
+        memcpy(p, header_suffix, sizeof(header_suffix) - 1);
+        return p + sizeof(header_suffix) - 1;
+    }
+    
     static bool send_request(const char *buf, int len, int n_digits, int m_number) {
         last_send_tsc = __rdtsc();
-        double local_latency = (last_send_tsc - last_recv_tsc) / (double) tsc_freq_us;
         
-        add_stat(local_latency, n_digits, m_number);
+        add_stat(last_send_tsc - last_recv_tsc, n_digits, m_number);
         send_fn(buf, len);
         
         return true;
     }
     
-    static void report_string(const char *str, int len, int m_number) {
-        static char buf[1024];
-        int header_len = sprintf(buf, header_format, len);
-        
-        memcpy(buf + header_len, str, len);
-        send_request(buf, header_len + len, len, m_number);
-    }
-    
-    static void report_digits(const int *digits, int len, int m_number) {
+    static void report_digits(const uint8_t *digits, int len, int min_len, int m_number) {
         if (digits[0] == 0) return;
-        if (m_number == 1 && len < 14) return;
-        if (m_number == 2 && len < 27) return;
-        if (m_number == 3 && len < 54) return;
-        if (m_number == 4 && len < 68) return;
+        if (len < min_len) return;
         
-        static char buf[1024];
+        char *body = begin_request(len);
         for (int i = 0; i < len; i++) {
-            buf[i] = digits[i] + '0';
+            body[i] = digits[i] + '0';
         }
         
-        report_string(buf, len, m_number);
+        send_request(request, body + len - request, len, m_number);
     }
 }
 
 namespace Solver {
+    #define u8 uint8_t
     #define u16 uint16_t
     #define u32 uint32_t
     #define u64 uint64_t
     #define u128 __uint128_t
     
-    const int N = 256;
-    const int MAX_BATCH_SIZE = 400;
-    const int HASH_SIZE = 1024;
+    // ===== Modulus: arithmetic type and reduction are picked from M =====
     
-    // ===== M1, M2, M3, M4 =====
+    enum Reduction {
+        RED_U32_LANES,  // M < 2^31: s = a + b; min(s, s - M) in u32 lanes
+        RED_U64_LANES,  // M < 2^62: s = a + b; s - (s > M - 1 ? M : 0) in u64 lanes
+        RED_SCALAR,     // otherwise: u128, one scalar chain
+    };
     
-    // const u64 M1 = 20220311122858ull;
-    const u32 M1 = 299236546;  // 2*7*887*24097
+    // min_len: shorter matches are not reported, number: M<number> in reports
+    template <u128 M, int MinLen, int Number>
+    struct Modulus {
+        static constexpr Reduction reduction =
+            M < (1ull << 31) ? RED_U32_LANES :
+            M < (1ull << 62) ? RED_U64_LANES : RED_SCALAR;
+        
+        typedef typename std::conditional<reduction == RED_U32_LANES, u32,
+            typename std::conditional<reduction == RED_U64_LANES, u64, u128>::type>::type T;
+        
+        static constexpr T value = M;
+        static constexpr int min_len = MinLen;
+        static constexpr int number = Number;
+        
+        static inline T add_mod(T a, T b) {
+            T sum = a + b;
+            return sum >= value ? sum - value : sum;
+        }
+    };
     
-    // 104648257118348370704723401
-    const u128 M2 = (u128) 1046482571183 * (u128) 100000000000000 + 48370704723401ull;
+    // e[i * 10 + d] = d * 10^(L - 1 - i) mod M
+    template <typename Mod, int L>
+    struct PowerTable {
+        typedef typename Mod::T T;
+        T e[10 * L];
+        
+        constexpr PowerTable() : e() {
+            T cur = 1;
+            
+            for (int i = L - 1; i >= 0; i--) {
+                T tmp = 0;
+                
+                for (int j = 0; j <= 9; j++) {
+                    e[i * 10 + j] = tmp;
+                    tmp = tmp + cur >= Mod::value ? tmp + cur - Mod::value : tmp + cur;
+                }
+                
+                cur = tmp;
+            }
+        }
+    };
     
-    const u64 M3 = 500000000000000000ull + 243ull;
+    // ===== Hash =====
     
-    const u32 M4 = 387420489;  // 3^18
+    const int HASH_GROUP_SIZE = 32;
     
-    // =====
+    // Tag match over one probe group, bit i set if tags[i] == tag
+    struct MatchSSE2 {
+        static inline u32 match(const u8 *tags, u8 tag) {
+            __m128i t = _mm_set1_epi8(tag);
+            __m128i lo = _mm_load_si128((const __m128i *) tags);
+            __m128i hi = _mm_load_si128((const __m128i *) (tags + 16));
+            return (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(lo, t))
+                | (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(hi, t)) << 16;
+        }
+    };
     
-    static int digits[N + MAX_BATCH_SIZE];  // N-1 ... 0
+    // Only inlined into flatten'ed target("avx2") callers
+    struct MatchAVX2 {
+        __attribute__((target("avx2")))
+        static inline u32 match(const u8 *tags, u8 tag) {
+            __m256i t = _mm256_set1_epi8(tag);
+            __m256i v = _mm256_load_si256((const __m256i *) tags);
+            return (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, t));
+        }
+    };
+    
+    static constexpr int ceil_log2(int x) {
+        return x <= 1 ? 0 : 1 + ceil_log2((x + 1) / 2);
+    }
     
+    // Open addressing, 32-slot probe groups, 8-bit tags (0 = empty).
+    // No deletion: a group with an empty slot ends the probe sequence,
+    // and equal keys are laid out in insertion order along it.
+    // Sized for at most max_entries inserts between clears, load below 1/2.
+    template <int N, int max_entries>
     struct Hash {
-        u16 first[HASH_SIZE];
-        u16 next[N + MAX_BATCH_SIZE + 5];
-        u16 values[N + MAX_BATCH_SIZE + 5];
-        u64 keys[N + MAX_BATCH_SIZE + 5];
-        u32 cnt;
+        static const int SIZE_LOG2 = ceil_log2(max_entries * 2 + 1);
+        static const int SIZE = 1 << SIZE_LOG2;
+        static const int GROUPS_LOG2 = SIZE_LOG2 - 5;
+        
+        static_assert(HASH_GROUP_SIZE == 32, "one AVX2 compare per probe group");
+        static_assert(max_entries < 65536, "values are u16");
+        
+        struct Slot {
+            u64 key;
+            u16 value;
+        } __attribute__((aligned(16)));  // 4 slots per cache line
+        
+        u8 tags[SIZE] __attribute__((aligned(64)));
+        Slot slots[SIZE] __attribute__((aligned(64)));
+        
+        static inline u64 hash(u64 key) {
+            return key * 0x9e3779b97f4a7c15ull;
+        }
+        
+        static inline u32 group_of(u64 h) {
+            return h >> (64 - GROUPS_LOG2);
+        }
+        
+        static inline u8 tag_of(u64 h) {
+            return 0x80 | ((h >> (57 - GROUPS_LOG2)) & 0x7f);
+        }
         
         void clear() {
-            cnt = 0;
-            memset(first, 0, sizeof(first));
+            memset(tags, 0, sizeof(tags));
         }
         
+        template <typename Match>
         void insert(u64 key, u32 value) {
-            u32 idx = key & (HASH_SIZE - 1);
+            u64 h = hash(key);
+            u32 g = group_of(h);
             
-            cnt++;
-            next[cnt] = first[idx];
-            keys[cnt] = key;
-            values[cnt] = value;
-            first[idx] = cnt;
+            while (1) {
+                u32 base = g * HASH_GROUP_SIZE;
+                u32 m = Match::match(tags + base, 0);
+                if (m) {
+                    u32 i = base + __builtin_ctz(m);
+                    tags[i] = tag_of(h);
+                    slots[i].key = key;
+                    slots[i].value = value;
+                    return;
+                }
+                g = (g + 1) & ((1 << GROUPS_LOG2) - 1);
+            }
         }
         
-        void query_all(u64 key, u32 q_idx, int m_number) {
-            u32 idx = key & (HASH_SIZE - 1);
+        template <typename Mod, typename Match>
+        void query_all(u64 key, u32 q_idx, const u8 *digits) {
+            u64 h = hash(key);
+            u32 g = group_of(h);
+            u8 tag = tag_of(h);
             
-            for (u32 i = first[idx]; i; i = next[i]) {
-                if (keys[i] != key) continue;
-                
-                u32 value = values[i];
-                if (q_idx - value > N) continue;
-                
+            u16 found[N];
+            int n_found = 0;
+            
+            while (1) {
+                u32 base = g * HASH_GROUP_SIZE;
+                for (u32 m = Match::match(tags + base, tag); m; m &= m - 1) {
+                    const Slot &slot = slots[base + __builtin_ctz(m)];
+                    if (slot.key != key) continue;
+                    
+                    u32 value = slot.value;
+                    if (q_idx - value > N) continue;
+                    
+                    found[n_found++] = value;
+                }
+                if (Match::match(tags + base, 0)) break;
+                g = (g + 1) & ((1 << GROUPS_LOG2) - 1);
+            }
+            
+            // newest first
+            while (n_found--) {
                 // value is digit idx
-                Reporter::report_digits(digits + value + 1, q_idx - value, m_number);
+                u32 value = found[n_found];
+                Reporter::report_digits(digits + value + 1, q_idx - value,
+                    Mod::min_len, Mod::number);
             }
         }
     };
     
-    static Hash h1, h2, h3, h4;
+    // ===== SIMD lanes: prefix sums of one block of digits for one modulus =====
     
-    template <typename T>
-    static inline T add_mod(T a, T b, T M) {
-        T sum = a + b;
-        return sum >= M ? sum - M : sum;
-    }
+    template <Reduction R>
+    struct Lanes;
     
-    static u32 e1[10 * (N + MAX_BATCH_SIZE)];
-    static u128 e2[10 * (N + MAX_BATCH_SIZE)];
-    static u64 e3[10 * (N + MAX_BATCH_SIZE)];
-    static u32 e4[10 * (N + MAX_BATCH_SIZE)];
+    // avx512fintrin.h seeds unmasked ops with _mm512_undefined_*()
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wuninitialized"
+    #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
     
-    static u32 sum1;
-    static u128 sum2;
-    static u64 sum3;
-    static u32 sum4;
+    template <>
+    struct Lanes<RED_U32_LANES> {
+        __attribute__((target("avx2")))
+        static inline __m256i add_mod(__m256i a, __m256i b, __m256i m) {
+            __m256i s = _mm256_add_epi32(a, b);
+            return _mm256_min_epu32(s, _mm256_sub_epi32(s, m));
+        }
+        
+        __attribute__((target("avx2")))
+        static inline __m256i scan(__m256i x, __m256i m) {
+            x = add_mod(x, _mm256_slli_si256(x, 4), m);
+            x = add_mod(x, _mm256_slli_si256(x, 8), m);
+            __m256i t = _mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+            return add_mod(x, _mm256_permute2x128_si256(t, t, 0x08), m);
+        }
+        
+        // 8 digits, idx[k] = (pos + k) * 10 + digit
+        template <typename T>
+        __attribute__((target("avx2")))
+        static inline void scan_avx2(const T *e, T M, __m256i idx, T &sum, T *p) {
+            const __m256i m = _mm256_set1_epi32(M);
+            __m256i x = _mm256_i32gather_epi32((const int *) e, idx, 4);
+            x = add_mod(scan(x, m), _mm256_set1_epi32(sum), m);
+            _mm256_storeu_si256((__m256i *) p, x);
+            sum = _mm256_extract_epi32(x, 7);
+        }
+        
+        __attribute__((target("avx512f")))
+        static inline __m512i add_mod(__m512i a, __m512i b, __m512i m) {
+            __m512i s = _mm512_add_epi32(a, b);
+            return _mm512_min_epu32(s, _mm512_sub_epi32(s, m));
+        }
+        
+        __attribute__((target("avx512f")))
+        static inline __m512i scan(__m512i x, __m512i m) {
+            const __m512i z = _mm512_setzero_si512();
+            x = add_mod(x, _mm512_alignr_epi32(x, z, 15), m);
+            x = add_mod(x, _mm512_alignr_epi32(x, z, 14), m);
+            x = add_mod(x, _mm512_alignr_epi32(x, z, 12), m);
+            x = add_mod(x, _mm512_alignr_epi32(x, z, 8), m);
+            return x;
+        }
+        
+        // 16 digits
+        template <typename T>
+        __attribute__((target("avx512f")))
+        static inline void scan_avx512(const T *e, T M, __m512i idx, T &sum, T *p) {
+            const __m512i m = _mm512_set1_epi32(M);
+            __m512i x = _mm512_i32gather_epi32(idx, (const void *) e, 4);
+            x = add_mod(scan(x, m), _mm512_set1_epi32(sum), m);
+            _mm512_storeu_si512((void *) p, x);
+            sum = p[15];
+        }
+    };
     
-    template <typename T>
-    static void do_add_digits(int len, T sum, const T *e, Hash &h, T M, int m_number) {
-        for (int i = 0; i < len; i++) {
-            int d = digits[N + i];
-            sum = add_mod(sum, e[(N + i) * 10 + d], M);
+    template <>
+    struct Lanes<RED_U64_LANES> {
+        __attribute__((target("avx2")))
+        static inline __m256i add_mod(__m256i a, __m256i b, __m256i m) {
+            __m256i s = _mm256_add_epi64(a, b);
+            __m256i ge = _mm256_cmpgt_epi64(s, _mm256_sub_epi64(m, _mm256_set1_epi64x(1)));
+            return _mm256_sub_epi64(s, _mm256_and_si256(ge, m));
+        }
+        
+        __attribute__((target("avx2")))
+        static inline __m256i scan(__m256i x, __m256i m) {
+            x = add_mod(x, _mm256_slli_si256(x, 8), m);
+            __m256i t = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 1, 0, 0));
+            t = _mm256_blend_epi32(t, _mm256_setzero_si256(), 0x0f);
+            return add_mod(x, t, m);
+        }
+        
+        template <typename T>
+        __attribute__((target("avx2")))
+        static inline void scan_avx2(const T *e, T M, __m256i idx, T &sum, T *p) {
+            const __m256i m = _mm256_set1_epi64x(M);
+            __m256i lo = _mm256_i32gather_epi64((const long long *) e, _mm256_castsi256_si128(idx), 8);
+            __m256i hi = _mm256_i32gather_epi64((const long long *) e, _mm256_extracti128_si256(idx, 1), 8);
+            lo = add_mod(scan(lo, m), _mm256_set1_epi64x(sum), m);
+            hi = add_mod(scan(hi, m), _mm256_permute4x64_epi64(lo, _MM_SHUFFLE(3, 3, 3, 3)), m);
+            _mm256_storeu_si256((__m256i *) p, lo);
+            _mm256_storeu_si256((__m256i *) (p + 4), hi);
+            sum = _mm256_extract_epi64(hi, 3);
+        }
+        
+        __attribute__((target("avx512f")))
+        static inline __m512i add_mod(__m512i a, __m512i b, __m512i m) {
+            __m512i s = _mm512_add_epi64(a, b);
+            return _mm512_min_epu64(s, _mm512_sub_epi64(s, m));
+        }
+        
+        __attribute__((target("avx512f")))
+        static inline __m512i scan(__m512i x, __m512i m) {
+            const __m512i z = _mm512_setzero_si512();
+            x = add_mod(x, _mm512_alignr_epi64(x, z, 7), m);
+            x = add_mod(x, _mm512_alignr_epi64(x, z, 6), m);
+            x = add_mod(x, _mm512_alignr_epi64(x, z, 4), m);
+            return x;
+        }
+        
+        template <typename T>
+        __attribute__((target("avx512f")))
+        static inline void scan_avx512(const T *e, T M, __m512i idx, T &sum, T *p) {
+            const __m512i m = _mm512_set1_epi64(M);
+            const __m512i last = _mm512_set1_epi64(7);
+            __m512i lo = _mm512_i32gather_epi64(_mm512_castsi512_si256(idx), (const void *) e, 8);
+            __m512i hi = _mm512_i32gather_epi64(_mm512_extracti64x4_epi64(idx, 1), (const void *) e, 8);
+            lo = add_mod(scan(lo, m), _mm512_set1_epi64(sum), m);
+            hi = add_mod(scan(hi, m), _mm512_permutexvar_epi64(last, lo), m);
+            _mm512_storeu_si512((void *) p, lo);
+            _mm512_storeu_si512((void *) (p + 8), hi);
+            sum = p[15];
+        }
+    };
+    
+    // Does not fit in a SIMD lane, chained inside the same loop
+    template <>
+    struct Lanes<RED_SCALAR> {
+        template <typename T>
+        static inline void scan_scalar(const T *e, T M, const u8 *digits, int pos, int cnt, T &sum, T *p) {
+            for (int k = 0; k < cnt; k++) {
+                sum = sum + e[(pos + k) * 10 + digits[pos + k]];
+                sum = sum >= M ? sum - M : sum;
+                p[k] = sum;
+            }
+        }
+    };
+    
+    // ===== ASCII digits -> u8, validated on the way =====
+    
+    // Each variant writes buf[i] - '0' to dst[i] and returns the first i
+    // where buf[i] is not '0'..'9', or len. The last partial vector is done
+    // by re-running the final full vector, overlapping the one before it.
+    static int convert_digits_scalar(u8 *dst, const char *buf, int len, int i = 0) {
+        for (; i < len; i++) {
+            u8 d = buf[i] - '0';
+            if (d > 9) return i;
+            dst[i] = d;
+        }
+        return len;
+    }
+    
+    static int convert_digits_sse2(u8 *dst, const char *buf, int len) {
+        const __m128i zero = _mm_set1_epi8('0');
+        const __m128i nine = _mm_set1_epi8(9);
+        
+        if (len < 16) return convert_digits_scalar(dst, buf, len);
+        
+        for (int i = 0; ; i += 16) {
+            if (i + 16 > len) i = len - 16;
+            
+            __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (buf + i)), zero);
+            u32 bad = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(d, nine), nine)) & 0xffff;
+            if (bad) return i + __builtin_ctz(bad);
+            _mm_storeu_si128((__m128i *) (dst + i), d);
             
-            h.query_all((u64) sum, N + i, m_number);
-            h.insert((u64) sum, N + i);
+            if (i + 16 == len) return len;
         }
     }
     
-    static void add_digits(int *new_digits, int len) {
-        memcpy(digits + N, new_digits, len * sizeof(int));
+    __attribute__((target("avx2")))
+    static int convert_digits_avx2(u8 *dst, const char *buf, int len) {
+        const __m256i zero = _mm256_set1_epi8('0');
+        const __m256i nine = _mm256_set1_epi8(9);
         
-        do_add_digits(len, sum1, e1, h1, M1, 1);
-        do_add_digits(len, sum4, e4, h4, M4, 4);
-        do_add_digits(len, sum3, e3, h3, M3, 3);
-        do_add_digits(len, sum2, e2, h2, M2, 2);
+        if (len < 32) return convert_digits_sse2(dst, buf, len);
         
-        memmove(digits, digits + len, N * sizeof(digits[0]));
+        for (int i = 0; ; i += 32) {
+            if (i + 32 > len) i = len - 32;
+            
+            __m256i d = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) (buf + i)), zero);
+            u32 bad = ~(u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(d, nine), nine));
+            if (bad) return i + __builtin_ctz(bad);
+            _mm256_storeu_si256((__m256i *) (dst + i), d);
+            
+            if (i + 32 == len) return len;
+        }
     }
     
-    template <typename T>
-    static void init_e(T *e, T M) {
-        T cur = 1;
+    static inline int convert_digits(u8 *dst, const char *buf, int len) {
+        return CPU::has_avx2 ? convert_digits_avx2(dst, buf, len) : convert_digits_sse2(dst, buf, len);
+    }
+    
+    // ===== SolverEngine =====
+    
+    // Per-modulus state; the engine inherits one of these per modulus
+    template <typename Mod, int N, int MAX_BATCH_SIZE, int WINDOW_CAPACITY>
+    struct ModState {
+        typedef typename Mod::T T;
+        
+        static constexpr PowerTable<Mod, WINDOW_CAPACITY> table{};
+        
+        T sum;
+        T p[MAX_BATCH_SIZE];  // p[i] = sum after digit n_digits + i
+        Hash<N, WINDOW_CAPACITY> h;
+        
+        void scan_scalar(const u8 *digits, int pos, int i, int cnt) {
+            Lanes<RED_SCALAR>::scan_scalar(table.e, Mod::value, digits, pos + i, cnt, sum, p + i);
+        }
+        
+        template <Reduction R = Mod::reduction>
+        __attribute__((target("avx2")))
+        typename std::enable_if<R != RED_SCALAR>::type
+        scan_avx2(const u8 *, int, int i, __m256i idx) {
+            Lanes<R>::scan_avx2(table.e, Mod::value, idx, sum, p + i);
+        }
+        
+        template <Reduction R = Mod::reduction>
+        typename std::enable_if<R == RED_SCALAR>::type
+        scan_avx2(const u8 *digits, int pos, int i, const __m256i &) {
+            scan_scalar(digits, pos, i, 8);
+        }
+        
+        template <Reduction R = Mod::reduction>
+        __attribute__((target("avx512f")))
+        typename std::enable_if<R != RED_SCALAR>::type
+        scan_avx512(const u8 *, int, int i, __m512i idx) {
+            Lanes<R>::scan_avx512(table.e, Mod::value, idx, sum, p + i);
+        }
+        
+        template <Reduction R = Mod::reduction>
+        typename std::enable_if<R == RED_SCALAR>::type
+        scan_avx512(const u8 *digits, int pos, int i, const __m512i &) {
+            scan_scalar(digits, pos, i, 16);
+        }
+        
+        template <typename Match>
+        void query(const u8 *digits, int pos, int len) {
+            for (int i = 0; i < len; i++) {
+                h.template query_all<Mod, Match>((u64) p[i], pos + i, digits);
+                h.template insert<Match>((u64) p[i], pos + i);
+            }
+            sum = p[len - 1];
+        }
+        
+        void rebuild(const u8 *digits) {
+            sum = 233333333 % Mod::value;
+            h.clear();
+            
+            for (int i = 0; i < N; i++) {
+                sum = Mod::add_mod(sum, table.e[i * 10 + digits[i]]);
+                h.template insert<MatchSSE2>((u64) sum, i);
+            }
+        }
+    };
+    
+    template <typename Mod, int N, int MAX_BATCH_SIZE, int WINDOW_CAPACITY>
+    constexpr PowerTable<Mod, WINDOW_CAPACITY> ModState<Mod, N, MAX_BATCH_SIZE, WINDOW_CAPACITY>::table;
+    
+    // Evaluates expr for every modulus, in the order of the parameter pack
+    #define FOR_EACH_MODULUS(expr) \
+        ((void) std::initializer_list<int> { ((expr), 0)... })
+    
+    // N: window size, MAX_BATCH_SIZE: longest recv_input,
+    // Moduli: Modulus<...> in probe (and report) order
+    template <int N, int MAX_BATCH_SIZE, typename... Moduli>
+    struct SolverEngine {
+        static const int max_batch = MAX_BATCH_SIZE;
+        
+        // digits[] is rebased (last N digits moved to the front) only when
+        // fewer than MAX_BATCH_SIZE free positions remain
+        static const int WINDOW_CAPACITY = N + 4 * MAX_BATCH_SIZE;
+        
+        static_assert((N & -N) == N, "N must be a power of 2");
+        static_assert(MAX_BATCH_SIZE % 16 == 0, "SIMD kernels work on whole 16-digit blocks");
+        
+        template <typename Mod>
+        using State = ModState<Mod, N, MAX_BATCH_SIZE, WINDOW_CAPACITY>;
+        
+        // digits[0 .. n_digits), the window is the last N of them
+        u8 digits[WINDOW_CAPACITY];
+        int n_digits;
+        
+        struct States : State<Moduli>... {} states;
+        
+        template <typename Mod>
+        State<Mod> &state() {
+            return static_cast<State<Mod> &>(states);
+        }
+        
+        void scan_batch_scalar(int len) {
+            FOR_EACH_MODULUS(state<Moduli>().scan_scalar(digits, n_digits, 0, len));
+        }
         
-        for (int i = N + MAX_BATCH_SIZE - 1; i >= 0; i--) {
-            T tmp = 0;
+        // MAX_BATCH_SIZE is a multiple of 16, lanes past len are ignored
+        __attribute__((target("avx2")))
+        void scan_batch_avx2(int len) {
+            __m256i base = _mm256_setr_epi32(0, 10, 20, 30, 40, 50, 60, 70);
+            base = _mm256_add_epi32(base, _mm256_set1_epi32(n_digits * 10));
             
-            for (int j = 0; j <= 9; j++) {
-                e[i * 10 + j] = tmp;
-                tmp = add_mod(tmp, cur, M);
+            for (int i = 0; i < len; i += 8) {
+                __m256i d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (digits + n_digits + i)));
+                __m256i idx = _mm256_add_epi32(base, d);
+                base = _mm256_add_epi32(base, _mm256_set1_epi32(80));
+                
+                FOR_EACH_MODULUS(state<Moduli>().scan_avx2(digits, n_digits, i, idx));
             }
+        }
+        
+        __attribute__((target("avx512f")))
+        void scan_batch_avx512(int len) {
+            __m512i base = _mm512_setr_epi32(
+                0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 110, 120, 130, 140, 150);
+            base = _mm512_add_epi32(base, _mm512_set1_epi32(n_digits * 10));
             
-            cur = tmp;
+            for (int i = 0; i < len; i += 16) {
+                __m512i d = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) (digits + n_digits + i)));
+                __m512i idx = _mm512_add_epi32(base, d);
+                base = _mm512_add_epi32(base, _mm512_set1_epi32(160));
+                
+                FOR_EACH_MODULUS(state<Moduli>().scan_avx512(digits, n_digits, i, idx));
+            }
         }
-    }
+        
+        void query_batch_sse2(int len) {
+            FOR_EACH_MODULUS(state<Moduli>().template query<MatchSSE2>(digits, n_digits, len));
+        }
+        
+        __attribute__((target("avx2"), flatten))
+        void query_batch_avx2(int len) {
+            FOR_EACH_MODULUS(state<Moduli>().template query<MatchAVX2>(digits, n_digits, len));
+        }
+        
+        // new digits are already at digits[n_digits .. n_digits + len)
+        void add_digits(int len) {
+            if (CPU::has_avx512f) {
+                scan_batch_avx512(len);
+            } else if (CPU::has_avx2) {
+                scan_batch_avx2(len);
+            } else {
+                scan_batch_scalar(len);
+            }
+            
+            if (CPU::has_avx2) {
+                query_batch_avx2(len);
+            } else {
+                query_batch_sse2(len);
+            }
+            
+            n_digits += len;
+        }
+        
+        // Move the window to the front of digits[] and rebuild the hashes
+        void rebase() {
+            memmove(digits, digits + n_digits - N, N);
+            n_digits = N;
+            
+            FOR_EACH_MODULUS(state<Moduli>().rebuild(digits));
+        }
+        
+        // ===== entry points =====
+        
+        static SolverEngine engine;
+        
+        static void init() {
+            for (int i = 0; i < N; i++) {
+                engine.digits[i] = 9;
+            }
+            engine.n_digits = N;
+            engine.rebase();
+        }
+        
+        // Digits are converted in place past n_digits and only taken in
+        // when all of buf is valid
+        static int recv_input(const char *buf, int len) {
+            assert(1 <= len && len <= MAX_BATCH_SIZE);
+            
+            int bad = convert_digits(engine.digits + engine.n_digits, buf, len);
+            if (bad < len) return bad;
+            
+            engine.add_digits(len);
+            return len;
+        }
+        
+        // Make room for the next batch, rebasing only when digits[] is full
+        static void prepare() {
+            if (engine.n_digits + MAX_BATCH_SIZE > WINDOW_CAPACITY) {
+                engine.rebase();
+            }
+        }
+    };
+    
+    template <int N, int MAX_BATCH_SIZE, typename... Moduli>
+    SolverEngine<N, MAX_BATCH_SIZE, Moduli...> SolverEngine<N, MAX_BATCH_SIZE, Moduli...>::engine;
+    
+    #pragma GCC diagnostic pop
+    
+    #undef FOR_EACH_MODULUS
+    
+    // ===== Contest configurations =====
+    
+    // 104648257118348370704723401
+    const u128 M2 = (u128) 1046482571183 * (u128) 100000000000000 + 48370704723401ull;
     
-    template <typename T>
-    static void do_prepare_digits(T &sum, const T *e, Hash &h, T M) {
-        sum = 233333333;
-        h.clear();
+    typedef SolverEngine<256, 400,
+        Modulus<299236546, 14, 1>,  // 2*7*887*24097
+        Modulus<387420489, 68, 4>,  // 3^18
+        Modulus<500000000000000000ull + 243ull, 54, 3>,
+        Modulus<M2, 27, 2>
+    > EngineOnsite;
+    
+    // Same as onsite, with the earlier 14-digit M1 (u64 lanes)
+    typedef SolverEngine<256, 400,
+        Modulus<20220311122858ull, 14, 1>,
+        Modulus<387420489, 68, 4>,
+        Modulus<500000000000000000ull + 243ull, 54, 3>,
+        Modulus<M2, 27, 2>
+    > EngineOnsiteM1_20220311122858;
+    
+    // Selected with "solver=<name>" on the kernel command line
+    static const struct Engine {
+        const char *name;
+        int max_batch_size;
+        void (*init)();
+        int (*recv_input)(const char *buf, int len);
+        void (*prepare)();
+    } engines[] = {
+        {
+            "onsite", EngineOnsite::max_batch,
+            EngineOnsite::init,
+            EngineOnsite::recv_input,
+            EngineOnsite::prepare
+        },
+        {
+            "onsite-m1-20220311122858", EngineOnsiteM1_20220311122858::max_batch,
+            EngineOnsiteM1_20220311122858::init,
+            EngineOnsiteM1_20220311122858::recv_input,
+            EngineOnsiteM1_20220311122858::prepare
+        },
+    };
+    const int n_engines = sizeof(engines) / sizeof(engines[0]);
+    
+    static const Engine *engine = &engines[0];
+    
+    static const Engine *find_engine(const char *cmdline) {
+        const int MAX_LEN = 256;
         
-        for (int i = 0; i < N; i++) {
-            int d = digits[i];
-            sum = add_mod(sum, e[i * 10 + d], M);
+        for (const char *ch = cmdline; *ch; ch++) {
+            if (*ch == ' ') continue;
+            
+            char buf[MAX_LEN], content[MAX_LEN];
+            int buf_len = 0;
+            while (*ch && *ch != ' ' && *ch != '\t' && buf_len + 1 < MAX_LEN) {
+                buf[buf_len++] = *ch;
+                ch++;
+            }
+            buf[buf_len] = 0;
             
-            h.insert((u64) sum, i);
-            sum = sum;
+            if (1 == sscanf(buf, " solver = %s ", content)) {
+                for (int i = 0; i < n_engines; i++) {
+                    if (strcmp(engines[i].name, content) == 0) {
+                        return &engines[i];
+                    }
+                }
+                LWARN("Solver: unknown solver %s, using %s", content, engines[0].name);
+            }
+            
+            if (!*ch) break;
         }
+        
+        return &engines[0];
     }
     
     void prepare() {
-        do_prepare_digits(sum1, e1, h1, M1);
-        do_prepare_digits(sum2, e2, h2, M2);
-        do_prepare_digits(sum3, e3, h3, M3);
-        do_prepare_digits(sum4, e4, h4, M4);
+        engine->prepare();
     }
     
     void init(void (*send)(const char *, int)) {
@@ -240,31 +814,48 @@ namespace Solver {
         printf("tsc_freq = %lu\n", tsc_freq_us);
         
         send_fn = send;
-        assert((N & -N) == N);
         
-        for (int i = 0; i < N; i++) {
-            digits[i] = 9;
+        if (Multiboot2_Loader::command_line) {
+            engine = find_engine(Multiboot2_Loader::command_line);
         }
         
-        init_e(e1, M1);
-        init_e(e2, M2);
-        init_e(e3, M3);
-        init_e(e4, M4);
+        LINFO("Solver: engine %s, %s prefix-sum kernel", engine->name,
+            CPU::has_avx512f ? "AVX-512" : CPU::has_avx2 ? "AVX2" : "scalar");
         
-        prepare();
+        engine->init();
     }
     
-    void recv_input(const char *buf, int len) {
-        assert(1 <= len && len <= MAX_BATCH_SIZE);
+    int recv_input(const char *buf, int len) {
         last_recv_tsc = __rdtsc();
         
-        static int new_digits[MAX_BATCH_SIZE];
-        
-        for (int i = 0; i < len; i++) {
-            new_digits[i] = buf[i] - '0';
+        int r = engine->recv_input(buf, len);
+        if (r == len) {
+            Reporter::n_packets++;
+            Reporter::n_bytes += len;
         }
-        
-        add_digits(new_digits, len);
+        return r;
+    }
+    
+    void set_send(void (*send)(const char *, int)) {
+        send_fn = send;
+    }
+    
+    void reset() {
+        Reporter::reset_stat();
+        Reporter::reset_counters();
+        engine->init();
+    }
+    
+    int format_stats(char *buf, int size) {
+        return Reporter::format_counters(buf, size);
+    }
+    
+    void reset_stats() {
+        Reporter::reset_counters();
+    }
+    
+    int max_batch_size() {
+        return engine->max_batch_size;
     }
     
     void print_stat(int bytes_processed) {
@@ -194,9 +194,9 @@ namespace Trap {
 			// Flush TLB to show A/D bits
 			x86_64::lcr3(x86_64::rcr3());
 		} else {
-			if (num == TRAP_IRQ + PIC::IRQ_TIMER) {
-				// timer interrupt caused by scheduler
-				// just return with interrupts disabled
+			if (num == TRAP_IRQ + PIC::IRQ_TIMER || num == TRAP_WAKEUP) {
+				// timer interrupt caused by scheduler, or the NIC ending
+				// that sleep early: just return with interrupts disabled
 				LAPIC::eoi();
 				LAPIC::timer_disable();
 				tf->tf_rflags &= ~0x200;  // disable interrupts
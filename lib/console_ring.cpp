@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include <inc/console_ring.hpp>
+#include <inc/x86_64.hpp>
+
+namespace ConsoleRing {
+	static const uint64_t RING_SIZE = 1 << 16;
+	
+	// Records start at multiples of sizeof(Header), so there is always room
+	// for a padding header before the wrap
+	struct Header {
+		uint32_t size;     // whole record; 0 until committed
+		uint32_t len;      // payload bytes
+		Formatter format;  // NULL for padding
+		uint64_t tsc;
+		uint64_t reserved;
+	};
+	
+	static_assert(sizeof(Header) == 32, "Header must be 32 bytes");
+	static_assert(RING_SIZE % sizeof(Header) == 0, "RING_SIZE alignment");
+	
+	alignas(64) static uint8_t ring[RING_SIZE];
+	
+	// Bytes ever reserved / consumed. Producers (including interrupt
+	// handlers) reserve with a CAS on head; there is one consumer.
+	static uint64_t head, tail;
+	
+	static uint64_t high_water, n_records, n_dropped;
+	static bool deferred = false;
+	
+	static inline Header * header_at(uint64_t pos) {
+		return (Header *) (ring + (pos & (RING_SIZE - 1)));
+	}
+	
+	void set_deferred(bool d) {
+		if (!d) flush();
+		deferred = d;
+	}
+	
+	bool push(Formatter format, const void *data, int len) {
+		if (!deferred) {
+			format(x86_64::rdtsc(), data, len);
+			return true;
+		}
+		
+		const uint64_t size = (sizeof(Header) + len + sizeof(Header) - 1)
+			/ sizeof(Header) * sizeof(Header);
+		
+		uint64_t h, start, end;
+		do {
+			h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+			
+			// Records do not wrap; pad to the start of the ring instead
+			uint64_t off = h & (RING_SIZE - 1);
+			start = off + size > RING_SIZE ? h + (RING_SIZE - off) : h;
+			end = start + size;
+			
+			if (end - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) > RING_SIZE) {
+				__atomic_fetch_add(&n_dropped, 1, __ATOMIC_RELAXED);
+				return false;
+			}
+		} while (!__atomic_compare_exchange_n(&head, &h, end, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		
+		if (start != h) {
+			Header *pad = header_at(h);
+			pad->len = 0;
+			pad->format = NULL;
+			__atomic_store_n(&pad->size, (uint32_t) (start - h), __ATOMIC_RELEASE);
+		}
+		
+		Header *hdr = header_at(start);
+		hdr->len = len;
+		hdr->format = format;
+		hdr->tsc = x86_64::rdtsc();
+		memcpy(hdr + 1, data, len);
+		__atomic_store_n(&hdr->size, (uint32_t) size, __ATOMIC_RELEASE);
+		
+		uint64_t used = end - tail;
+		if (used > high_water) high_water = used;
+		n_records++;
+		
+		return true;
+	}
+	
+	bool drain_one() {
+		while (true) {
+			uint64_t t = tail;
+			if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) return false;
+			
+			Header *hdr = header_at(t);
+			uint32_t size = __atomic_load_n(&hdr->size, __ATOMIC_ACQUIRE);
+			if (size == 0) return false;  // reserved, but not committed yet
+			
+			Formatter format = hdr->format;
+			if (format) format(hdr->tsc, hdr + 1, hdr->len);
+			
+			hdr->size = 0;
+			__atomic_store_n(&tail, t + size, __ATOMIC_RELEASE);
+			
+			if (format) return true;
+		}
+	}
+	
+	void flush() {
+		while (drain_one());
+	}
+	
+	Stats get_stats() {
+		return (Stats) {
+			RING_SIZE,
+			__atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail,
+			high_water,
+			n_records,
+			n_dropped
+		};
+	}
+}
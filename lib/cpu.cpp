@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#include <inc/cpu.hpp>
+#include <inc/x86_64.hpp>
+#include <inc/logger.hpp>
+
+namespace CPU {
+	bool has_avx2;
+	bool has_avx512f;
+	
+	#define XCR0_X87        (1ull << 0)
+	#define XCR0_SSE        (1ull << 1)
+	#define XCR0_AVX        (1ull << 2)
+	#define XCR0_OPMASK     (1ull << 5)
+	#define XCR0_ZMM_HI256  (1ull << 6)
+	#define XCR0_HI16_ZMM   (1ull << 7)
+	#define XCR0_AVX512     (XCR0_OPMASK | XCR0_ZMM_HI256 | XCR0_HI16_ZMM)
+	
+	void init() {
+		LDEBUG_ENTER_RET();
+		
+		uint32_t max_leaf, ecx1, ebx7;
+		x86_64::cpuid(0, &max_leaf, NULL, NULL, NULL);
+		x86_64::cpuid(1, NULL, NULL, &ecx1, NULL);
+		
+		bool has_xsave = (ecx1 >> 26) & 1;
+		bool has_avx = (ecx1 >> 28) & 1;
+		if (!has_xsave || !has_avx || max_leaf < 0xd) {
+			LINFO("CPU: no AVX, using scalar code paths");
+			return;
+		}
+		
+		// long_mode_init only sets X87 | SSE in XCR0
+		uint32_t xcr0_supported;
+		x86_64::cpuid_count(0xd, 0, &xcr0_supported, NULL, NULL, NULL);
+		x86_64::cpuid_count(7, 0, NULL, &ebx7, NULL, NULL);
+		
+		uint64_t xcr0 = x86_64::xgetbv(0) | XCR0_AVX;
+		has_avx2 = (ebx7 >> 5) & 1;
+		
+		if (((ebx7 >> 16) & 1) && (xcr0_supported & XCR0_AVX512) == XCR0_AVX512) {
+			xcr0 |= XCR0_AVX512;
+			has_avx512f = true;
+		}
+		
+		x86_64::xsetbv(0, xcr0);
+		
+		LINFO("CPU: xcr0 = 0x%lx, avx2 %d, avx512f %d",
+			x86_64::xgetbv(0), has_avx2, has_avx512f);
+	}
+}
@@ -6,6 +6,7 @@
 #include <inc/memory.hpp>
 #include <inc/timer.hpp>
 #include <inc/pci.hpp>
+#include <inc/trap.hpp>
 
 // kernel pages are 4k-sized
 using Memory::PAGE_SIZE;
@@ -23,6 +24,31 @@ namespace e1000 {
 		uint16_t special;
 	} __attribute__((packed));
 	
+	// Sets up the checksum offsets for the data descriptors that follow
+	struct TransContextDesc {
+		uint8_t ipcss;
+		uint8_t ipcso;
+		uint16_t ipcse;
+		uint8_t tucss;
+		uint8_t tucso;
+		uint16_t tucse;
+		uint32_t cmd_and_length;  // PAYLEN | DTYP << 20 | TUCMD << 24
+		uint8_t status;
+		uint8_t hdrlen;
+		uint16_t mss;
+	} __attribute__((packed));
+	
+	struct TransDataDesc {
+		uint64_t addr;
+		uint32_t cmd_and_length;  // DTALEN | DTYP << 20 | DCMD << 24
+		uint8_t status;
+		uint8_t popts;
+		uint16_t special;
+	} __attribute__((packed));
+	
+	static_assert(sizeof(TransContextDesc) == sizeof(TransDesc), "bad descriptor size");
+	static_assert(sizeof(TransDataDesc) == sizeof(TransDesc), "bad descriptor size");
+	
 	struct RecvDesc {
 		uint64_t addr;
 		uint16_t length;
@@ -32,8 +58,7 @@ namespace e1000 {
 		uint16_t special;
 	} __attribute__((packed));
 	
-	#define TQ_FLUSH_COUNT 32
-	#define RQ_FLUSH_COUNT 128
+	#define RQ_REFILL_COUNT 32
 	
 	#define RQ_DESC_PAGE_COUNT 1
 	
@@ -43,40 +68,46 @@ namespace e1000 {
 	static volatile TransDesc tq[TQSIZE] __attribute__((aligned(PAGE_SIZE)));
 	static volatile RecvDesc rq[RQSIZE] __attribute__((aligned(PAGE_SIZE)));
 	
-	static char tq_pages[TQSIZE / 2][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
 	static char rq_pages[RQSIZE / 2][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
 	
-	static void *tq_addrs[TQSIZE];
 	static void *rq_addrs[RQSIZE];
 	
-	static int last_tq_page_id;
-	static uint64_t last_tq_page_offset;
+	// Completion of the frame whose last descriptor is tq[i]
+	static struct {
+		void (*fn)(void *);
+		void *arg;
+	} tq_done[TQSIZE];
 	
 	static volatile char e1000[0x10000] __attribute__((aligned(PAGE_SIZE)));
 	
 	static uint32_t e1000_rdt, e1000_rdh;
 	static uint32_t e1000_rdt_real;
-	static uint32_t e1000_tdt, e1000_tdh;
+	
+	// rq[e1000_rdt + 1 .. e1000_rdt + rx_held] are handed out by rx_burst
+	static uint32_t rx_held;
+	
+	static uint32_t e1000_tdt;
 	static uint32_t e1000_tdt_real;
 	
-	// MTU = 1500, half page per packet
-	static int tq_frag_alloc(uint64_t cnt, void **va, void **pa) {
-		cnt += (-cnt) & (64 - 1);  // ???
-		if (last_tq_page_offset + cnt <= PAGE_SIZE) {
-			*pa = (char *) tq_addrs[last_tq_page_id] + last_tq_page_offset;
-			*va = tq_pages[last_tq_page_id] + last_tq_page_offset;
-			last_tq_page_offset += cnt;
-			return 0;
-		} else if (cnt <= PAGE_SIZE) {
-			last_tq_page_id = (last_tq_page_id + 1) % (TQSIZE / 2);
-			*pa = tq_addrs[last_tq_page_id];
-			*va = tq_pages[last_tq_page_id];
-			last_tq_page_offset = cnt;
-			return 0;
-		} else {
-			return -1;
+	// tq[e1000_tclean .. e1000_tdt) are in flight or not reclaimed yet
+	static uint32_t e1000_tclean;
+	
+	// What the last context descriptor set up, the NIC keeps it until the next
+	struct CsumContext {
+		uint8_t ipcss, ipcso;
+		uint16_t ipcse;
+		uint8_t tucss, tucso;
+		uint8_t tucmd;
+		
+		bool operator == (const CsumContext &o) const {
+			return ipcss == o.ipcss && ipcso == o.ipcso && ipcse == o.ipcse &&
+				tucss == o.tucss && tucso == o.tucso && tucmd == o.tucmd;
 		}
-	}
+	};
+	static CsumContext tx_ctx;
+	static bool tx_ctx_valid;
+	
+	static bool msi_enabled;
 	
 	static int e1000_init(unsigned maxMTA, uint8_t mac[6]) {
 		LDEBUG("e1000 status = %x", *(volatile uint32_t *) (e1000 + 0x8));
@@ -84,18 +115,11 @@ namespace e1000 {
 		const uint32_t tq_pa = (uint32_t) (uint64_t) tq;
 		const uint32_t rq_pa = (uint32_t) (uint64_t) rq;
 		
-		for (uint64_t i = 0; i < TQSIZE; i++) {
-			tq_addrs[i] = (void *) tq_pages[i];
-		}
 		for (uint64_t i = 0; i < RQSIZE; i++) {
 			rq_addrs[i] = (void *) ((uint64_t) rq_pages[i / 2] + (i % 2) * PAGE_SIZE / 2);
 			rq[i].addr = (uint32_t) (uint64_t) rq_addrs[i];
 		}
 		
-		// For allocating fragments
-		last_tq_page_id = 0;
-		last_tq_page_offset = 0;
-		
 		*(volatile uint32_t *) (e1000 + 0x400) = 0;        // clear TCTL
 		*(volatile uint32_t *) (e1000 + 0x100) = 0;        // clear RCTL
 		
@@ -133,7 +157,8 @@ namespace e1000 {
 		*(volatile uint32_t *) (e1000 + 0x3818) = 0;          // TDT
 		e1000_tdt = 0;
 		e1000_tdt_real = 0;
-		e1000_tdh = 0;
+		e1000_tclean = 0;
+		tx_ctx_valid = false;
 		
 		// TXDCTL: GRAN=0 | 1<<22(must=1) | WTHRESH=3 | HTHRESH=4 | PTHRESH=3
 		*(volatile uint32_t *) (e1000 + 0x3828) = (0u << 24) | (1u << 22) | (3u << 16) | (4u << 8) | 3u;
@@ -170,6 +195,10 @@ namespace e1000 {
 		e1000_rdh = 0;
 		e1000_rdt = RQSIZE - 1;
 		e1000_rdt_real = e1000_rdt;
+		rx_held = 0;
+		
+		// RXCSUM: IPOFLD | TUOFLD
+		*(volatile uint32_t *) (e1000 + 0x5000) = (1u << 8) | (1u << 9);
 		
 		// RCTL: EN | BAM | BSIZE=2048 | BSEX=0 | SECRC=1
 		uint32_t rctl = (1 << 1) | (1 << 15) | (0 << 16) | (0 << 25) | (1 << 26);
@@ -196,83 +225,256 @@ namespace e1000 {
 		for (int i = 0; args[i][0]; i++) {
 			r = PCI::map_device(args[i][0], args[i][1], (uint64_t) e1000, sizeof(e1000));
 			if (r != -1ull) {
+				// e1000e has MSI, the 82540EM only INTx which we do not route
+				msi_enabled = PCI::enable_msi(args[i][0], args[i][1], Trap::TRAP_WAKEUP);
 				return e1000_init(args[i][2], mac);
 			}
 		}
 		return r;
 	}
 	
-	int send(const void *buf, int cnt) {
-		if (cnt < 0 || cnt > 1500) {
+	// Every descriptor has RS set, so DD tells us when its buffer is free
+	static void tx_reclaim() {
+		while (e1000_tclean != e1000_tdt && (tq[e1000_tclean].status & 1)) {
+			if (tq_done[e1000_tclean].fn) {
+				tq_done[e1000_tclean].fn(tq_done[e1000_tclean].arg);
+				tq_done[e1000_tclean].fn = NULL;
+			}
+			e1000_tclean = (e1000_tclean + 1) % TQSIZE;
+		}
+	}
+	
+	static inline uint32_t tx_n_free() {
+		return (e1000_tclean + TQSIZE - e1000_tdt - 1) % TQSIZE;
+	}
+	
+	uint32_t csum_offload() {
+		return NetworkDriver::CSUM_IPv4 | NetworkDriver::CSUM_L4;
+	}
+	
+	// Zeroes the checksum fields the NIC fills in, and seeds the TCP/UDP one
+	// with the pseudo header sum as the NIC leaves that out
+	// returns: POPTS for the data descriptors, zero if no offload applies
+	static uint8_t csum_prepare(const NetworkDriver::Fragment &frag, uint32_t csum, CsumContext *ctx) {
+		uint8_t *p = (uint8_t *) frag.data;
+		const int ETH_HLEN = 14;
+		
+		if (frag.len < ETH_HLEN + 20 || p[12] != 0x08 || p[13] != 0x00) {
+			return 0;  // not IPv4
+		}
+		uint8_t *iph = p + ETH_HLEN;
+		int ihl = (iph[0] & 0xf) * 4;
+		if ((iph[0] >> 4) != 4 || ihl < 20 || frag.len < ETH_HLEN + ihl) {
+			return 0;
+		}
+		
+		uint8_t popts = 0;
+		memset(ctx, 0, sizeof(*ctx));
+		ctx->ipcss = ETH_HLEN;
+		ctx->ipcso = ETH_HLEN + 10;
+		ctx->ipcse = ETH_HLEN + ihl - 1;
+		ctx->tucss = ETH_HLEN + ihl;
+		ctx->tucmd = 1 << 1;  // IP
+		if (csum & NetworkDriver::CSUM_IPv4) {
+			iph[10] = iph[11] = 0;
+			popts |= 1 << 0;  // IXSM
+		}
+		
+		// The TCP/UDP checksum covers the whole packet, so no fragments
+		int csum_off = iph[9] == 6 ? 16 : iph[9] == 17 ? 6 : -1;
+		bool is_fragment = ((iph[6] & 0x3f) | iph[7]) != 0;
+		if ((csum & NetworkDriver::CSUM_L4) && csum_off >= 0 && !is_fragment &&
+			frag.len >= ctx->tucss + csum_off + 2) {
+			uint16_t l4_len = ((iph[2] << 8) | iph[3]) - ihl;
+			uint32_t sum = iph[9] + l4_len;
+			for (int i = 12; i < 20; i += 2) {
+				sum += (iph[i] << 8) | iph[i + 1];
+			}
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			
+			uint8_t *l4 = p + ctx->tucss + csum_off;
+			l4[0] = sum >> 8;
+			l4[1] = sum & 0xff;
+			
+			ctx->tucso = ctx->tucss + csum_off;
+			if (iph[9] == 6) {
+				ctx->tucmd |= 1 << 0;  // TCP
+			}
+			popts |= 1 << 1;  // TXSM
+		}
+		return popts;
+	}
+	
+	// One descriptor per fragment, EOP on the last. Checksum offload uses
+	// extended data descriptors, after a context descriptor if the offsets
+	// differ from the last frame's.
+	int send_sg(const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg) {
+		if (n <= 0 || n > NetworkDriver::MAX_FRAGMENTS) {
+			return -1;
+		}
+		
+		int cnt = 0;
+		for (int i = 0; i < n; i++) {
+			cnt += frags[i].len;
+		}
+		if (cnt > NetworkDriver::MAX_FRAME_LEN) {
 			return -1;
 		}
 		
 		// LINFO("send len %d", cnt);
 		
-		if ((e1000_tdt + 1) % TQSIZE == e1000_tdh) {
-			e1000_tdh = *(volatile uint32_t *) (e1000 + 0x3810);
+		CsumContext ctx;
+		uint8_t popts = csum ? csum_prepare(frags[0], csum, &ctx) : 0;
+		bool new_ctx = popts && !(tx_ctx_valid && tx_ctx == ctx);
+		uint32_t n_desc = n + new_ctx;
+		
+		if (tx_n_free() < n_desc) {
+			tx_reclaim();
 		}
-		if ((e1000_tdt + 1) % TQSIZE == e1000_tdh) {
+		if (tx_n_free() < n_desc) {
 			return -1;
 		}
 		
-		void *va, *pa;
-		if (tq_frag_alloc(cnt, &va, &pa) < 0) {
-			return -1;
+		if (new_ctx) {
+			TransContextDesc cd;
+			memset(&cd, 0, sizeof(cd));
+			cd.ipcss = ctx.ipcss;
+			cd.ipcso = ctx.ipcso;
+			cd.ipcse = ctx.ipcse;
+			cd.tucss = ctx.tucss;
+			cd.tucso = ctx.tucso;
+			cd.tucse = 0;  // to the end of the packet
+			// DTYP=0000 | TUCMD: DEXT | RS
+			cd.cmd_and_length = (uint32_t) (ctx.tucmd | (1 << 5) | (1 << 3)) << 24;
+			memcpy((void *) &tq[e1000_tdt], &cd, sizeof(cd));
+			e1000_tdt = (e1000_tdt + 1) % TQSIZE;
+			tx_ctx = ctx;
+			tx_ctx_valid = true;
 		}
-		memcpy(va, buf, cnt);
-		
-		TransDesc td;
-		memset(&td, 0, sizeof(td));
-		td.addr = (uint32_t) (uint64_t) pa;
-		td.length = cnt;
-		td.cmd &= ~(1 << 5);
-		td.cmd |= (1 << 3) | (1 << 0);
-		td.cmd |= (1 << 1);
-		memcpy((void *) &tq[e1000_tdt], &td, sizeof(td));
-		e1000_tdt = (e1000_tdt + 1) % TQSIZE;
-		
-		if (e1000_tdt % TQ_FLUSH_COUNT == 0) {
-			*(volatile uint32_t *) (e1000 + 0x3818) = e1000_tdt;
-			e1000_tdt_real = e1000_tdt;
+		
+		for (int i = 0; i < n; i++) {
+			if (popts) {
+				TransDataDesc dd;
+				memset(&dd, 0, sizeof(dd));
+				dd.addr = (uint64_t) frags[i].data;
+				// DTYP=0001 | DCMD: DEXT | RS | IFCS, EOP on the last
+				uint32_t dcmd = (1 << 5) | (1 << 3) | (1 << 1) | (i == n - 1);
+				dd.cmd_and_length = frags[i].len | (1u << 20) | (dcmd << 24);
+				dd.popts = popts;
+				memcpy((void *) &tq[e1000_tdt], &dd, sizeof(dd));
+			} else {
+				TransDesc td;
+				memset(&td, 0, sizeof(td));
+				td.addr = (uint64_t) frags[i].data;
+				td.length = frags[i].len;
+				td.cmd &= ~(1 << 5);
+				td.cmd |= (1 << 3) | (1 << 1);
+				if (i == n - 1) {
+					td.cmd |= (1 << 0);
+				}
+				memcpy((void *) &tq[e1000_tdt], &td, sizeof(td));
+			}
+			if (i == n - 1) {
+				tq_done[e1000_tdt].fn = done;
+				tq_done[e1000_tdt].arg = arg;
+			}
+			e1000_tdt = (e1000_tdt + 1) % TQSIZE;
 		}
+		NetworkDriver::last_tx.post_tsc = Timer::get_tsc();
+		
 		flush();
 		
-		return 0;
+		return cnt;
 	}
 	
 	int flush() {
 		if (e1000_tdt != e1000_tdt_real) {
 			*(volatile uint32_t *) (e1000 + 0x3818) = e1000_tdt;
 			e1000_tdt_real = e1000_tdt;
+			NetworkDriver::last_tx.doorbell_tsc = Timer::get_tsc();
 		}
 		
+		tx_reclaim();
+		
 		return 0;
 	}
 	
-	// returns: length
-	int receive(void *bufpage) {
-		uint32_t idx = (e1000_rdt + 1) % RQSIZE;
-		volatile struct RecvDesc *rd = rq + idx;
-		if (!(rd->status & 1)) {
-			return -1;
+	// What the NIC says about the checksums of a received frame
+	static inline uint32_t rx_csum(uint8_t status, uint8_t errors) {
+		if (status & (1 << 2)) {
+			return 0;  // IXSM: nothing checked
 		}
-		int len = rd->length;
-		if (len < 0) {
-			return -1;
+		uint32_t r = 0;
+		if (status & (1 << 6)) {  // IPCS
+			r |= (errors & (1 << 6)) ? NetworkDriver::CSUM_BAD : NetworkDriver::CSUM_IPv4;
 		}
-		if (len > (int) PAGE_SIZE / 2) {
-			len = PAGE_SIZE / 2;
+		if (status & (1 << 5)) {  // TCPCS
+			r |= (errors & (1 << 5)) ? NetworkDriver::CSUM_BAD : NetworkDriver::CSUM_L4;
 		}
-		memcpy(bufpage, rq_addrs[idx], len);
-		rd->status &= ~1;
-		e1000_rdt = idx;
-		if (e1000_rdt % RQ_FLUSH_COUNT == 0) {
-			*(volatile uint32_t *) (e1000 + 0x2818) = e1000_rdt;  // ???
+		return r;
+	}
+	
+	// Frames popped together share one rx_tsc
+	int rx_burst(NetworkDriver::PacketRef *pkts, int max) {
+		int n = 0;
+		uint64_t tsc = 0;
+		while (n < max && rx_held < RQSIZE - 1) {
+			uint32_t idx = (e1000_rdt + 1 + rx_held) % RQSIZE;
+			volatile struct RecvDesc *rd = rq + idx;
+			if (!(rd->status & 1)) {
+				break;
+			}
+			int len = rd->length;
+			if (len > (int) PAGE_SIZE / 2) {
+				len = PAGE_SIZE / 2;
+			}
+			if (n == 0) tsc = Timer::get_tsc();
+			pkts[n++] = (NetworkDriver::PacketRef) { rq_addrs[idx], len, rx_csum(rd->status, rd->errors), tsc };
+			rx_held++;
+		}
+		// if (n) LINFO("rx_burst %d", n);
+		return n;
+	}
+	
+	void rx_release(int n) {
+		for (int i = 1; i <= n; i++) {
+			rq[(e1000_rdt + i) % RQSIZE].status = 0;
+		}
+		e1000_rdt = (e1000_rdt + n) % RQSIZE;
+		rx_held -= n;
+		
+		// Refill in batches, one RDT write per release at most
+		if ((e1000_rdt - e1000_rdt_real + RQSIZE) % RQSIZE >= RQ_REFILL_COUNT) {
+			*(volatile uint32_t *) (e1000 + 0x2818) = e1000_rdt;
 			e1000_rdt_real = e1000_rdt;
 		}
-		// if (len != -1) LINFO("recv len %d", len);
-		return len;
+	}
+	
+	bool has_rx_wakeup() {
+		return msi_enabled;
+	}
+	
+	// RXT0 fires on every write back as RDTR is zero. Causes from frames
+	// we polled meanwhile are cleared first, or they would fire at once.
+	bool rx_wakeup_arm() {
+		*(volatile uint32_t *) (e1000 + 0xc0);                  // read ICR
+		*(volatile uint32_t *) (e1000 + 0xd0) = 1u << 7;        // IMS: RXT0
+		
+		uint32_t idx = (e1000_rdt + 1 + rx_held) % RQSIZE;
+		return !(rq[idx].status & 1);
+	}
+	
+	void rx_wakeup_disarm() {
+		*(volatile uint32_t *) (e1000 + 0xd8) = 1u << 7;        // IMC: RXT0
+		*(volatile uint32_t *) (e1000 + 0xc0);                  // read ICR
+	}
+	
+	// status, errors and special of the next frame's descriptor
+	const volatile uint32_t *rx_wait_addr() {
+		uint32_t idx = (e1000_rdt + 1 + rx_held) % RQSIZE;
+		return (const volatile uint32_t *) &rq[idx].status;
 	}
 	
 	bool init(uint8_t mac[6]) {
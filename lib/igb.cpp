@@ -0,0 +1,601 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <inc/igb.hpp>
+#include <inc/logger.hpp>
+#include <inc/memory.hpp>
+#include <inc/timer.hpp>
+#include <inc/pci.hpp>
+#include <inc/trap.hpp>
+
+// kernel pages are 4k-sized
+using Memory::PAGE_SIZE;
+
+using Timer::microdelay;
+
+namespace igb {
+	// Advanced descriptors, the only kind with per-queue contexts
+	struct AdvTransDesc {
+		uint64_t addr;
+		uint32_t cmd_type_len;   // DTALEN | DTYP << 20 | DCMD << 24
+		uint32_t olinfo_status;  // STA (DD written back) | POPTS << 8 | PAYLEN << 14
+	} __attribute__((packed));
+	
+	struct AdvTransContextDesc {
+		uint32_t vlan_macip_lens;  // IPLEN | MACLEN << 9
+		uint32_t seqnum_seed;
+		uint32_t type_tucmd_mlhl;  // TUCMD << 9 | DTYP << 20 | DEXT
+		uint32_t mss_l4len_idx;
+	} __attribute__((packed));
+	
+	union AdvRecvDesc {
+		struct {
+			uint64_t pkt_addr;
+			uint64_t hdr_addr;     // zero: no header split, also clears DD
+		} read;
+		struct {
+			uint32_t info;
+			uint32_t rss_hash;
+			uint32_t status_error; // extended status 19:0, errors 31:20
+			uint16_t length;
+			uint16_t vlan;
+		} wb;
+	} __attribute__((packed));
+	
+	static_assert(sizeof(AdvTransContextDesc) == sizeof(AdvTransDesc), "bad descriptor size");
+	static_assert(sizeof(AdvRecvDesc) == 16, "bad descriptor size");
+	
+	// The 82576 has 16 of each, a few are plenty for our flows
+	const int N_QUEUES = 4;
+	
+	const uint32_t TQSIZE = 512;
+	const uint32_t RQSIZE = 512;
+	const uint32_t RX_BUFFER_SIZE = 2048;
+	const uint32_t RQ_REFILL_COUNT = 32;
+	
+	const int N_ETYPE_FILTERS = 8;
+	const int N_FIVE_TUPLE_FILTERS = 8;
+	
+	// Registers
+	const uint32_t CTRL = 0x0000, STATUS = 0x0008;
+	const uint32_t RCTL = 0x0100, TCTL = 0x0400;
+	const uint32_t ICR = 0x1500, IMS = 0x1508, IMC = 0x150c, EIMC = 0x1528;
+	const uint32_t IVAR = 0x1700;
+	const uint32_t RXCSUM = 0x5000, MTA = 0x5200, RAL = 0x5400, RAH = 0x5404;
+	const uint32_t MRQC = 0x5818;
+	const uint32_t SAQF = 0x5980, DAQF = 0x59a0, SPQF = 0x59c0, FTQF = 0x59e0;
+	const uint32_t IMIR = 0x5a80, IMIREXT = 0x5aa0;
+	const uint32_t ETQF = 0x5cb0;
+	
+	// Per-queue registers, 0x40 apart
+	const uint32_t RDBAL = 0xc000, RDBAH = 0xc004, RDLEN = 0xc008, SRRCTL = 0xc00c;
+	const uint32_t RDH = 0xc010, RDT = 0xc018, RXDCTL = 0xc028;
+	const uint32_t TDBAL = 0xe000, TDBAH = 0xe004, TDLEN = 0xe008;
+	const uint32_t TDH = 0xe010, TDT = 0xe018, TXDCTL = 0xe028;
+	
+	const uint32_t QUEUE_ENABLE = 1u << 25;  // RXDCTL / TXDCTL
+	
+	static volatile AdvTransDesc tq[N_QUEUES][TQSIZE] __attribute__((aligned(PAGE_SIZE)));
+	static volatile AdvRecvDesc rq[N_QUEUES][RQSIZE] __attribute__((aligned(PAGE_SIZE)));
+	
+	static char rq_bufs[N_QUEUES][RQSIZE][RX_BUFFER_SIZE] __attribute__((aligned(PAGE_SIZE)));
+	
+	static volatile char igb[0x20000] __attribute__((aligned(PAGE_SIZE)));
+	
+	static inline volatile uint32_t &reg(uint32_t off) {
+		return *(volatile uint32_t *) (igb + off);
+	}
+	
+	static inline volatile uint32_t &queue_reg(uint32_t off, int queue) {
+		return reg(off + 0x40 * queue);
+	}
+	
+	// What the last context descriptor of a queue set up
+	struct CsumContext {
+		uint32_t vlan_macip_lens;
+		uint32_t tucmd;
+		
+		bool operator == (const CsumContext &o) const {
+			return vlan_macip_lens == o.vlan_macip_lens && tucmd == o.tucmd;
+		}
+	};
+	
+	static struct RxQueue {
+		uint32_t rdt, rdt_real;
+		
+		// rq[rdt + 1 .. rdt + held] are handed out by rx_burst
+		uint32_t held;
+	} rx[N_QUEUES];
+	
+	static struct TxQueue {
+		uint32_t tdt, tdt_real;
+		
+		// tq[tclean .. tdt) are in flight or not reclaimed yet
+		uint32_t tclean;
+		
+		CsumContext ctx;
+		bool ctx_valid;
+	} tx[N_QUEUES];
+	
+	// For the first descriptor of each frame: where it ends, and what to
+	// call once the NIC has written back DD there
+	static struct {
+		uint32_t eop;
+		void (*fn)(void *);
+		void *arg;
+	} tq_frame[N_QUEUES][TQSIZE];
+	
+	static int n_etype_filters, n_five_tuple_filters;
+	
+	static bool msi_enabled;
+	
+	static void init_rx_queue(int q) {
+		for (uint32_t i = 0; i < RQSIZE; i++) {
+			rq[q][i].read.pkt_addr = (uint64_t) rq_bufs[q][i];
+			rq[q][i].read.hdr_addr = 0;
+		}
+		
+		const uint64_t rq_pa = (uint64_t) rq[q];
+		queue_reg(RXDCTL, q) = 0;
+		queue_reg(RDBAL, q) = (uint32_t) rq_pa;
+		queue_reg(RDBAH, q) = (uint32_t) (rq_pa >> 32);
+		queue_reg(RDLEN, q) = sizeof(rq[q]);
+		// SRRCTL: BSIZEPACKET=2KB | DESCTYPE=advanced one buffer | DROP_EN,
+		// so a queue that runs dry drops its own frames instead of
+		// holding up the others
+		queue_reg(SRRCTL, q) = (RX_BUFFER_SIZE >> 10) | (1u << 25) | (1u << 31);
+		queue_reg(RDH, q) = 0;
+		queue_reg(RDT, q) = 0;
+		
+		// RXDCTL: ENABLE | WTHRESH=1 | HTHRESH=8 | PTHRESH=8, every frame
+		// is written back at once
+		queue_reg(RXDCTL, q) = QUEUE_ENABLE | (1u << 16) | (8u << 8) | 8u;
+		while (!(queue_reg(RXDCTL, q) & QUEUE_ENABLE)) {
+			microdelay(10);
+		}
+		
+		rx[q].rdt = RQSIZE - 1;
+		rx[q].rdt_real = rx[q].rdt;
+		rx[q].held = 0;
+		queue_reg(RDT, q) = rx[q].rdt;
+	}
+	
+	static void init_tx_queue(int q) {
+		const uint64_t tq_pa = (uint64_t) tq[q];
+		queue_reg(TXDCTL, q) = 0;
+		queue_reg(TDBAL, q) = (uint32_t) tq_pa;
+		queue_reg(TDBAH, q) = (uint32_t) (tq_pa >> 32);
+		queue_reg(TDLEN, q) = sizeof(tq[q]);
+		queue_reg(TDH, q) = 0;
+		queue_reg(TDT, q) = 0;
+		
+		// TXDCTL: ENABLE | WTHRESH=1 | HTHRESH=1 | PTHRESH=8
+		queue_reg(TXDCTL, q) = QUEUE_ENABLE | (1u << 16) | (1u << 8) | 8u;
+		while (!(queue_reg(TXDCTL, q) & QUEUE_ENABLE)) {
+			microdelay(10);
+		}
+		
+		tx[q].tdt = 0;
+		tx[q].tdt_real = 0;
+		tx[q].tclean = 0;
+		tx[q].ctx_valid = false;
+	}
+	
+	static int igb_init(uint8_t mac[6]) {
+		LDEBUG("igb status = %x", reg(STATUS));
+		
+		reg(IMC) = 0xffffffff;
+		reg(EIMC) = 0xffffffff;
+		reg(RCTL) = 0;
+		reg(TCTL) = 0;
+		
+		// reset, the NIC clears RST when done
+		reg(CTRL) = reg(CTRL) | (1u << 26);
+		microdelay(1000);
+		while (reg(CTRL) & (1u << 26)) {
+			microdelay(100);
+		}
+		reg(IMC) = 0xffffffff;
+		reg(EIMC) = 0xffffffff;
+		*(volatile uint32_t *) (igb + ICR);  // read ICR
+		
+		// Init link
+		uint32_t ctrl = reg(CTRL);
+		ctrl &= ~((1u << 11) | (1u << 12));   // No forcing speed or full-duplex
+		ctrl |= 1u << 6;   // set link up
+		reg(CTRL) = ctrl;
+		
+		LDEBUG("igb: waiting for link ...");
+		while (!(reg(STATUS) & 0x2)) {
+			microdelay(100000);
+		}
+		LDEBUG("igb: link up");
+		
+		// MAC address
+		uint32_t ral = 0, rah = 0;
+		for (int i = 0; i < 4; i++) ral |= (uint32_t) mac[i] << (i * 8);
+		for (int i = 0; i < 2; i++) rah |= (uint32_t) mac[i + 4] << (i * 8);
+		reg(RAL) = ral;
+		reg(RAH) = rah | (1u << 31);
+		
+		for (uint32_t i = MTA; i < MTA + 128 * 4; i += 4) {
+			reg(i) = 0;
+		}
+		
+		// No RSS: whatever no filter steers lands on queue 0
+		reg(MRQC) = 0;
+		for (int i = 0; i < N_ETYPE_FILTERS; i++) {
+			reg(ETQF + 4 * i) = 0;
+		}
+		for (int i = 0; i < N_FIVE_TUPLE_FILTERS; i++) {
+			reg(FTQF + 4 * i) = 0;
+		}
+		n_etype_filters = n_five_tuple_filters = 0;
+		
+		for (int q = 0; q < N_QUEUES; q++) {
+			init_rx_queue(q);
+			init_tx_queue(q);
+		}
+		
+		// Every RX queue raises interrupt cause 0, which is RXDW in ICR
+		// without MSI-X mode (GPIE stays zero)
+		for (int q = 0; q < N_QUEUES; q++) {
+			reg(IVAR + 4 * q) = (reg(IVAR + 4 * q) & ~0xffu) | 0x80;  // VALID | vector 0
+		}
+		
+		// RXCSUM: IPOFLD | TUOFLD
+		reg(RXCSUM) = (1u << 8) | (1u << 9);
+		
+		// RCTL: EN | BAM | SECRC, buffer sizes come from SRRCTL
+		reg(RCTL) = (1u << 1) | (1u << 15) | (1u << 26);
+		
+		// TCTL: EN | PSP | CT=0xf | COLD=0x3f
+		reg(TCTL) = (1u << 1) | (1u << 3) | (0xfu << 4) | (0x3fu << 12);
+		
+		LDEBUG("igb status = %08x", reg(STATUS));
+		
+		return 0;
+	}
+	
+	static int _init(uint8_t mac[6]) {
+		const uint32_t args[][2] = {
+			{ 0x8086, 0x10c9 },  // 82576
+			{ 0x8086, 0x10e6 },  // 82576 fiber
+			{ 0x8086, 0x10e7 },  // 82576 serdes
+			{ 0x8086, 0x10e8 },  // 82576 quad copper
+			{ 0x8086, 0x1526 },  // 82576 quad copper ET2
+			{ 0, 0 }
+		};
+		
+		for (int i = 0; args[i][0]; i++) {
+			uint64_t r = PCI::map_device(args[i][0], args[i][1], (uint64_t) igb, sizeof(igb));
+			if (r != -1ull) {
+				msi_enabled = PCI::enable_msi(args[i][0], args[i][1], Trap::TRAP_WAKEUP)
+					|| PCI::enable_msix(args[i][0], args[i][1], Trap::TRAP_WAKEUP);
+				return igb_init(mac);
+			}
+		}
+		return -1;
+	}
+	
+	int n_queue_pairs() {
+		return N_QUEUES;
+	}
+	
+	uint32_t csum_offload() {
+		return NetworkDriver::CSUM_IPv4 | NetworkDriver::CSUM_L4;
+	}
+	
+	// Only the last descriptor of a frame has RS, so DD is checked there
+	static void tx_reclaim(int q) {
+		TxQueue &t = tx[q];
+		while (t.tclean != t.tdt) {
+			const uint32_t eop = tq_frame[q][t.tclean].eop;
+			if (!(tq[q][eop].olinfo_status & 1)) {
+				break;
+			}
+			if (tq_frame[q][t.tclean].fn) {
+				tq_frame[q][t.tclean].fn(tq_frame[q][t.tclean].arg);
+				tq_frame[q][t.tclean].fn = NULL;
+			}
+			t.tclean = (eop + 1) % TQSIZE;
+		}
+	}
+	
+	static inline uint32_t tx_n_free(int q) {
+		return (tx[q].tclean + TQSIZE - tx[q].tdt - 1) % TQSIZE;
+	}
+	
+	// Zeroes the IP checksum and seeds the TCP/UDP one with the pseudo
+	// header sum, as on e1000
+	// returns: POPTS for the first data descriptor, zero if no offload applies
+	static uint32_t csum_prepare(const NetworkDriver::Fragment &frag, uint32_t csum, CsumContext *ctx) {
+		uint8_t *p = (uint8_t *) frag.data;
+		const int ETH_HLEN = 14;
+		
+		if (frag.len < ETH_HLEN + 20 || p[12] != 0x08 || p[13] != 0x00) {
+			return 0;  // not IPv4
+		}
+		uint8_t *iph = p + ETH_HLEN;
+		int ihl = (iph[0] & 0xf) * 4;
+		if ((iph[0] >> 4) != 4 || ihl < 20 || frag.len < ETH_HLEN + ihl) {
+			return 0;
+		}
+		
+		uint32_t popts = 0;
+		ctx->vlan_macip_lens = ihl | (ETH_HLEN << 9);
+		ctx->tucmd = 1u << 1;  // IPV4
+		if (csum & NetworkDriver::CSUM_IPv4) {
+			iph[10] = iph[11] = 0;
+			popts |= 1 << 0;  // IXSM
+		}
+		
+		// The TCP/UDP checksum covers the whole packet, so no fragments
+		int csum_off = iph[9] == 6 ? 16 : iph[9] == 17 ? 6 : -1;
+		bool is_fragment = ((iph[6] & 0x3f) | iph[7]) != 0;
+		if ((csum & NetworkDriver::CSUM_L4) && csum_off >= 0 && !is_fragment &&
+			frag.len >= ETH_HLEN + ihl + csum_off + 2) {
+			uint16_t l4_len = ((iph[2] << 8) | iph[3]) - ihl;
+			uint32_t sum = iph[9] + l4_len;
+			for (int i = 12; i < 20; i += 2) {
+				sum += (iph[i] << 8) | iph[i + 1];
+			}
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			
+			uint8_t *l4 = iph + ihl + csum_off;
+			l4[0] = sum >> 8;
+			l4[1] = sum & 0xff;
+			
+			if (iph[9] == 6) {
+				ctx->tucmd |= 1u << 2;  // L4T=TCP
+			}
+			popts |= 1 << 1;  // TXSM
+		}
+		return popts;
+	}
+	
+	// One data descriptor per fragment, EOP and RS on the last, after a
+	// context descriptor if the checksum offsets differ from the last
+	// frame's on this queue
+	int send_sg_q(int queue, const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg) {
+		if (queue < 0 || queue >= N_QUEUES || n <= 0 || n > NetworkDriver::MAX_FRAGMENTS) {
+			return -1;
+		}
+		
+		int cnt = 0;
+		for (int i = 0; i < n; i++) {
+			cnt += frags[i].len;
+		}
+		if (cnt > NetworkDriver::MAX_FRAME_LEN) {
+			return -1;
+		}
+		
+		TxQueue &t = tx[queue];
+		CsumContext ctx;
+		uint32_t popts = csum ? csum_prepare(frags[0], csum, &ctx) : 0;
+		bool new_ctx = popts && !(t.ctx_valid && t.ctx == ctx);
+		uint32_t n_desc = n + new_ctx;
+		
+		if (tx_n_free(queue) < n_desc) {
+			tx_reclaim(queue);
+		}
+		if (tx_n_free(queue) < n_desc) {
+			return -1;
+		}
+		
+		const uint32_t first = t.tdt;
+		
+		if (new_ctx) {
+			AdvTransContextDesc cd;
+			memset(&cd, 0, sizeof(cd));
+			cd.vlan_macip_lens = ctx.vlan_macip_lens;
+			// TUCMD | DTYP=0010 | DEXT
+			cd.type_tucmd_mlhl = (ctx.tucmd << 9) | (0x2u << 20) | (1u << 29);
+			memcpy((void *) &tq[queue][t.tdt], &cd, sizeof(cd));
+			t.tdt = (t.tdt + 1) % TQSIZE;
+			t.ctx = ctx;
+			t.ctx_valid = true;
+		}
+		
+		for (int i = 0; i < n; i++) {
+			AdvTransDesc dd;
+			dd.addr = (uint64_t) frags[i].data;
+			// DTYP=0011 | DCMD: DEXT | IFCS, EOP | RS on the last
+			uint32_t dcmd = (1u << 5) | (1u << 1);
+			if (i == n - 1) {
+				dcmd |= (1u << 3) | (1u << 0);
+			}
+			dd.cmd_type_len = frags[i].len | (0x3u << 20) | (dcmd << 24);
+			dd.olinfo_status = i == 0 ? (popts << 8) | ((uint32_t) cnt << 14) : 0;
+			memcpy((void *) &tq[queue][t.tdt], &dd, sizeof(dd));
+			
+			if (i == n - 1) {
+				tq_frame[queue][first].eop = t.tdt;
+				tq_frame[queue][first].fn = done;
+				tq_frame[queue][first].arg = arg;
+			}
+			t.tdt = (t.tdt + 1) % TQSIZE;
+		}
+		
+		// push out right away, one TDT write per frame
+		NetworkDriver::last_tx.post_tsc = Timer::get_tsc();
+		queue_reg(TDT, queue) = t.tdt;
+		t.tdt_real = t.tdt;
+		NetworkDriver::last_tx.doorbell_tsc = Timer::get_tsc();
+		
+		tx_reclaim(queue);
+		
+		return cnt;
+	}
+	
+	int send_sg(const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg) {
+		return send_sg_q(0, frags, n, csum, done, arg);
+	}
+	
+	int flush() {
+		for (int q = 0; q < N_QUEUES; q++) {
+			if (tx[q].tdt != tx[q].tdt_real) {
+				queue_reg(TDT, q) = tx[q].tdt;
+				tx[q].tdt_real = tx[q].tdt;
+			}
+			tx_reclaim(q);
+		}
+		return 0;
+	}
+	
+	// What the NIC says about the checksums of a received frame
+	static inline uint32_t rx_csum(uint32_t status_error) {
+		if (status_error & (1u << 2)) {
+			return 0;  // IXSM: nothing checked
+		}
+		uint32_t r = 0;
+		if (status_error & (1u << 6)) {  // IPCS
+			r |= (status_error & (1u << 30)) ? NetworkDriver::CSUM_BAD : NetworkDriver::CSUM_IPv4;
+		}
+		if (status_error & ((1u << 5) | (1u << 4))) {  // TCPCS | UDPCS
+			r |= (status_error & (1u << 29)) ? NetworkDriver::CSUM_BAD : NetworkDriver::CSUM_L4;
+		}
+		return r;
+	}
+	
+	int rx_burst_q(int queue, NetworkDriver::PacketRef *pkts, int max) {
+		if (queue < 0 || queue >= N_QUEUES) {
+			return 0;
+		}
+		
+		RxQueue &r = rx[queue];
+		int n = 0;
+		uint64_t tsc = 0;
+		while (n < max && r.held < RQSIZE - 1) {
+			uint32_t idx = (r.rdt + 1 + r.held) % RQSIZE;
+			volatile AdvRecvDesc *rd = &rq[queue][idx];
+			uint32_t status_error = rd->wb.status_error;
+			if (!(status_error & 1)) {
+				break;
+			}
+			int len = rd->wb.length;
+			if (len > (int) RX_BUFFER_SIZE) {
+				len = RX_BUFFER_SIZE;
+			}
+			if (n == 0) tsc = Timer::get_tsc();
+			pkts[n++] = (NetworkDriver::PacketRef) { rq_bufs[queue][idx], len, rx_csum(status_error), tsc };
+			r.held++;
+		}
+		return n;
+	}
+	
+	int rx_burst(NetworkDriver::PacketRef *pkts, int max) {
+		return rx_burst_q(0, pkts, max);
+	}
+	
+	// The write back overwrote the buffer address, so it is filled in again
+	void rx_release_q(int queue, int n) {
+		if (queue < 0 || queue >= N_QUEUES) {
+			return;
+		}
+		
+		RxQueue &r = rx[queue];
+		for (int i = 1; i <= n; i++) {
+			uint32_t idx = (r.rdt + i) % RQSIZE;
+			rq[queue][idx].read.pkt_addr = (uint64_t) rq_bufs[queue][idx];
+			rq[queue][idx].read.hdr_addr = 0;
+		}
+		r.rdt = (r.rdt + n) % RQSIZE;
+		r.held -= n;
+		
+		// Refill in batches, one RDT write per release at most
+		if ((r.rdt - r.rdt_real + RQSIZE) % RQSIZE >= RQ_REFILL_COUNT) {
+			queue_reg(RDT, queue) = r.rdt;
+			r.rdt_real = r.rdt;
+		}
+	}
+	
+	void rx_release(int n) {
+		rx_release_q(0, n);
+	}
+	
+	// EtherType filters take ethertype alone, everything else goes to a
+	// 5-tuple filter with the unset fields bypassed
+	bool steer(const NetworkDriver::FlowMatch &match, int queue) {
+		if (queue < 0 || queue >= N_QUEUES) {
+			return false;
+		}
+		
+		uint32_t src_ip;
+		memcpy(&src_ip, match.src_ip, sizeof(src_ip));
+		
+		if (match.ethertype && !match.proto && !src_ip && !match.src_port && !match.dst_port) {
+			if (n_etype_filters == N_ETYPE_FILTERS) {
+				return false;
+			}
+			// ETQF: ETYPE | RX queue << 16 | FILTER_ENABLE | QUEUE_ENABLE
+			reg(ETQF + 4 * n_etype_filters++) =
+				match.ethertype | ((uint32_t) queue << 16) | (1u << 26) | (1u << 31);
+			return true;
+		}
+		
+		if ((match.ethertype && match.ethertype != 0x0800) ||
+			n_five_tuple_filters == N_FIVE_TUPLE_FILTERS) {
+			return false;
+		}
+		
+		const int i = n_five_tuple_filters++;
+		reg(SAQF + 4 * i) = src_ip;
+		reg(DAQF + 4 * i) = 0;
+		reg(SPQF + 4 * i) = match.src_port;
+		// IMIR: destination port | PORT_BP if unset;
+		// IMIREXT: SIZE_BP | CTRL_BP, any length and TCP flags
+		reg(IMIR + 4 * i) = match.dst_port | (match.dst_port ? 0 : 1u << 17);
+		reg(IMIREXT + 4 * i) = (1u << 12) | (1u << 19);
+		
+		// FTQF: protocol | QUEUE_ENABLE | RX queue << 16 | the bypass bits
+		// for protocol, source and destination address and source port
+		uint32_t ftqf = match.proto | (1u << 8) | ((uint32_t) queue << 16);
+		if (!match.proto) ftqf |= 1u << 28;
+		if (!src_ip) ftqf |= 1u << 29;
+		ftqf |= 1u << 30;
+		if (!match.src_port) ftqf |= 1u << 31;
+		reg(FTQF + 4 * i) = ftqf;
+		
+		return true;
+	}
+	
+	bool has_rx_wakeup() {
+		return msi_enabled;
+	}
+	
+	// Causes from frames we polled meanwhile are cleared first, or they
+	// would fire at once
+	bool rx_wakeup_arm() {
+		*(volatile uint32_t *) (igb + ICR);  // read ICR
+		reg(IMS) = 1u << 7;  // RXDW
+		
+		for (int q = 0; q < N_QUEUES; q++) {
+			uint32_t idx = (rx[q].rdt + 1 + rx[q].held) % RQSIZE;
+			if (rq[q][idx].wb.status_error & 1) {
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	void rx_wakeup_disarm() {
+		reg(IMC) = 1u << 7;
+		*(volatile uint32_t *) (igb + ICR);  // read ICR
+	}
+	
+	// Only queue 0 is watched, steered flows still have the interrupt
+	const volatile uint32_t *rx_wait_addr() {
+		uint32_t idx = (rx[0].rdt + 1 + rx[0].held) % RQSIZE;
+		return (const volatile uint32_t *) ((volatile char *) &rq[0][idx] + 8);  // status_error
+	}
+	
+	bool init(uint8_t mac[6]) {
+		LDEBUG_ENTER_RET();
+		
+		return _init(mac) == 0;
+	}
+}
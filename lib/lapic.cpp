@@ -190,6 +190,10 @@ namespace LAPIC {
 		lapicw(EOI, 0);
 	}
 	
+	uint8_t id() {
+		return lapic[ID] >> 24;
+	}
+	
 	static void detect_ext_freq() {
 		// TODO: Detect ext freq from tsc freq
 		unimplemented();
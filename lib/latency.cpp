@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <inc/latency.hpp>
+#include <inc/histogram.hpp>
+#include <inc/network_driver.hpp>
+#include <inc/timer.hpp>
+
+namespace Latency {
+	static Histogram stages[N_STAGES];
+	
+	static const char *stage_names[N_STAGES] = {
+		"driver", "stack", "app", "tx-build", "doorbell", "total",
+	};
+	
+	void add(Stage stage, uint64_t tsc) {
+		stages[stage].add(tsc);
+	}
+	
+	void add_tx(uint64_t rx_tsc, uint64_t send_tsc) {
+		const NetworkDriver::TxStamps &tx = NetworkDriver::last_tx;
+		if (tx.post_tsc < send_tsc) return;
+		
+		stages[TX_BUILD].add(tx.post_tsc - send_tsc);
+		if (tx.doorbell_tsc < tx.post_tsc) return;
+		
+		stages[DOORBELL].add(tx.doorbell_tsc - tx.post_tsc);
+		if (rx_tsc != 0 && rx_tsc <= send_tsc) {
+			stages[TOTAL].add(tx.doorbell_tsc - rx_tsc);
+		}
+	}
+	
+	int format(char *buf, int size) {
+		const double f = Timer::tsc_freq / 1000000;
+		
+		int len = 0;
+		for (int i = 0; i < N_STAGES && len < size; i++) {
+			const Histogram &h = stages[i];
+			len += snprintf(buf + len, size - len,
+				"%s: n %lu, p50 %.2lf, p99 %.2lf, p99.9 %.2lf, max %.2lf us\n",
+				stage_names[i], h.total,
+				h.percentile(0.5) / f, h.percentile(0.99) / f,
+				h.percentile(0.999) / f, h.max / f);
+		}
+		
+		return len < size ? len : size - 1;
+	}
+	
+	void reset() {
+		memset(stages, 0, sizeof(stages));
+	}
+}
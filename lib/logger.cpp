@@ -1,10 +1,10 @@
 #include <cstdarg>
 
 #include <inc/logger.hpp>
+#include <inc/console_ring.hpp>
 #include <inc/timer.hpp>
 #include <inc/x86_64.hpp>
 
-using Timer::secf_since_epoch;
 using x86_64::rdtsc;
 
 namespace Logger {
@@ -27,6 +27,33 @@ namespace Logger {
 		}
 	}
 	
+	static VGA_Buffer::ColorCode get_colorcode(char name) {
+		using VGA_Buffer::Color;
+		
+		switch (name) {
+			case 'F':
+				return VGA_Buffer::ColorCode::generate(Color::White, Color::LightRed);
+			case 'E':
+				return VGA_Buffer::ColorCode::generate(Color::LightRed, Color::Black);
+			case 'W':
+				return VGA_Buffer::ColorCode::generate(Color::Yellow, Color::Black);
+			case 'I':
+				return VGA_Buffer::ColorCode::generate(Color::Green, Color::Black);
+			default:
+				return VGA_Buffer::ColorCode::generate(Color::DarkGray, Color::Black);
+		}
+	}
+	
+	static void print_header(char name, uint64_t tsc) {
+		if (Timer::tsc_epoch) {
+			printf("[%.6lf]", Timer::tsc_to_secf(tsc - Timer::tsc_epoch));
+		} else {
+			printf("[tsc %lu]", tsc);
+		}
+		
+		printf("[%s] ", get_prefix(name));
+	}
+	
 	static bool logger_in_use = false;
 	static VGA_Buffer::ColorCode logger_saved_colorcode;
 	
@@ -34,6 +61,9 @@ namespace Logger {
 		: name(name), mute(mute), saved_colorcode(VGA_Buffer::writer->color_code) {
 		if (mute) return;
 		
+		// Keep order with whatever is still in the ring
+		if (!logger_in_use) ConsoleRing::flush();
+		
 		if (!logger_in_use) {
 			VGA_Buffer::writer->color_code = colorcode;
 			logger_saved_colorcode = saved_colorcode;
@@ -42,14 +72,7 @@ namespace Logger {
 			saved_colorcode = logger_saved_colorcode;
 		}
 		
-		double tm = secf_since_epoch();
-		if (tm != -1) {
-			printf("[%.6lf]", tm);
-		} else {
-			printf("[tsc %lu]", rdtsc());
-		}
-		
-		printf("[%s] ", get_prefix(name));
+		print_header(name, rdtsc());
 	}
 	
 	TimedLogger::TimedLogger(const TimedLogger &logger)
@@ -82,38 +105,23 @@ namespace Logger {
 	}
 	
 	TimedLogger LFATAL() {
-		return get_logger(
-			VGA_Buffer::ColorCode::generate(VGA_Buffer::Color::White,
-				VGA_Buffer::Color::LightRed),
-			LL_FATAL, 'F');
+		return get_logger(get_colorcode('F'), LL_FATAL, 'F');
 	}
 	
 	TimedLogger LERROR() {
-		return get_logger(
-			VGA_Buffer::ColorCode::generate(VGA_Buffer::Color::LightRed,
-				VGA_Buffer::Color::Black),
-			LL_ERROR, 'E');
+		return get_logger(get_colorcode('E'), LL_ERROR, 'E');
 	}
 	
 	TimedLogger LWARN() {
-		return get_logger(
-			VGA_Buffer::ColorCode::generate(VGA_Buffer::Color::Yellow,
-				VGA_Buffer::Color::Black),
-			LL_WARN, 'W');
+		return get_logger(get_colorcode('W'), LL_WARN, 'W');
 	}
 	
 	TimedLogger LINFO() {
-		return get_logger(
-			VGA_Buffer::ColorCode::generate(VGA_Buffer::Color::Green,
-				VGA_Buffer::Color::Black),
-			LL_INFO, 'I');
+		return get_logger(get_colorcode('I'), LL_INFO, 'I');
 	}
 	
 	TimedLogger LDEBUG() {
-		return get_logger(
-			VGA_Buffer::ColorCode::generate(VGA_Buffer::Color::DarkGray,
-				VGA_Buffer::Color::Black),
-			LL_DEBUG, 'D');
+		return get_logger(get_colorcode('D'), LL_DEBUG, 'D');
 	}
 	
 	void LFATAL(const char * fmt, ...) {
@@ -134,30 +142,57 @@ namespace Logger {
 		va_end(args);
 	}
 	
+	// WARN and below go through ConsoleRing. The message is rendered at the
+	// call site (arguments may point to the caller's stack); the timestamp,
+	// colors and the console write are deferred.
+	struct Record {
+		char name;
+		char text[255];
+	};
+	
+	static void format_record(uint64_t tsc, const void *data, int) {
+		const Record *rec = (const Record *) data;
+		
+		VGA_Buffer::ColorCode saved = VGA_Buffer::writer->color_code;
+		VGA_Buffer::writer->color_code = get_colorcode(rec->name);
+		print_header(rec->name, tsc);
+		printf("%s", rec->text);
+		fflush(stdout);
+		VGA_Buffer::writer->color_code = saved;
+		putchar('\n');
+	}
+	
+	static void log_deferred(char name, const char *fmt, va_list args) {
+		Record rec;
+		rec.name = name;
+		int len = vsnprintf(rec.text, sizeof(rec.text), fmt, args);
+		if (len < 0) len = 0;
+		if (len > (int) sizeof(rec.text) - 1) len = sizeof(rec.text) - 1;
+		
+		ConsoleRing::push(format_record, &rec, 1 + len + 1);
+	}
+	
 	void LWARN(const char * fmt, ...) {
 		if (LL_WARN > log_level) return;
-		auto logger = LWARN();
 		va_list args;
 		va_start(args, fmt);
-		vprintf(fmt, args);
+		log_deferred('W', fmt, args);
 		va_end(args);
 	}
 	
 	void LINFO(const char * fmt, ...) {
 		if (LL_INFO > log_level) return;
-		auto logger = LINFO();
 		va_list args;
 		va_start(args, fmt);
-		vprintf(fmt, args);
+		log_deferred('I', fmt, args);
 		va_end(args);
 	}
 	
 	void LDEBUG(const char * fmt, ...) {
 		if (LL_DEBUG > log_level) return;
-		auto logger = LDEBUG();
 		va_list args;
 		va_start(args, fmt);
-		vprintf(fmt, args);
+		log_deferred('D', fmt, args);
 		va_end(args);
 	}
 }
@@ -12,6 +12,32 @@ unsigned __multiboot_addr;
 extern uint64_t ebss;
 
 namespace Multiboot2_Loader {
+	static const int MAX_N_MODULES = 8;
+	
+	static Module modules[MAX_N_MODULES];
+	static int n_modules = 0;
+	
+	static bool overlaps_module(uint64_t start, uint64_t end) {
+		for (int i = 0; i < n_modules; i++) {
+			if (start < modules[i].end && modules[i].start < end) return true;
+		}
+		return false;
+	}
+	
+	static void load_module(struct multiboot_tag_module *mod) {
+		LDEBUG("module [%08x, %08x) %s", mod->mod_start, mod->mod_end, mod->cmdline);
+		
+		if (n_modules >= MAX_N_MODULES) {
+			LWARN("Too many modules, %s ignored", mod->cmdline);
+			return;
+		}
+		
+		Module &m = modules[n_modules++];
+		m.start = mod->mod_start;
+		m.end = mod->mod_end;
+		strncpy(m.cmdline, mod->cmdline, sizeof(m.cmdline) - 1);
+	}
+	
 	static void load_mmap(struct multiboot_tag_mmap *mmap) {
 		multiboot_memory_map_t *e = mmap->entries;
 		while ((unsigned long) e != (unsigned long) mmap + mmap->size) {
@@ -25,6 +51,8 @@ namespace Multiboot2_Loader {
 					start = Utils::round_up((uint64_t) &ebss, Memory::HUGE_PAGE_SIZE);
 				}
 				for (uint64_t va = start; va < end; va += Memory::HUGE_PAGE_SIZE) {
+					// keep modules away from the page allocator
+					if (overlaps_module(va, va + Memory::HUGE_PAGE_SIZE)) continue;
 					Memory::register_available_huge_page((void *) va);
 				}
 			}
@@ -45,6 +73,13 @@ namespace Multiboot2_Loader {
 		
 		struct multiboot_tag *tag = (struct multiboot_tag *) multiboot_addr + 1;
 		
+		// modules first, load_mmap() needs them
+		for (struct multiboot_tag *t = tag; t->type != MULTIBOOT_TAG_TYPE_END; t += (t->size + 7u) / 8u) {
+			if (t->type == MULTIBOOT_TAG_TYPE_MODULE) {
+				load_module((struct multiboot_tag_module *) t);
+			}
+		}
+		
 		while (tag->type != MULTIBOOT_TAG_TYPE_END) {
 			switch (tag->type) {
 				case MULTIBOOT_TAG_TYPE_MMAP:
@@ -60,4 +95,25 @@ namespace Multiboot2_Loader {
 			tag += (tag->size + 7u) / 8u;
 		}
 	}
+	
+	// GRUB may or may not put the file name in front of the module cmdline
+	static bool cmdline_has_word(const char *cmdline, const char *word) {
+		int len = strlen(word);
+		for (const char *ch = cmdline; *ch; ch++) {
+			if (ch != cmdline && ch[-1] != ' ') continue;
+			if (strncmp(ch, word, len) == 0 && (ch[len] == 0 || ch[len] == ' ')) {
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	const Module * find_module(const char *cmdline) {
+		for (int i = 0; i < n_modules; i++) {
+			if (cmdline_has_word(modules[i].cmdline, cmdline)) {
+				return &modules[i];
+			}
+		}
+		return NULL;
+	}
 }
@@ -4,6 +4,7 @@
 #include <inc/pci.hpp>
 #include <inc/logger.hpp>
 #include <inc/e1000.hpp>
+#include <inc/igb.hpp>
 #include <inc/virtio_net.hpp>
 #include <inc/multiboot2_loader.hpp>
 #include <inc/utils.hpp>
@@ -14,6 +15,10 @@ namespace NetworkDriver {
 	uint8_t prefix_len;
 	uint8_t server_ip[4];
 	bool do_not_send_answer;
+	uint32_t tx_csum_offload, rx_csum_offload;
+	
+	// csum_offload=0 on the command line turns offload off
+	static bool csum_offload_disabled;
 	
 	static bool read_ip(const char *ip_str, uint8_t ip[4]) {
 		int r = sscanf(ip_str, "%hhu.%hhu.%hhu.%hhu", &ip[0], &ip[1], &ip[2], &ip[3]);
@@ -61,6 +66,11 @@ namespace NetworkDriver {
 				if (1 == sscanf(content, "%d", &val)) {
 					do_not_send_answer = val != 0;
 				}
+			} else if (1 == sscanf(buf, " csum_offload = %s", content)) {
+				int val;
+				if (1 == sscanf(content, "%d", &val)) {
+					csum_offload_disabled = val == 0;
+				}
 			}
 		}
 		
@@ -82,15 +92,156 @@ namespace NetworkDriver {
 		return true;
 	}
 	
-	// returns: # of bytes sent
-	int (*send)(const void *buf, int len);
+	int (*send_sg)(const Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	
+	int (*rx_burst)(PacketRef *pkts, int max);
 	
-	// returns: # of bytes received
-	int (*receive)(void *buf);
+	void (*rx_release)(int n);
 	
 	// returns: zero
 	int (*flush)();
 	
+	int n_queue_pairs;
+	
+	int (*send_sg_q)(int queue, const Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg);
+	int (*rx_burst_q)(int queue, PacketRef *pkts, int max);
+	void (*rx_release_q)(int queue, int n);
+	
+	// For NICs with a single queue pair
+	static int single_send_sg_q(int queue, const Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg) {
+		return queue == 0 && send_sg ? send_sg(frags, n, csum, done, arg) : -1;
+	}
+	
+	static int single_rx_burst_q(int queue, PacketRef *pkts, int max) {
+		return queue == 0 && rx_burst ? rx_burst(pkts, max) : 0;
+	}
+	
+	// With csum_offload=0 the NIC may still verify checksums, so its
+	// verdicts are masked out here before anyone sees them
+	static int (*driver_rx_burst)(PacketRef *pkts, int max);
+	static int (*driver_rx_burst_q)(int queue, PacketRef *pkts, int max);
+	
+	static int mask_rx_csum(PacketRef *pkts, int n) {
+		for (int i = 0; i < n; i++) {
+			pkts[i].csum &= rx_csum_offload;
+		}
+		return n;
+	}
+	
+	static int masked_rx_burst(PacketRef *pkts, int max) {
+		return mask_rx_csum(pkts, driver_rx_burst(pkts, max));
+	}
+	
+	static int masked_rx_burst_q(int queue, PacketRef *pkts, int max) {
+		return mask_rx_csum(pkts, driver_rx_burst_q(queue, pkts, max));
+	}
+	
+	static void single_rx_release_q(int queue, int n) {
+		if (queue == 0 && rx_release) {
+			rx_release(n);
+		}
+	}
+	
+	bool (*steer)(const FlowMatch &match, int queue);
+	
+	// For NICs without receive filters
+	static bool no_steer(const FlowMatch &, int) {
+		return false;
+	}
+	
+	bool has_rx_wakeup;
+	static bool (*driver_wakeup_arm)();
+	static void (*driver_wakeup_disarm)();
+	
+	bool rx_wakeup_arm() {
+		return has_rx_wakeup ? driver_wakeup_arm() : true;
+	}
+	
+	void rx_wakeup_disarm() {
+		if (!has_rx_wakeup) {
+			return;
+		}
+		driver_wakeup_disarm();
+	}
+	
+	const volatile uint32_t *(*rx_wait_addr)();
+	
+	static const volatile uint32_t *no_rx_wait_addr() {
+		return NULL;
+	}
+	
+	TxStamps last_tx;
+	
+	// ===== TX buffers =====
+	
+	const int N_TX_BUFFERS = 256;
+	static TxBuffer tx_buffers[N_TX_BUFFERS];
+	static TxBuffer *tx_free_list;
+	
+	static void init_tx_buffers() {
+		tx_free_list = NULL;
+		for (int i = N_TX_BUFFERS - 1; i >= 0; i--) {
+			tx_free(&tx_buffers[i]);
+		}
+	}
+	
+	TxBuffer *tx_alloc(int headroom) {
+		if (tx_free_list == NULL && flush) {
+			flush();
+		}
+		
+		TxBuffer *buf = tx_free_list;
+		if (buf == NULL || headroom < 0 || headroom > TX_BUFFER_SIZE) {
+			return NULL;
+		}
+		
+		tx_free_list = buf->next_free;
+		buf->data = buf->mem + headroom;
+		buf->len = 0;
+		buf->csum = 0;
+		return buf;
+	}
+	
+	void tx_free(TxBuffer *buf) {
+		buf->next_free = tx_free_list;
+		tx_free_list = buf;
+	}
+	
+	static void tx_done(void *arg) {
+		tx_free((TxBuffer *) arg);
+	}
+	
+	int tx_send_q(int queue, TxBuffer *buf) {
+		Fragment frag = { buf->data, buf->len };
+		int r = send_sg_q(queue, &frag, 1, buf->csum, tx_done, buf);
+		if (r < 0) {
+			tx_free(buf);
+		}
+		return r;
+	}
+	
+	int tx_send(TxBuffer *buf) {
+		return tx_send_q(0, buf);
+	}
+	
+	int send(const void *buf, int len, uint32_t csum) {
+		if (len < 0 || len > MAX_FRAME_LEN) {
+			return -1;
+		}
+		
+		TxBuffer *tx = tx_alloc(0);
+		if (tx == NULL) {
+			return -1;
+		}
+		
+		memcpy(tx->put(len), buf, len);
+		tx->csum = csum;
+		return tx_send(tx);
+	}
+	
 	void init() {
 		LDEBUG_ENTER_RET();
 		
@@ -108,19 +259,77 @@ namespace NetworkDriver {
 		}
 		
 		if (e1000::init(mac)) {
-			send = e1000::send;
-			receive = e1000::receive;
+			send_sg = e1000::send_sg;
+			rx_burst = e1000::rx_burst;
+			rx_release = e1000::rx_release;
 			flush = e1000::flush;
+			tx_csum_offload = rx_csum_offload = e1000::csum_offload();
+			has_rx_wakeup = e1000::has_rx_wakeup();
+			driver_wakeup_arm = e1000::rx_wakeup_arm;
+			driver_wakeup_disarm = e1000::rx_wakeup_disarm;
+			rx_wait_addr = e1000::rx_wait_addr;
 			LINFO("e1000 driver initialized");
+		} else if (igb::init(mac)) {
+			send_sg = igb::send_sg;
+			rx_burst = igb::rx_burst;
+			rx_release = igb::rx_release;
+			flush = igb::flush;
+			tx_csum_offload = rx_csum_offload = igb::csum_offload();
+			n_queue_pairs = igb::n_queue_pairs();
+			send_sg_q = igb::send_sg_q;
+			rx_burst_q = igb::rx_burst_q;
+			rx_release_q = igb::rx_release_q;
+			steer = igb::steer;
+			has_rx_wakeup = igb::has_rx_wakeup();
+			driver_wakeup_arm = igb::rx_wakeup_arm;
+			driver_wakeup_disarm = igb::rx_wakeup_disarm;
+			rx_wait_addr = igb::rx_wait_addr;
+			LINFO("igb driver initialized");
 		} else if (virtio_net::init(mac)) {
-			send = virtio_net::send;
-			receive = virtio_net::receive;
+			send_sg = virtio_net::send_sg;
+			rx_burst = virtio_net::rx_burst;
+			rx_release = virtio_net::rx_release;
 			flush = virtio_net::flush;
+			n_queue_pairs = virtio_net::n_queue_pairs();
+			send_sg_q = virtio_net::send_sg_q;
+			rx_burst_q = virtio_net::rx_burst_q;
+			rx_release_q = virtio_net::rx_release_q;
+			has_rx_wakeup = virtio_net::has_rx_wakeup();
+			driver_wakeup_arm = virtio_net::rx_wakeup_arm;
+			driver_wakeup_disarm = virtio_net::rx_wakeup_disarm;
+			rx_wait_addr = virtio_net::rx_wait_addr;
 			LINFO("virtio-net driver initialized");
 		} else {
 			LWARN("No network driver found. Running in standalone mode...");
 		}
 		
+		if (send_sg_q == NULL) {
+			n_queue_pairs = 1;
+			send_sg_q = single_send_sg_q;
+			rx_burst_q = single_rx_burst_q;
+			rx_release_q = single_rx_release_q;
+		}
+		if (steer == NULL) {
+			steer = no_steer;
+		}
+		if (rx_wait_addr == NULL) {
+			rx_wait_addr = no_rx_wait_addr;
+		}
+		
+		init_tx_buffers();
+		
+		if (csum_offload_disabled) {
+			tx_csum_offload = rx_csum_offload = 0;
+			if (rx_burst) {
+				driver_rx_burst = rx_burst;
+				rx_burst = masked_rx_burst;
+			}
+			driver_rx_burst_q = rx_burst_q;
+			rx_burst_q = masked_rx_burst_q;
+		}
+		LINFO("checksum offload: tx %x rx %x", tx_csum_offload, rx_csum_offload);
+		LINFO("RX wakeup interrupts: %s", has_rx_wakeup ? "yes" : "no");
+		
 		LINFO("IP = %u.%u.%u.%u/%u  MAC = %02x:%02x:%02x:%02x:%02x:%02x  gateway = %u.%u.%u.%u",
 			ip[0], ip[1], ip[2], ip[3], prefix_len,
 			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
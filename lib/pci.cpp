@@ -8,6 +8,7 @@
 #include <inc/logger.hpp>
 #include <inc/memory.hpp>
 #include <inc/utils.hpp>
+#include <inc/lapic.hpp>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
@@ -22,10 +23,16 @@ namespace PCI {
 	static Func stored_pci_devices[MAX_N_PCI_DEVICES];
 	static int n_stored_pci_devices = 0;
 	
+	// Buses behind bridges live on the stack during the scan
+	static Bus stored_pci_buses[MAX_N_PCI_DEVICES];
+	
 	static int pci_store(Func *pcif) {
 		if (n_stored_pci_devices < MAX_N_PCI_DEVICES) {
 			pci_func_enable(pcif);
-			memcpy(&stored_pci_devices[n_stored_pci_devices++], pcif, sizeof(Func));
+			stored_pci_buses[n_stored_pci_devices] = *pcif->bus;
+			memcpy(&stored_pci_devices[n_stored_pci_devices], pcif, sizeof(Func));
+			stored_pci_devices[n_stored_pci_devices].bus = &stored_pci_buses[n_stored_pci_devices];
+			n_stored_pci_devices++;
 			LINFO("PCI enabled: %04x.%04x",
 				PCI_VENDOR(pcif->dev_id), PCI_PRODUCT(pcif->dev_id));
 			return 0;
@@ -70,8 +77,15 @@ namespace PCI {
 		{ 0x8086, 0x15b8, &pci_store },  // I219-V H310CM-ITX/ac
 		{ 0x8086, 0x0d55, &pci_store },  // B460M TUF Gaming
 		{ 0x8086, 0x15fa, &pci_store },  // H510M-HDV/M.2
+		// igb
+		{ 0x8086, 0x10c9, &pci_store },  // 82576
+		{ 0x8086, 0x10e6, &pci_store },  // 82576 fiber
+		{ 0x8086, 0x10e7, &pci_store },  // 82576 serdes
+		{ 0x8086, 0x10e8, &pci_store },  // 82576 quad copper
+		{ 0x8086, 0x1526, &pci_store },  // 82576 quad copper ET2
 		// And virtio net
 		{ 0x1af4, 0x1000, &pci_store },  // Virtio Network
+		{ 0x1af4, 0x1041, &pci_store },  // Virtio Network (modern only)
 		{ 0, 0, 0 },
 	};
 	
@@ -237,7 +251,8 @@ namespace PCI {
 			}
 			
 			int regnum = PCI_MAPREG_NUM(bar);
-			uint32_t base, size;
+			uint64_t base;
+			uint32_t size;
 			if (PCI_MAPREG_TYPE(rv) == PCI_MAPREG_TYPE_MEM) {
 				if (PCI_MAPREG_MEM_TYPE(rv) == PCI_MAPREG_MEM_TYPE_64BIT) {
 					bar_width = 8;
@@ -247,8 +262,11 @@ namespace PCI {
 				
 				size = PCI_MAPREG_MEM_SIZE(rv);
 				base = PCI_MAPREG_MEM_ADDR(oldv);
+				if (bar_width == 8) {
+					base |= (uint64_t) pci_conf_read(f, bar + 4) << 32;
+				}
 				if (pci_show_addrs) {
-					LDEBUG("  mem region %d: %d bytes at 0x%x",
+					LDEBUG("  mem region %d: %d bytes at 0x%lx",
 						regnum, size, base);
 				}
 			} else {
@@ -257,7 +275,7 @@ namespace PCI {
 				size = PCI_MAPREG_IO_SIZE(rv);
 				base = PCI_MAPREG_IO_ADDR(oldv);
 				if (pci_show_addrs) {
-					LDEBUG("  io region %d: %d bytes at 0x%x",
+					LDEBUG("  io region %d: %d bytes at 0x%lx",
 						regnum, size, base);
 				}
 			}
@@ -269,7 +287,7 @@ namespace PCI {
 			if (size && !base) {
 				LWARN("PCI device %02x:%02x.%d (%04x:%04x) "
 					"may be misconfigured: "
-					"region %d: base 0x%x, size %d",
+					"region %d: base 0x%lx, size %d",
 					f->bus->busno, f->dev, f->func,
 					PCI_VENDOR(f->dev_id), PCI_PRODUCT(f->dev_id),
 					regnum, base, size);
@@ -340,4 +358,129 @@ namespace PCI {
 		return -1ull;
 	}
 	
+	static Func *find_stored_device(uint32_t key1, uint32_t key2) {
+		for (int i = 0; i < n_stored_pci_devices; i++) {
+			uint32_t dev_id = stored_pci_devices[i].dev_id;
+			if (PCI_VENDOR(dev_id) == key1 && PCI_PRODUCT(dev_id) == key2) {
+				return &stored_pci_devices[i];
+			}
+		}
+		return NULL;
+	}
+	
+	uint32_t read_config(uint32_t key1, uint32_t key2, uint32_t off) {
+		Func *f = find_stored_device(key1, key2);
+		return f ? pci_conf_read(f, off) : 0xffffffff;
+	}
+	
+	uint32_t find_capability(uint32_t key1, uint32_t key2, uint8_t cap_id, uint32_t after) {
+		Func *f = find_stored_device(key1, key2);
+		if (f == NULL || !(pci_conf_read(f, PCI_COMMAND_STATUS_REG) & PCI_STATUS_CAPLIST_SUPPORT)) {
+			return 0;
+		}
+		
+		uint32_t off = after
+			? PCI_CAPLIST_NEXT(pci_conf_read(f, after))
+			: PCI_CAPLIST_PTR(pci_conf_read(f, PCI_CAPLISTPTR_REG));
+		
+		// at most 48 capabilities fit in the 192 bytes after the header
+		for (int i = 0; i < 48 && off >= 0x40; i++) {
+			off &= ~3u;
+			uint32_t cr = pci_conf_read(f, off);
+			if (PCI_CAPLIST_CAP(cr) == cap_id) {
+				return off;
+			}
+			off = PCI_CAPLIST_NEXT(cr);
+		}
+		return 0;
+	}
+	
+	void write_config(uint32_t key1, uint32_t key2, uint32_t off, uint32_t value) {
+		Func *f = find_stored_device(key1, key2);
+		if (f) {
+			pci_conf_write(f, off, value);
+		}
+	}
+	
+	// Fixed delivery, edge triggered, physical destination
+	static inline uint32_t msi_address() {
+		return 0xfee00000 | ((uint32_t) LAPIC::id() << 12);
+	}
+	
+	static void disable_intx(Func *f) {
+		uint32_t cmd = pci_conf_read(f, PCI_COMMAND_STATUS_REG) & 0xffff;
+		pci_conf_write(f, PCI_COMMAND_STATUS_REG, cmd | PCI_COMMAND_INTERRUPT_DISABLE);
+	}
+	
+	bool enable_msi(uint32_t key1, uint32_t key2, uint8_t vector) {
+		Func *f = find_stored_device(key1, key2);
+		uint32_t cap = find_capability(key1, key2, PCI_CAP_MSI);
+		if (f == NULL || cap == 0) {
+			return false;
+		}
+		
+		// message control: ENABLE bit 16, 64-bit address bit 23; one message
+		uint32_t ctrl = pci_conf_read(f, cap);
+		bool is_64bit = ctrl & (1u << 23);
+		pci_conf_write(f, cap + 4, msi_address());
+		if (is_64bit) {
+			pci_conf_write(f, cap + 8, 0);
+		}
+		uint32_t data_off = is_64bit ? cap + 12 : cap + 8;
+		uint32_t data = pci_conf_read(f, data_off);
+		pci_conf_write(f, data_off, (data & 0xffff0000) | vector);
+		pci_conf_write(f, cap, (ctrl & ~(7u << 20)) | (1u << 16));
+		
+		disable_intx(f);
+		return true;
+	}
+	
+	// MSI-X tables live in a memory BAR, these windows map them
+	#define MAX_N_MSIX_DEVICES 2
+	#define MSIX_WINDOW_SIZE 0x4000
+	static volatile char msix_windows[MAX_N_MSIX_DEVICES][MSIX_WINDOW_SIZE]
+		__attribute__((aligned(Memory::PAGE_SIZE)));
+	static int n_msix_windows;
+	
+	bool enable_msix(uint32_t key1, uint32_t key2, uint8_t vector) {
+		Func *f = find_stored_device(key1, key2);
+		uint32_t cap = find_capability(key1, key2, PCI_CAP_MSIX);
+		if (f == NULL || cap == 0 || n_msix_windows == MAX_N_MSIX_DEVICES) {
+			return false;
+		}
+		
+		// message control: table size - 1 in bits 26:16, FUNCTION_MASK
+		// bit 30, ENABLE bit 31; the table is at offset in BAR bir
+		uint32_t ctrl = pci_conf_read(f, cap);
+		uint32_t n_entries = ((ctrl >> 16) & 0x7ff) + 1;
+		uint32_t table = pci_conf_read(f, cap + 4);
+		uint32_t bir = table & 7, offset = table & ~7u;
+		uint32_t end = offset + n_entries * 16;
+		if (bir >= 6 || end > MSIX_WINDOW_SIZE) {
+			LWARN("PCI: %04x.%04x: MSI-X table at BAR %u + 0x%x out of reach",
+				key1, key2, bir, offset);
+			return false;
+		}
+		
+		volatile char *window = msix_windows[n_msix_windows];
+		uint64_t r = map_device(key1, key2, (uint64_t) window, end, bir);
+		if (r == -1ull || r < end) {
+			return false;
+		}
+		n_msix_windows++;
+		
+		// entries are programmed with the function masked
+		pci_conf_write(f, cap, ctrl | (1u << 30) | (1u << 31));
+		for (uint32_t i = 0; i < n_entries; i++) {
+			volatile uint32_t *entry = (volatile uint32_t *) (window + offset + 16 * i);
+			entry[0] = msi_address();
+			entry[1] = 0;
+			entry[2] = vector;
+			entry[3] = 0;  // vector control: unmasked
+		}
+		pci_conf_write(f, cap, (ctrl & ~(1u << 30)) | (1u << 31));
+		
+		disable_intx(f);
+		return true;
+	}
 }
@@ -1,46 +1,101 @@
 #include <inc/scheduler.hpp>
 #include <inc/logger.hpp>
 #include <inc/timer.hpp>
+#include <inc/x86_64.hpp>
+#include <inc/network_driver.hpp>
 
 namespace Scheduler {
 	static enum {
 		ACTIVE, IDLE
 	} current_state;
 	
+	// Spin for up to SPIN_GAPS average gaps between bursts of traffic, as
+	// long as that is below SPIN_MAX_US; past that the next burst is far
+	// off, so only spin SPIN_MIN_US before sleeping
+	const uint64_t SPIN_GAPS = 2;
+	const uint64_t SPIN_MIN_US = 20;
+	const uint64_t SPIN_MAX_US = 1000;
+	static uint64_t spin_min_tsc, spin_max_tsc;
+	
+	// already X ms idle -> sleep Y ms
+	const uint64_t idle_policy_ms[][2] = {
+		{ 0, 1 },
+		{ 30, 2 },
+	};
+	const int n_idle_policies =
+		sizeof(idle_policy_ms) / sizeof(idle_policy_ms[0]);
+	
+	static uint64_t last_active_tsc;  // when the current idle period began
+	static uint64_t avg_gap_tsc;      // EWMA of idle periods, weight 1/8
+	
+	static uint64_t busy_tsc, spin_tsc, sleep_tsc, n_sleeps;
+	static uint64_t last_account_tsc;
+	
+	// Charges the time since the last call to the current state
+	static void account(uint64_t now) {
+		if (current_state == ACTIVE) {
+			busy_tsc += now - last_account_tsc;
+		} else {
+			spin_tsc += now - last_account_tsc;
+		}
+		last_account_tsc = now;
+	}
+	
 	void init() {
 		LDEBUG_ENTER_RET();
 		
+		spin_min_tsc = SPIN_MIN_US * (Timer::tsc_freq / 1000000);
+		spin_max_tsc = SPIN_MAX_US * (Timer::tsc_freq / 1000000);
+		
 		current_state = ACTIVE;
+		avg_gap_tsc = 0;
+		busy_tsc = spin_tsc = sleep_tsc = n_sleeps = 0;
+		last_account_tsc = Timer::get_tsc();
 	}
 	
+	// Called for every frame, so only the end of an idle period costs
 	void set_active() {
+		if (current_state == ACTIVE) return;
+		
+		uint64_t now = Timer::get_tsc();
+		account(now);
 		current_state = ACTIVE;
+		
+		int64_t gap = now - last_active_tsc;
+		avg_gap_tsc += (gap - (int64_t) avg_gap_tsc) / 8;
 	}
 	
-	static uint64_t last_active_timestamp_ns;
-	
-	// already X ms idle -> sleep Y ms
-	const uint64_t idle_policy_ms[][2] = {
-		{ 0, 0 },
-		{ 1, 1 },
-		{ 30, 2 },
-	};
-	const int n_idle_policies =
-		sizeof(idle_policy_ms) / sizeof(idle_policy_ms[0]);
-	
 	void set_idle() {
 		if (current_state == ACTIVE) {
-			last_active_timestamp_ns = Timer::ns_since_epoch();
+			uint64_t now = Timer::get_tsc();
+			account(now);
+			last_active_tsc = now;
 			current_state = IDLE;
 		}
 	}
 	
+	// Whether a frame can end a sleep early, instead of it costing up to
+	// a whole sleep of latency
+	static bool can_wake_early() {
+		return NetworkDriver::has_rx_wakeup
+			|| (Timer::has_mwait && NetworkDriver::rx_wait_addr() != NULL);
+	}
+	
+	static uint64_t get_spin_limit_tsc() {
+		if (!can_wake_early()) return spin_max_tsc;
+		
+		uint64_t limit = SPIN_GAPS * avg_gap_tsc;
+		if (limit > spin_max_tsc) return spin_min_tsc;
+		return limit > spin_min_tsc ? limit : spin_min_tsc;
+	}
+	
 	static uint64_t get_sleep_duration_ms() {
 		if (current_state != IDLE) return 0;
 		
-		const uint64_t current_timestamp_ns = Timer::ns_since_epoch();
-		const uint64_t idle_time_ms =
-			(current_timestamp_ns - last_active_timestamp_ns) / 1000000;
+		const uint64_t idle_tsc = Timer::get_tsc() - last_active_tsc;
+		if (idle_tsc < get_spin_limit_tsc()) return 0;
+		
+		const uint64_t idle_time_ms = Timer::tsc_to_ns(idle_tsc) / 1000000;
 		
 		// pick the matched idle policy
 		int i;
@@ -55,11 +110,46 @@ namespace Scheduler {
 		return get_sleep_duration_ms() > 0;
 	}
 	
+	void spin() {
+		x86_64::pause();
+	}
+	
+	// A frame arriving meanwhile ends the sleep early, if the NIC can
+	// wake us (NetworkDriver::has_rx_wakeup) or we can watch its RX ring
 	void sleep() {
 		uint64_t ms = get_sleep_duration_ms();
+		if (ms == 0) return;
+		
+		// Read before arming, so a frame landing in between shows up as a
+		// changed value and the wait ends at once
+		const volatile uint32_t *addr = NetworkDriver::rx_wait_addr();
+		uint32_t value = addr ? *addr : 0;
 		
-		if (ms > 0) {
-			Timer::powersave_sleep(ms * 1000000);
+		uint64_t start = Timer::get_tsc();
+		account(start);
+		
+		if (NetworkDriver::rx_wakeup_arm()) {
+			if (addr) {
+				Timer::powersave_wait(ms * 1000000, addr, value);
+			} else {
+				Timer::powersave_sleep(ms * 1000000);
+			}
 		}
+		NetworkDriver::rx_wakeup_disarm();
+		
+		last_account_tsc = Timer::get_tsc();
+		sleep_tsc += last_account_tsc - start;
+		n_sleeps++;
+	}
+	
+	Stats get_stats() {
+		account(Timer::get_tsc());
+		return (Stats) {
+			Timer::tsc_to_ns(busy_tsc),
+			Timer::tsc_to_ns(spin_tsc),
+			Timer::tsc_to_ns(sleep_tsc),
+			n_sleeps,
+			Timer::tsc_to_ns(avg_gap_tsc),
+		};
 	}
 }
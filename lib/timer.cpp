@@ -14,6 +14,7 @@ namespace Timer {
 	uint64_t tsc_freq, tsc_epoch;
 	uint32_t ext_freq;
 	uint64_t clk_freq;
+	bool has_mwait;
 	
 	// returns: -1 if error
 	static int get_tsc_clock_ratio(uint32_t *a, uint32_t *b, uint32_t *ext_freq) {
@@ -89,6 +90,11 @@ namespace Timer {
 		
 		LDEBUG("tsc_freq = %lu, ext_freq = %u", tsc_freq, ext_freq);
 		
+		uint32_t ecx;
+		x86_64::cpuid(1, NULL, NULL, &ecx, NULL);
+		has_mwait = ecx & (1u << 3);
+		LDEBUG("MONITOR/MWAIT: %s", has_mwait ? "yes" : "no");
+		
 		enable_performance_counters();
 	}
 	
@@ -98,6 +104,23 @@ namespace Timer {
 		x86_64::hlt();
 	}
 	
+	// Checking *addr after monitor closes the race with a write that came
+	// before it. Whatever ended the wait, the timer is stopped after.
+	void powersave_wait(uint64_t ns, const volatile uint32_t *addr, uint32_t value) {
+		if (!has_mwait) {
+			powersave_sleep(ns);
+			return;
+		}
+		
+		LAPIC::timer_single_shot_ns(ns);
+		x86_64::monitor(addr);
+		if (*addr == value) {
+			x86_64::sti_mwait(0);  // C1
+			x86_64::cli();
+		}
+		LAPIC::timer_disable();
+	}
+	
 	void reset_performance_counters() {
 		LWARN("[2021-03-14] performance counters skipped");
 		// x86_64::wrmsr(x86_64::INST_RETIRED_ANY, 0);
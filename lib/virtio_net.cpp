@@ -9,75 +9,98 @@
 #include <inc/x86_64.hpp>
 #include <inc/memory.hpp>
 #include <inc/pci.hpp>
+#include <inc/pcireg.h>
 #include <inc/timer.hpp>
+#include <inc/trap.hpp>
 
 // kernel pages are 4k-sized
 using Memory::PAGE_SIZE;
 
-// using x86_64::memory_barrier;
+// The rings live in ordinary write-back memory. x86 keeps stores in order
+// with stores and loads with loads (MMIO registers are UC, which is even
+// stricter), so the virtio read/write barriers only have to stop the
+// compiler. A store followed by a load of another location may still be
+// reordered, which matters when we publish avail->idx and then look at
+// used->flags to decide whether to notify.
+static inline void virtio_wmb() {
+	x86_64::memory_barrier();
+}
+
+static inline void virtio_rmb() {
+	x86_64::memory_barrier();
+}
 
-static inline void memory_barrier() {
+static inline void virtio_mb() {
 	asm volatile("mfence" : : : "memory");
 }
 
 namespace virtio_net {
-	// (legacy interface)
-	static uint32_t regio_base;
-	static uint64_t mmio_base;
+	// Legacy devices are driven through I/O ports or MMIO in one BAR, modern
+	// (virtio 1.x) ones through the regions their PCI capabilities point at
 	static bool is_mmio;
+	static bool is_modern;
+	
+	// Negotiated VIRTIO_F_RING_PACKED / VIRTIO_RING_F_EVENT_IDX
+	static bool use_packed;
+	static bool use_event_idx;
+	
+	const uint64_t VIRTIO_NET_F_MAC = 1ull << 5;
+	const uint64_t VIRTIO_NET_F_STATUS = 1ull << 16;
+	const uint64_t VIRTIO_NET_F_CTRL_VQ = 1ull << 17;
+	const uint64_t VIRTIO_NET_F_MQ = 1ull << 22;
+	const uint64_t VIRTIO_RING_F_EVENT_IDX = 1ull << 29;
+	const uint64_t VIRTIO_F_VERSION_1 = 1ull << 32;
+	const uint64_t VIRTIO_F_RING_PACKED = 1ull << 34;
 	
 	template <typename T>
 	static T read_mem(uint64_t addr) {
-		T ret;
-		memcpy(&ret, (const void *) addr, sizeof(T));
-		return ret;
+		return * (volatile T *) addr;
 	}
 	
 	template <typename T>
 	static void write_mem(uint64_t addr, uint32_t value) {
-		memcpy((void *) addr, &value, sizeof(T));
+		* (volatile T *) addr = value;
 	}
 	
 	struct io_reg {
-		int offset;
+		uint64_t addr;  // I/O port unless is_mmio
 		int size;
 		
-		void init(int offset, int size) {
-			this->offset = offset;
+		void init(uint64_t base, int offset, int size) {
+			this->addr = base + offset;
 			this->size = size;
 		}
 		
 		uint32_t read() {
 			if (is_mmio) {
-				memory_barrier();
+				virtio_rmb();
 				switch (size) {
-					case 4: return read_mem<uint32_t>(mmio_base + offset);
-					case 2: return read_mem<uint16_t>(mmio_base + offset);
-					default: return read_mem<uint8_t>(mmio_base + offset);
+					case 4: return read_mem<uint32_t>(addr);
+					case 2: return read_mem<uint16_t>(addr);
+					default: return read_mem<uint8_t>(addr);
 				}
 			} else {
 				switch (size) {
-					case 4: return x86_64::inl(regio_base + offset);
-					case 2: return x86_64::inw(regio_base + offset);
-					default: return x86_64::inb(regio_base + offset);
+					case 4: return x86_64::inl(addr);
+					case 2: return x86_64::inw(addr);
+					default: return x86_64::inb(addr);
 				}
 			}
 		}
 		
 		void write(uint32_t value) {
 			if (is_mmio) {
-				memory_barrier();
+				virtio_wmb();
 				switch (size) {
-					case 4: return write_mem<uint32_t>(mmio_base + offset, value);
-					case 2: return write_mem<uint16_t>(mmio_base + offset, value);
-					default: return write_mem<uint8_t>(mmio_base + offset, value);
+					case 4: return write_mem<uint32_t>(addr, value);
+					case 2: return write_mem<uint16_t>(addr, value);
+					default: return write_mem<uint8_t>(addr, value);
 				}
-				memory_barrier();
 			} else {
 				switch (size) {
-					case 4: return x86_64::outl(regio_base + offset, value), void();
-					case 2: return x86_64::outw(regio_base + offset, value), void();
-					default: return x86_64::outb(regio_base + offset, value), void();
+					case 4: return x86_64::outl(addr, value), void();
+					case 2: return x86_64::outw(addr, value), void();
+					default: return x86_64::outb(addr, value), void();
 				}
 			}
 		}
@@ -90,32 +113,84 @@ namespace virtio_net {
 	struct VirtIOCommonRegs {
 		io_reg device_features;
 		io_reg driver_features;
-		io_reg queue_address;
 		io_reg queue_size;
 		io_reg queue_select;
-		io_reg queue_notify;
 		io_reg device_status;
-		io_reg ISR_status;
 		io_reg mac[6];
+		io_reg max_virtqueue_pairs;  // with VIRTIO_NET_F_MQ
+		
+		// legacy only
+		io_reg queue_address;
+		io_reg queue_notify;
+		io_reg ISR_status;
+		
+		// modern only, 64-bit fields are split into low and high dwords
+		io_reg device_feature_select;
+		io_reg driver_feature_select;
+		io_reg msix_config;
+		io_reg queue_msix_vector;
+		io_reg queue_enable;
+		io_reg queue_notify_off;
+		io_reg queue_desc[2];
+		io_reg queue_driver[2];
+		io_reg queue_device[2];
 		
-		void init() {
-			device_features.init(0, 4);
-			driver_features.init(4, 4);
-			queue_address.init(8, 4);
-			queue_size.init(12, 2);
-			queue_select.init(14, 2);
-			queue_notify.init(16, 2);
-			device_status.init(18, 1);
-			ISR_status.init(19, 1);
+		void init_legacy(uint64_t base) {
+			device_features.init(base, 0, 4);
+			driver_features.init(base, 4, 4);
+			queue_address.init(base, 8, 4);
+			queue_size.init(base, 12, 2);
+			queue_select.init(base, 14, 2);
+			queue_notify.init(base, 16, 2);
+			device_status.init(base, 18, 1);
+			ISR_status.init(base, 19, 1);
 			
 			for (int i = 0; i < 6; i++) {
-				mac[i].init(20 + i, 1);
+				mac[i].init(base, 20 + i, 1);
 			}
+			max_virtqueue_pairs.init(base, 28, 2);
+		}
+		
+		// struct virtio_pci_common_cfg at common, virtio_net_config at device
+		void init_modern(uint64_t common, uint64_t device) {
+			device_feature_select.init(common, 0x00, 4);
+			device_features.init(common, 0x04, 4);
+			driver_feature_select.init(common, 0x08, 4);
+			driver_features.init(common, 0x0c, 4);
+			msix_config.init(common, 0x10, 2);
+			device_status.init(common, 0x14, 1);
+			queue_select.init(common, 0x16, 2);
+			queue_size.init(common, 0x18, 2);
+			queue_msix_vector.init(common, 0x1a, 2);
+			queue_enable.init(common, 0x1c, 2);
+			queue_notify_off.init(common, 0x1e, 2);
+			for (int i = 0; i < 2; i++) {
+				queue_desc[i].init(common, 0x20 + 4 * i, 4);
+				queue_driver[i].init(common, 0x28 + 4 * i, 4);
+				queue_device[i].init(common, 0x30 + 4 * i, 4);
+			}
+			
+			for (int i = 0; i < 6; i++) {
+				mac[i].init(device, i, 1);
+			}
+			max_virtqueue_pairs.init(device, 8, 2);
 		}
 	};
 	
 	static VirtIOCommonRegs common_regs;
 	
+	// modern: queue i is notified at notify_base + its queue_notify_off * multiplier
+	static uint64_t notify_base;
+	static uint32_t notify_off_multiplier;
+	
+	// modern: the PCI device init_modern_regs went with
+	static uint32_t modern_device_id;
+	
+	// RX queues interrupt through MSI-X entry 0 (modern only, enabling
+	// MSI-X moves the legacy device config)
+	static bool msix_enabled;
+	#define VIRTIO_MSI_NO_VECTOR 0xffff
+	
 	#define VIRTQ_DESC_F_NEXT 1
 	#define VIRTQ_DESC_F_WRITE 2
 	#define VIRTQ_DESC_F_INDIRECT 4
@@ -129,6 +204,7 @@ namespace virtio_net {
 	
 	#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
 	
+	// followed by used_event with EVENT_IDX
 	struct VirtQueueAvail {
 		uint16_t flags;
 		uint16_t idx;
@@ -142,39 +218,180 @@ namespace virtio_net {
 		uint32_t len;
 	} __attribute__((packed));
 	
+	// followed by avail_event with EVENT_IDX
 	struct VirtQueueUsed {
 		uint16_t flags;
 		uint16_t idx;
 		VirtQueueUsedElement ring[];
 	} __attribute__((packed));
 	
+	// A slot is available when AVAIL matches the driver's wrap counter and
+	// USED does not, used when both match the device's
+	#define VIRTQ_DESC_F_AVAIL (1 << 7)
+	#define VIRTQ_DESC_F_USED (1 << 15)
+	
+	struct VirtQueuePackedDesc {
+		uint64_t addr;
+		uint32_t len;
+		uint16_t id;
+		uint16_t flags;
+	} __attribute__((packed));
+	
+	#define RING_EVENT_FLAGS_ENABLE 0
+	#define RING_EVENT_FLAGS_DISABLE 1
+	#define RING_EVENT_FLAGS_DESC 2  // only with EVENT_IDX
+	
+	// Packed ring event suppression, one each for the driver and the device
+	struct VirtQueueEvent {
+		uint16_t off_wrap;
+		uint16_t flags;
+	} __attribute__((packed));
+	
+	// Whether moving an index from old_idx to new_idx passed event_idx
+	static inline bool need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+		return (uint16_t) (new_idx - event_idx - 1) < (uint16_t) (new_idx - old_idx);
+	}
+	
+	#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+	#define VIRTIO_NET_HDR_F_DATA_VALID 2
+	#define VIRTIO_NET_HDR_F_RSC_INFO 4
+	
+	#define VIRTIO_NET_HDR_GSO_NONE 0
+	#define VIRTIO_NET_HDR_GSO_TCPV4 1
+	#define VIRTIO_NET_HDR_GSO_UDP 3
+	#define VIRTIO_NET_HDR_GSO_TCPV6 4
+	#define VIRTIO_NET_HDR_GSO_ECN 0x80
+	
+	struct VirtIONetHeader {
+		uint8_t flags;
+		uint8_t gso_type;
+		uint16_t hdr_len;
+		uint16_t gso_size;
+		uint16_t csum_start;
+		uint16_t csum_offset;
+		uint16_t num_buffers;  // only there with VIRTIO_F_VERSION_1
+	} __attribute__((packed));
+	
+	// sizeof(VirtIONetHeader) for modern devices, 2 less for legacy ones
+	static uint32_t net_hdr_len;
+	
 	const int MAX_SUPPORTED_QUEUE_SIZE = 4096;
 	const int QUEUE_MEMORY_SIZE = MAX_SUPPORTED_QUEUE_SIZE * (18 + 8) + 2 * PAGE_SIZE;
 	static char queue_memory_pool[QUEUE_MEMORY_SIZE * 2] __attribute__((aligned(PAGE_SIZE)));
 	static uint32_t queue_memory_pool_allocated = 0;
 	
+	// returns: NULL once the pool is used up
 	static void * alloc_queue_memory(uint32_t size) {
-		assert(size + queue_memory_pool_allocated <= sizeof(queue_memory_pool));
+		if (size + queue_memory_pool_allocated > sizeof(queue_memory_pool)) {
+			return NULL;
+		}
 		void *ret = queue_memory_pool + queue_memory_pool_allocated;
 		queue_memory_pool_allocated += size;
 		return ret;
 	}
 	
 	const int BUFFER_LEN = 1600;
-	const int MAX_ACTUAL_QUEUE_SIZE = 128;
+	const int MAX_ACTUAL_QUEUE_SIZE = 256;
+	const int MAX_QUEUE_PAIRS = 4;
 	const int QUEUE_BUFFER_POOL_SIZE = MAX_ACTUAL_QUEUE_SIZE * BUFFER_LEN;
-	static char queue_buffer_pool[QUEUE_BUFFER_POOL_SIZE * 2] __attribute__((aligned(PAGE_SIZE)));
+	static char queue_buffer_pool[QUEUE_BUFFER_POOL_SIZE * (MAX_QUEUE_PAIRS + 1)]
+		__attribute__((aligned(PAGE_SIZE)));
 	static uint32_t queue_buffer_pool_allocated = 0;
 	
+	// returns: NULL once the pool is used up
 	static void * alloc_queue_buffer(uint32_t size) {
-		assert(size + queue_buffer_pool_allocated <= sizeof(queue_buffer_pool));
+		if (size + queue_buffer_pool_allocated > sizeof(queue_buffer_pool)) {
+			return NULL;
+		}
 		void *ret = queue_buffer_pool + queue_buffer_pool_allocated;
 		queue_buffer_pool_allocated += size;
 		return ret;
 	}
 	
-	struct VirtQueue {
+	// Selects queue_id and sizes its ring: legacy devices fix the size,
+	// modern ones let us shrink it to what we use
+	// returns: # of entries, zero if the queue does not exist
+	static uint32_t queue_begin(int queue_id) {
+		common_regs.queue_select.write(queue_id);
+		uint32_t size = common_regs.queue_size.read();
+		if (is_modern && size > (uint32_t) MAX_ACTUAL_QUEUE_SIZE) {
+			size = MAX_ACTUAL_QUEUE_SIZE;
+			common_regs.queue_size.write(size);
+		}
+		return size;
+	}
+	
+	// Hands the selected queue's rings to the device
+	// returns: where to notify it (modern only)
+	static uint64_t queue_activate(uint64_t desc, uint64_t driver, uint64_t device) {
+		virtio_wmb();
+		
+		if (!is_modern) {
+			// the legacy layout is implied by the queue size
+			common_regs.queue_address.write(desc / PAGE_SIZE);
+			return 0;
+		}
+		
+		common_regs.queue_desc[0].write(desc);
+		common_regs.queue_desc[1].write(desc >> 32);
+		common_regs.queue_driver[0].write(driver);
+		common_regs.queue_driver[1].write(driver >> 32);
+		common_regs.queue_device[0].write(device);
+		common_regs.queue_device[1].write(device >> 32);
+		uint64_t notify_addr = notify_base
+			+ (uint64_t) common_regs.queue_notify_off.read() * notify_off_multiplier;
+		common_regs.queue_enable.write(1);
+		return notify_addr;
+	}
+	
+	enum QueueKind { RX_QUEUE, TX_QUEUE, CTRL_QUEUE };
+	
+	// What both ring layouts keep per queue
+	struct QueueBase {
 		int queue_id;
+		uint64_t notify_addr;
+		
+		// TX queues put a net header in front of every chain
+		bool with_header;
+		
+		// TX/CTRL: completion of the chain with each buffer id
+		struct {
+			void (*fn)(void *);
+			void *arg;
+		} done[MAX_ACTUAL_QUEUE_SIZE];
+		
+		// TX: each chain starts with the (constant) net header of its id
+		VirtIONetHeader *headers;
+		
+		// RX: ids of the used buffers handed out by recv_burst, oldest first
+		uint16_t held[MAX_ACTUAL_QUEUE_SIZE];
+		uint32_t held_head, n_held;
+		
+		bool init_tx(uint32_t n, QueueKind kind) {
+			with_header = kind == TX_QUEUE;
+			headers = (VirtIONetHeader *) alloc_queue_buffer(n * sizeof(VirtIONetHeader));
+			if (headers == NULL) {
+				return false;
+			}
+			for (uint32_t id = 0; id < n; id++) {
+				headers[id] = (VirtIONetHeader) {
+					0, VIRTIO_NET_HDR_GSO_NONE, 0, 0, 0, 0, 0
+				};
+				done[id].fn = NULL;
+			}
+			return true;
+		}
+		
+		void kick() {
+			if (is_modern) {
+				write_mem<uint16_t>(notify_addr, queue_id);
+			} else {
+				common_regs.queue_notify.write(queue_id);
+			}
+		}
+	};
+	
+	struct SplitQueue : QueueBase {
 		uint32_t queue_size;
 		uint32_t actual_queue_size;
 		VirtQueueDesc *desc;
@@ -182,9 +399,18 @@ namespace virtio_net {
 		VirtQueueUsed *used;
 		uint16_t cur_used_idx;
 		
-		void init(int queue_id, bool is_receive) {
-			common_regs.queue_select.write(queue_id);
-			uint32_t queue_size = common_regs.queue_size.read();
+		// avail->idx when we last decided whether to notify
+		uint16_t notified_idx;
+		
+		// TX: descriptors not in flight, linked through next
+		uint16_t free_head;
+		uint32_t n_free;
+		
+		bool init(int queue_id, QueueKind kind) {
+			uint32_t queue_size = queue_begin(queue_id);
+			if (queue_size == 0) {
+				return false;
+			}
 			uint32_t actual_queue_size = std::min((uint32_t) MAX_ACTUAL_QUEUE_SIZE, queue_size);
 			LDEBUG("init_queue %d, size %u (%u actual)", queue_id, queue_size, actual_queue_size);
 			
@@ -196,138 +422,620 @@ namespace virtio_net {
 			uint32_t total_size = Utils::round_up(part1_size + used_size, PAGE_SIZE);
 			
 			uint64_t queue_base = (uint64_t) alloc_queue_memory(total_size);
+			if (queue_base == 0) {
+				return false;
+			}
 			this->desc = (VirtQueueDesc *) queue_base;
 			this->avail = (VirtQueueAvail *) (queue_base + desc_size);
 			this->used = (VirtQueueUsed *) (queue_base + part1_size);
 			
 			this->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
 			this->avail->idx = 0;
+			// used_event: with EVENT_IDX, interrupt only after a full wrap
+			this->avail->ring[queue_size] = 0xffff;
 			
-			this->used->flags = VIRTQ_USED_F_NO_NOTIFY;
+			// used->flags is the device's to set
+			this->used->flags = 0;
 			this->used->idx = 0;
 			this->cur_used_idx = 0;
 			
-			uint16_t desc_flags = is_receive ? VIRTQ_DESC_F_WRITE : 0;
 			for (uint32_t id = 0; id < queue_size; id++) {
-				if (id < actual_queue_size) {
+				if (id < actual_queue_size && kind == RX_QUEUE) {
+					void *buf = alloc_queue_buffer(BUFFER_LEN);
+					if (buf == NULL) {
+						return false;
+					}
 					this->desc[id] = (VirtQueueDesc) {
-						(uint64_t) alloc_queue_buffer(BUFFER_LEN),
+						(uint64_t) buf,
 						BUFFER_LEN,
-						desc_flags,
+						VIRTQ_DESC_F_WRITE,
 						0
 					};
 				} else {
+					// TX buffers come from the caller, chained at send time
 					this->desc[id] = (VirtQueueDesc) {
-						0, 0, 0, 0
+						0, 0, 0, (uint16_t) (id + 1)
 					};
 				}
 			}
 			
-			if (is_receive) {
+			if (kind == RX_QUEUE) {
 				for (uint16_t id = 0; id < actual_queue_size; id++) {
 					this->add_avail(id);
 				}
 			} else {
-				// un-pop used?
-				for (uint16_t id = 0; id < actual_queue_size; id++) {
-					this->used->ring[-id & (queue_size - 1)].id = id;
+				this->free_head = 0;
+				this->n_free = actual_queue_size;
+				if (!this->init_tx(actual_queue_size, kind)) {
+					return false;
 				}
-				this->cur_used_idx = -actual_queue_size;
 			}
 			
-			memory_barrier();
-			
-			common_regs.queue_address.write(queue_base / PAGE_SIZE);
-			common_regs.queue_notify.write(queue_id);
-			
 			this->queue_id = queue_id;
 			this->queue_size = queue_size;
+			this->actual_queue_size = actual_queue_size;
+			this->notified_idx = avail->idx;
+			this->held_head = 0;
+			this->n_held = 0;
+			
+			this->notify_addr = queue_activate(queue_base,
+				(uint64_t) this->avail, (uint64_t) this->used);
+			return true;
+		}
+		
+		// Makes avail->ring[.. new_idx) visible, descriptors included
+		void publish_avail(uint16_t new_idx) {
+			virtio_wmb();
+			* (volatile uint16_t *) &avail->idx = new_idx;
 		}
 		
 		void add_avail(uint16_t desc_id) {
-			uint16_t idx = avail->idx & (queue_size - 1);
-			avail->ring[idx] = desc_id;
-			memory_barrier();
-			avail->idx++;
-			memory_barrier();
+			uint16_t idx = avail->idx;
+			avail->ring[idx & (queue_size - 1)] = desc_id;
+			publish_avail(idx + 1);
+		}
+		
+		// Kicks the device for what was published since the last call,
+		// unless it told us (avail_event or VIRTQ_USED_F_NO_NOTIFY) that it
+		// will get to those entries anyway
+		void notify() {
+			virtio_mb();
+			uint16_t new_idx = avail->idx;
+			bool kick_needed;
+			if (use_event_idx) {
+				uint16_t avail_event = * (volatile uint16_t *) &used->ring[queue_size];
+				kick_needed = need_event(avail_event, new_idx, notified_idx);
+			} else {
+				kick_needed = !(* (volatile uint16_t *) &used->flags & VIRTQ_USED_F_NO_NOTIFY);
+			}
+			notified_idx = new_idx;
+			
+			if (kick_needed) {
+				kick();
+			}
 		}
 		
 		uint16_t pop_used(uint32_t &used_len) {
-			memory_barrier();
-			uint16_t new_idx = used->idx;
+			uint16_t new_idx = * (volatile uint16_t *) &used->idx;
 			if (new_idx == cur_used_idx) {
 				return 0xffff;
 			}
+			virtio_rmb();  // the entry is read after the index that covers it
 			
 			const VirtQueueUsedElement &e = used->ring[cur_used_idx++ & (queue_size - 1)];
 			used_len = e.len;
 			return e.id;
 		}
 		
-		bool send(const void *buf, int len) {
+		// Returns finished chains to the free list and runs their done()
+		void reclaim() {
+			uint32_t _;
+			uint16_t head;
+			while ((head = pop_used(_)) != 0xffff) {
+				uint16_t id = head;
+				uint32_t cnt = 1;
+				while (desc[id].flags & VIRTQ_DESC_F_NEXT) {
+					id = desc[id].next;
+					cnt++;
+				}
+				desc[id].next = free_head;
+				free_head = head;
+				n_free += cnt;
+				
+				if (done[head].fn) {
+					done[head].fn(done[head].arg);
+					done[head].fn = NULL;
+				}
+			}
+		}
+		
+		// Net header (TX queues), then one descriptor per fragment; the
+		// device writes to the last n_in of them
+		bool send_chain(const NetworkDriver::Fragment *frags, int n, void (*fn)(void *), void *arg,
+			int n_in = 0) {
+			uint32_t n_desc = n + with_header;
+			// Always, so done() runs soon after the device is through and
+			// does not wait for the ring to run dry
+			reclaim();
+			if (n_free < n_desc) {
+				return false;
+			}
+			
+			uint16_t head = free_head;
+			uint16_t next = head;
+			for (int i = with_header ? -1 : 0; i < n; i++) {
+				uint16_t id = next;
+				next = desc[id].next;
+				
+				desc[id].addr = i < 0 ? (uint64_t) &headers[head] : (uint64_t) frags[i].data;
+				desc[id].len = i < 0 ? net_hdr_len : frags[i].len;
+				desc[id].flags = (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0)
+					| (i >= n - n_in ? VIRTQ_DESC_F_WRITE : 0);
+			}
+			
+			free_head = next;
+			n_free -= n_desc;
+			done[head].fn = fn;
+			done[head].arg = arg;
+			
+			add_avail(head);
+			NetworkDriver::last_tx.post_tsc = Timer::get_tsc();
+			notify();
+			NetworkDriver::last_tx.doorbell_tsc = Timer::get_tsc();
+			
+			return true;
+		}
+		
+		// Refs point offset bytes into each buffer
+		int recv_burst(NetworkDriver::PacketRef *pkts, int max, uint32_t offset = 0) {
+			int n = 0;
+			uint64_t tsc = 0;
+			while (n < max && n_held < MAX_ACTUAL_QUEUE_SIZE) {
+				uint32_t len;
+				uint16_t desc_id = pop_used(len);
+				if (desc_id == 0xffff) {
+					break;
+				}
+				
+				held[(held_head + n_held++) % MAX_ACTUAL_QUEUE_SIZE] = desc_id;
+				if (len < offset) {
+					len = offset;
+				}
+				if (n == 0) tsc = Timer::get_tsc();
+				pkts[n++] = (NetworkDriver::PacketRef) {
+					(void *) (desc[desc_id].addr + offset), (int) (len - offset), 0, tsc
+				};
+			}
+			
+			return n;
+		}
+		
+		// Asks for an interrupt on the next used entry
+		// returns: false if there already is one
+		bool enable_interrupt() {
+			if (use_event_idx) {
+				* (volatile uint16_t *) &avail->ring[queue_size] = cur_used_idx;
+			} else {
+				* (volatile uint16_t *) &avail->flags = 0;
+			}
+			virtio_mb();
+			return * (volatile uint16_t *) &used->idx == cur_used_idx;
+		}
+		
+		// With EVENT_IDX the device only skips used_event after a full wrap
+		void disable_interrupt() {
+			if (use_event_idx) {
+				* (volatile uint16_t *) &avail->ring[queue_size] = cur_used_idx - 1;
+			} else {
+				* (volatile uint16_t *) &avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+			}
+		}
+		
+		// used->flags and used->idx, the latter moves with every used entry
+		const volatile uint32_t *wait_addr() {
+			return (const volatile uint32_t *) used;
+		}
+		
+		// Puts the n oldest held buffers back with one avail->idx update and
+		// at most one notification
+		void release(int n) {
+			if (n <= 0) {
+				return;
+			}
+			
+			uint16_t idx = avail->idx;
+			for (int i = 0; i < n; i++) {
+				avail->ring[idx++ & (queue_size - 1)] = held[held_head];
+				held_head = (held_head + 1) % MAX_ACTUAL_QUEUE_SIZE;
+			}
+			n_held -= n;
+			
+			publish_avail(idx);
+			notify();
+		}
+	};
+	
+	// One descriptor ring shared with the device: we make slots available
+	// in order and it hands them back in place, one used slot per chain.
+	// Buffer ids tell chains apart, since the slots get reused.
+	struct PackedQueue : QueueBase {
+		uint32_t size;
+		VirtQueuePackedDesc *desc;
+		VirtQueueEvent *driver_event;  // when the device should interrupt us
+		VirtQueueEvent *device_event;  // when we should notify the device
+		
+		uint16_t next_avail, next_used;
+		bool avail_wrap, used_wrap;
+		
+		// slots made available since the last notify()
+		uint16_t n_added;
+		
+		// # of slots behind each buffer id
+		uint16_t chain_len[MAX_ACTUAL_QUEUE_SIZE];
+		
+		// TX: slots and buffer ids not in flight
+		uint32_t n_free;
+		uint16_t free_ids[MAX_ACTUAL_QUEUE_SIZE];
+		uint32_t n_free_ids;
+		
+		// RX: the buffer behind each id
+		char *rx_buffers[MAX_ACTUAL_QUEUE_SIZE];
+		
+		bool init(int queue_id, QueueKind kind) {
+			uint32_t size = queue_begin(queue_id);
+			if (size == 0) {
+				return false;
+			}
+			LDEBUG("init_queue %d, packed, size %u", queue_id, size);
+			
+			uint32_t desc_size = sizeof(VirtQueuePackedDesc) * size;
+			uint64_t queue_base = (uint64_t) alloc_queue_memory(
+				Utils::round_up(desc_size + 2 * sizeof(VirtQueueEvent), PAGE_SIZE));
+			if (queue_base == 0) {
+				return false;
+			}
+			this->desc = (VirtQueuePackedDesc *) queue_base;
+			this->driver_event = (VirtQueueEvent *) (queue_base + desc_size);
+			this->device_event = this->driver_event + 1;
+			
+			memset(this->desc, 0, desc_size);
+			// we poll
+			this->driver_event->off_wrap = 0;
+			this->driver_event->flags = RING_EVENT_FLAGS_DISABLE;
+			this->device_event->off_wrap = 0;
+			this->device_event->flags = 0;
+			
+			this->queue_id = queue_id;
+			this->size = size;
+			this->next_avail = this->next_used = 0;
+			this->avail_wrap = this->used_wrap = true;
+			this->held_head = 0;
+			this->n_held = 0;
+			
+			if (kind == RX_QUEUE) {
+				for (uint32_t id = 0; id < size; id++) {
+					this->rx_buffers[id] = (char *) alloc_queue_buffer(BUFFER_LEN);
+					if (this->rx_buffers[id] == NULL) {
+						return false;
+					}
+					this->chain_len[id] = 1;
+					this->held[id] = id;
+				}
+				this->n_held = size;
+				this->post_rx(size);
+			} else {
+				this->n_free = size;
+				this->n_free_ids = size;
+				for (uint32_t i = 0; i < size; i++) {
+					this->free_ids[i] = size - 1 - i;
+				}
+				if (!this->init_tx(size, kind)) {
+					return false;
+				}
+			}
+			this->n_added = 0;
+			
+			this->notify_addr = queue_activate(queue_base,
+				(uint64_t) this->driver_event, (uint64_t) this->device_event);
+			return true;
+		}
+		
+		// Takes the slot at next_avail
+		// returns: its index, flags marks it available (on its own)
+		uint16_t take_avail(uint16_t &flags) {
+			uint16_t idx = next_avail;
+			flags = avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+			if (++next_avail == size) {
+				next_avail = 0;
+				avail_wrap = !avail_wrap;
+			}
+			n_added++;
+			return idx;
+		}
+		
+		// The device stops at the first slot it does not own, so a batch
+		// becomes visible at once when its first slot's flags go in last
+		void publish(uint16_t first, uint16_t first_flags) {
+			virtio_wmb();
+			* (volatile uint16_t *) &desc[first].flags = first_flags;
+		}
+		
+		// Kicks the device for the slots made available since the last
+		// call, unless its event suppression says it does not need it
+		void notify() {
+			virtio_mb();
+			uint16_t old_idx = next_avail - n_added;
+			n_added = 0;
+			
+			uint32_t event = * (volatile uint32_t *) device_event;
+			uint16_t off_wrap = event & 0xffff;
+			uint16_t flags = event >> 16;
+			
+			bool kick_needed;
+			if (flags == RING_EVENT_FLAGS_DESC) {
+				uint16_t event_idx = off_wrap & 0x7fff;
+				if ((bool) (off_wrap >> 15) != avail_wrap) {
+					event_idx -= size;
+				}
+				kick_needed = need_event(event_idx, next_avail, old_idx);
+			} else {
+				kick_needed = flags != RING_EVENT_FLAGS_DISABLE;
+			}
+			
+			if (kick_needed) {
+				kick();
+			}
+		}
+		
+		uint16_t pop_used(uint32_t &used_len) {
+			uint16_t flags = * (volatile uint16_t *) &desc[next_used].flags;
+			bool avail = flags & VIRTQ_DESC_F_AVAIL;
+			bool used = flags & VIRTQ_DESC_F_USED;
+			if (avail != used || used != used_wrap) {
+				return 0xffff;
+			}
+			virtio_rmb();  // id and len are read after the flags
+			
+			uint16_t id = desc[next_used].id;
+			used_len = desc[next_used].len;
+			
+			next_used += chain_len[id];
+			if (next_used >= size) {
+				next_used -= size;
+				used_wrap = !used_wrap;
+			}
+			return id;
+		}
+		
+		void reclaim() {
 			uint32_t _;
-			uint16_t desc_id = pop_used(_);
-			if (desc_id == 0xffff) {
+			uint16_t id;
+			while ((id = pop_used(_)) != 0xffff) {
+				n_free += chain_len[id];
+				free_ids[n_free_ids++] = id;
+				
+				if (done[id].fn) {
+					done[id].fn(done[id].arg);
+					done[id].fn = NULL;
+				}
+			}
+		}
+		
+		// Net header (TX queues), then one slot per fragment; the device
+		// writes to the last n_in of them
+		bool send_chain(const NetworkDriver::Fragment *frags, int n, void (*fn)(void *), void *arg,
+			int n_in = 0) {
+			uint32_t n_desc = n + with_header;
+			reclaim();  // see SplitQueue::send_chain
+			if (n_free < n_desc || n_free_ids == 0) {
 				return false;
 			}
 			
-			memcpy((void *) desc[desc_id].addr, buf, len);
-			desc[desc_id].len = len;
-			add_avail(desc_id);
-			// TODO flush
+			uint16_t id = free_ids[--n_free_ids];
+			uint16_t first = next_avail, first_flags = 0;
+			for (int i = with_header ? -1 : 0; i < n; i++) {
+				uint16_t flags;
+				uint16_t idx = take_avail(flags);
+				if (i + 1 < n) {
+					flags |= VIRTQ_DESC_F_NEXT;
+				}
+				if (i >= n - n_in) {
+					flags |= VIRTQ_DESC_F_WRITE;
+				}
+				
+				desc[idx].addr = i < 0 ? (uint64_t) &headers[id] : (uint64_t) frags[i].data;
+				desc[idx].len = i < 0 ? net_hdr_len : frags[i].len;
+				desc[idx].id = id;
+				if (idx == first) {
+					first_flags = flags;
+				} else {
+					desc[idx].flags = flags;
+				}
+			}
+			
+			chain_len[id] = n_desc;
+			n_free -= n_desc;
+			done[id].fn = fn;
+			done[id].arg = arg;
 			
-			common_regs.queue_notify.write(queue_id);
+			publish(first, first_flags);
+			NetworkDriver::last_tx.post_tsc = Timer::get_tsc();
+			notify();
+			NetworkDriver::last_tx.doorbell_tsc = Timer::get_tsc();
 			
 			return true;
 		}
 		
-		// buf has enough length
-		int recv(void *buf, uint32_t offset = 0) {
-			common_regs.queue_notify.write(queue_id);
+		// Refs point offset bytes into each buffer
+		int recv_burst(NetworkDriver::PacketRef *pkts, int max, uint32_t offset = 0) {
+			int n = 0;
+			uint64_t tsc = 0;
+			while (n < max && n_held < MAX_ACTUAL_QUEUE_SIZE) {
+				uint32_t len;
+				uint16_t id = pop_used(len);
+				if (id == 0xffff) {
+					break;
+				}
+				
+				held[(held_head + n_held++) % MAX_ACTUAL_QUEUE_SIZE] = id;
+				if (len < offset) {
+					len = offset;
+				}
+				if (n == 0) tsc = Timer::get_tsc();
+				pkts[n++] = (NetworkDriver::PacketRef) {
+					rx_buffers[id] + offset, (int) (len - offset), 0, tsc
+				};
+			}
 			
-			uint32_t len;
-			uint16_t desc_id = pop_used(len);
-			if (desc_id == 0xffff) {
-				return -1;
+			return n;
+		}
+		
+		// Makes the n oldest held buffers available again
+		void post_rx(int n) {
+			uint16_t first = next_avail, first_flags = 0;
+			for (int i = 0; i < n; i++) {
+				uint16_t id = held[held_head];
+				held_head = (held_head + 1) % MAX_ACTUAL_QUEUE_SIZE;
+				
+				uint16_t flags;
+				uint16_t idx = take_avail(flags);
+				flags |= VIRTQ_DESC_F_WRITE;
+				
+				desc[idx].addr = (uint64_t) rx_buffers[id];
+				desc[idx].len = BUFFER_LEN;
+				desc[idx].id = id;
+				if (i == 0) {
+					first_flags = flags;
+				} else {
+					desc[idx].flags = flags;
+				}
 			}
+			n_held -= n;
 			
-			if (len < offset) {
-				return -1;
+			publish(first, first_flags);
+		}
+		
+		// Puts the n oldest held buffers back with at most one notification
+		void release(int n) {
+			if (n <= 0) {
+				return;
 			}
 			
-			memcpy(buf, (const void *) (desc[desc_id].addr + offset), len - offset);
-			add_avail(desc_id);
+			post_rx(n);
+			notify();
+		}
+		
+		// Asks for an interrupt on the next used slot
+		// returns: false if there already is one
+		bool enable_interrupt() {
+			* (volatile uint16_t *) &driver_event->flags = RING_EVENT_FLAGS_ENABLE;
+			virtio_mb();
 			
-			return len;
-		} 
+			uint16_t flags = * (volatile uint16_t *) &desc[next_used].flags;
+			bool avail = flags & VIRTQ_DESC_F_AVAIL;
+			bool used = flags & VIRTQ_DESC_F_USED;
+			return avail != used || used != used_wrap;
+		}
+		
+		void disable_interrupt() {
+			* (volatile uint16_t *) &driver_event->flags = RING_EVENT_FLAGS_DISABLE;
+		}
+		
+		// id and flags of the next slot the device hands back
+		const volatile uint32_t *wait_addr() {
+			return (const volatile uint32_t *) ((char *) &desc[next_used] + 12);
+		}
 	};
 	
-	static VirtQueue receive_queue, transmit_queue;
+	// Pair i is receiveq 2i and transmitq 2i + 1, the control queue comes
+	// after all the pairs the device has
+	static SplitQueue split_rx[MAX_QUEUE_PAIRS], split_tx[MAX_QUEUE_PAIRS], split_ctrl;
+	static PackedQueue packed_rx[MAX_QUEUE_PAIRS], packed_tx[MAX_QUEUE_PAIRS], packed_ctrl;
+	static int n_pairs;
+	
+	static bool init_pair(int i) {
+		if (use_packed) {
+			return packed_rx[i].init(2 * i, RX_QUEUE) && packed_tx[i].init(2 * i + 1, TX_QUEUE);
+		} else {
+			return split_rx[i].init(2 * i, RX_QUEUE) && split_tx[i].init(2 * i + 1, TX_QUEUE);
+		}
+	}
+	
+	// The queues stay in cacheable kernel memory: the device is coherent.
+	// Pairs beyond the first are set up as far as our pools go.
+	static bool init_queue(uint32_t max_pairs) {
+		n_pairs = 0;
+		if (!init_pair(0)) {
+			return false;
+		}
+		n_pairs = 1;
+		
+		if (max_pairs > 1) {
+			bool ctrl_ok = use_packed
+				? packed_ctrl.init(2 * max_pairs, CTRL_QUEUE)
+				: split_ctrl.init(2 * max_pairs, CTRL_QUEUE);
+			
+			uint32_t want = std::min(max_pairs, (uint32_t) MAX_QUEUE_PAIRS);
+			while (ctrl_ok && (uint32_t) n_pairs < want && init_pair(n_pairs)) {
+				n_pairs++;
+			}
+		}
+		return true;
+	}
+	
+	#define VIRTIO_NET_OK 0
+	#define VIRTIO_NET_CTRL_MQ 4
+	#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
 	
-	static void init_queue() {
-		Memory::map_region_cache_disabled(
-			(uint64_t) queue_memory_pool,
-			(uint64_t) queue_memory_pool + sizeof(queue_memory_pool),
-			(uint64_t) queue_memory_pool);
+	static void ctrl_done(void *arg) {
+		* (bool *) arg = true;
+	}
+	
+	// Sends one command on the control queue and polls for the ack
+	// returns: whether the device took it
+	static bool ctrl_command(uint8_t cls, uint8_t cmd, const void *data, int len) {
+		static struct {
+			uint8_t cls;
+			uint8_t cmd;
+		} __attribute__((packed)) hdr;
+		static uint8_t ack;
+		
+		hdr.cls = cls;
+		hdr.cmd = cmd;
+		ack = 0xff;
+		bool finished = false;
 		
-		Memory::map_region_cache_disabled(
-			(uint64_t) queue_buffer_pool,
-			(uint64_t) queue_buffer_pool + sizeof(queue_buffer_pool),
-			(uint64_t) queue_buffer_pool);
+		const NetworkDriver::Fragment frags[3] = {
+			{ &hdr, sizeof(hdr) }, { data, len }, { &ack, sizeof(ack) }
+		};
+		bool r = use_packed
+			? packed_ctrl.send_chain(frags, 3, ctrl_done, &finished, 1)
+			: split_ctrl.send_chain(frags, 3, ctrl_done, &finished, 1);
+		if (!r) {
+			return false;
+		}
 		
-		receive_queue.init(0, true);
-		transmit_queue.init(1, false);
+		for (int i = 0; i < 100000 && !finished; i++) {
+			Timer::microdelay(10);
+			if (use_packed) {
+				packed_ctrl.reclaim();
+			} else {
+				split_ctrl.reclaim();
+			}
+		}
+		return finished && * (volatile uint8_t *) &ack == VIRTIO_NET_OK;
 	}
 	
-	static bool init_virtio_net_regs(uint32_t vendor_id, uint32_t device_id) {
+	static bool init_legacy_regs(uint32_t vendor_id, uint32_t device_id) {
+		is_modern = false;
+		
 		// Try regio
 		uint64_t r;
 		r = PCI::get_device_reg_base(vendor_id, device_id);
 		
 		if (r != -1ull) {
-			regio_base = r;
 			is_mmio = false;
-			common_regs.init();
+			common_regs.init_legacy(r);
 			return true;
 		}
 		
@@ -337,21 +1045,103 @@ namespace virtio_net {
 		
 		if (r != -1ull) {
 			is_mmio = true;
-			mmio_base = (uint64_t) mmio;
-			common_regs.init();
+			common_regs.init_legacy((uint64_t) mmio);
 			return true;
 		} else {
 			return false;
 		}
 	}
 	
-	bool init(uint8_t mac[6]) {
-		LDEBUG_ENTER_RET();
+	#define VIRTIO_PCI_CAP_COMMON_CFG 1
+	#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+	#define VIRTIO_PCI_CAP_ISR_CFG 3
+	#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+	
+	// Finds the common, notify and device config regions through the
+	// vendor-specific capabilities (struct virtio_pci_cap) and maps them.
+	// They all have to be in one memory BAR, as with QEMU.
+	static bool init_modern_regs(uint32_t vendor_id, uint32_t device_id) {
+		const uint32_t NONE = -1u;
+		uint32_t common_off = NONE, notify_off = NONE, device_off = NONE;
+		uint32_t bar = NONE, end = 0;
+		
+		for (uint32_t cap = PCI::find_capability(vendor_id, device_id, PCI_CAP_VENDSPEC);
+			cap != 0; cap = PCI::find_capability(vendor_id, device_id, PCI_CAP_VENDSPEC, cap)) {
+			
+			uint8_t cfg_type = PCI::read_config(vendor_id, device_id, cap) >> 24;
+			uint32_t cap_bar = PCI::read_config(vendor_id, device_id, cap + 4) & 0xff;
+			uint32_t offset = PCI::read_config(vendor_id, device_id, cap + 8);
+			uint32_t length = PCI::read_config(vendor_id, device_id, cap + 12);
+			
+			uint32_t *off;
+			switch (cfg_type) {
+				case VIRTIO_PCI_CAP_COMMON_CFG: off = &common_off; break;
+				case VIRTIO_PCI_CAP_NOTIFY_CFG: off = &notify_off; break;
+				case VIRTIO_PCI_CAP_DEVICE_CFG: off = &device_off; break;
+				default: continue;
+			}
+			if (*off != NONE) {
+				continue;  // the first one of each type is preferred
+			}
+			if (bar != NONE && bar != cap_bar) {
+				LWARN("virtio: config regions in more than one BAR");
+				return false;
+			}
+			
+			bar = cap_bar;
+			*off = offset;
+			end = std::max(end, offset + length);
+			if (cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+				notify_off_multiplier = PCI::read_config(vendor_id, device_id, cap + 16);
+			}
+		}
+		
+		if (common_off == NONE || notify_off == NONE || device_off == NONE || bar >= 6) {
+			return false;
+		}
+		
+		static char mmio[0x10000] __attribute__((aligned(PAGE_SIZE)));
+		if (end > sizeof(mmio)) {
+			LWARN("virtio: config regions span %u bytes, too many", end);
+			return false;
+		}
 		
-		if (!init_virtio_net_regs(0x1af4, 0x1000)) {
+		uint64_t r = PCI::map_device(vendor_id, device_id, (uint64_t) mmio, end, bar);
+		if (r == -1ull || r < end) {
 			return false;
 		}
 		
+		is_mmio = true;
+		is_modern = true;
+		modern_device_id = device_id;
+		notify_base = (uint64_t) mmio + notify_off;
+		common_regs.init_modern((uint64_t) mmio + common_off, (uint64_t) mmio + device_off);
+		return true;
+	}
+	
+	// Points the RX queues at MSI-X entry 0, the device answers
+	// VIRTIO_MSI_NO_VECTOR if it is out of resources
+	static void init_msix() {
+		msix_enabled = is_modern
+			&& PCI::enable_msix(0x1af4, modern_device_id, Trap::TRAP_WAKEUP);
+		if (!msix_enabled) {
+			return;
+		}
+		
+		common_regs.msix_config.write(VIRTIO_MSI_NO_VECTOR);
+		for (int i = 0; i < n_pairs; i++) {
+			common_regs.queue_select.write(2 * i);
+			common_regs.queue_msix_vector.write(0);
+			if (common_regs.queue_msix_vector.read() != 0) {
+				LWARN("virtio: no MSI-X vector for receiveq %d", i);
+				msix_enabled = false;
+			}
+		}
+	}
+	
+	// Resets the device and takes it through feature negotiation and queue
+	// setup to DRIVER_OK, with the interface selected by init_*_regs
+	static bool start_device(uint8_t mac[6]) {
 		LDEBUG("status = 0x%x, resetting ...", common_regs.device_status.read());
 		common_regs.device_status.write(0);  // RESET
 		while (common_regs.device_status.read() != 0);
@@ -361,16 +1151,53 @@ namespace virtio_net {
 		common_regs.device_status.write_or(2);  // DRIVER
 		LDEBUG("status = 0x%x", common_regs.device_status.read());
 		
-		uint32_t device_features = common_regs.device_features.read();
-		LDEBUG("device_features = 0x%x", device_features);
+		uint64_t device_features;
+		uint64_t supported_features = VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS
+			| VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ | VIRTIO_RING_F_EVENT_IDX;
+		if (is_modern) {
+			common_regs.device_feature_select.write(0);
+			device_features = common_regs.device_features.read();
+			common_regs.device_feature_select.write(1);
+			device_features |= (uint64_t) common_regs.device_features.read() << 32;
+			supported_features |= VIRTIO_F_VERSION_1 | VIRTIO_F_RING_PACKED;
+		} else {
+			device_features = common_regs.device_features.read();
+		}
+		LDEBUG("device_features = 0x%lx", device_features);
+		
+		uint64_t features = supported_features & device_features;
+		// the control queue is only for MQ, which cannot go without it
+		if ((features & (VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ))
+			!= (VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ)) {
+			features &= ~(VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ);
+		}
+		if (is_modern && !(features & VIRTIO_F_VERSION_1)) {
+			common_regs.device_status.write_or(128);  // FAILED
+			return false;
+		}
 		
-		uint32_t supported_features = 1 << 5 | 1 << 16;  // MAC, STATUS
-		common_regs.driver_features.write(supported_features & device_features);
+		if (is_modern) {
+			common_regs.driver_feature_select.write(0);
+			common_regs.driver_features.write(features);
+			common_regs.driver_feature_select.write(1);
+			common_regs.driver_features.write(features >> 32);
+		} else {
+			common_regs.driver_features.write(features);
+		}
 		common_regs.device_status.write_or(8);  // FEATURES_OK
 		
+		bool features_ok = (common_regs.device_status.read() & 8) != 0;
 		LDEBUG("status = 0x%x, features_ok = %s",
-			common_regs.device_status.read(),
-			(common_regs.device_status.read() & 8) != 0 ? "true" : "false");
+			common_regs.device_status.read(), features_ok ? "true" : "false");
+		// legacy devices need not keep FEATURES_OK
+		if (is_modern && !features_ok) {
+			common_regs.device_status.write_or(128);  // FAILED
+			return false;
+		}
+		
+		net_hdr_len = is_modern ? sizeof(VirtIONetHeader) : sizeof(VirtIONetHeader) - 2;
+		use_packed = (features & VIRTIO_F_RING_PACKED) != 0;
+		use_event_idx = (features & VIRTIO_RING_F_EVENT_IDX) != 0;
 		
 		for (int i = 0; i < 6; i++) {
 			mac[i] = common_regs.mac[i].read();
@@ -379,67 +1206,178 @@ namespace virtio_net {
 		LDEBUG("MAC (from device): %02x:%02x:%02x:%02x:%02x:%02x",
 			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 		
-		init_queue();
+		uint32_t max_pairs = 1;
+		if (features & VIRTIO_NET_F_MQ) {
+			max_pairs = std::max(common_regs.max_virtqueue_pairs.read(), 1u);
+		}
+		
+		if (!init_queue(max_pairs)) {
+			LWARN("virtio: no RX/TX queue pair");
+			common_regs.device_status.write_or(128);  // FAILED
+			return false;
+		}
+		
+		init_msix();
 		
 		common_regs.device_status.write_or(4);  // DRIVER_OK
 		
 		LDEBUG("DRIVER_OK set, status = 0x%x", common_regs.device_status.read());
 		
+		// the RX buffers went in before the device was live
+		for (int i = 0; i < n_pairs; i++) {
+			if (use_packed) {
+				packed_rx[i].kick();
+			} else {
+				split_rx[i].kick();
+			}
+		}
+		
+		// The device starts out with one pair
+		if (n_pairs > 1) {
+			uint16_t pairs = n_pairs;
+			if (!ctrl_command(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs))) {
+				LWARN("virtio: VQ_PAIRS_SET %u failed, using one queue pair", pairs);
+				n_pairs = 1;
+			}
+		}
+		
+		LINFO("virtio-net: %s interface, %s ring%s%s, %d of %u queue pairs",
+			is_modern ? "modern" : "legacy", use_packed ? "packed" : "split",
+			use_event_idx ? ", event idx" : "", msix_enabled ? ", MSI-X" : "",
+			n_pairs, max_pairs);
+		
 		return true;
 	}
 	
-	#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
-	#define VIRTIO_NET_HDR_F_DATA_VALID 2
-	#define VIRTIO_NET_HDR_F_RSC_INFO 4
+	bool init(uint8_t mac[6]) {
+		LDEBUG_ENTER_RET();
+		
+		// Modern-only devices have their own id, transitional ones offer
+		// both interfaces and we fall back to legacy if modern fails
+		const uint32_t device_ids[] = { 0x1041, 0x1000 };
+		for (uint32_t device_id : device_ids) {
+			if (init_modern_regs(0x1af4, device_id) && start_device(mac)) {
+				return true;
+			}
+		}
+		
+		return init_legacy_regs(0x1af4, 0x1000) && start_device(mac);
+	}
 	
-	#define VIRTIO_NET_HDR_GSO_NONE 0
-	#define VIRTIO_NET_HDR_GSO_TCPV4 1
-	#define VIRTIO_NET_HDR_GSO_UDP 3
-	#define VIRTIO_NET_HDR_GSO_TCPV6 4
-	#define VIRTIO_NET_HDR_GSO_ECN 0x80
 	
-	struct VirtIONetHeader {
-		uint8_t flags;
-		uint8_t gso_type;
-		uint16_t hdr_len;
-		uint16_t gso_size;
-		uint16_t csum_start;
-		uint16_t csum_offset;
-	} __attribute__((packed));
+	int n_queue_pairs() {
+		return n_pairs;
+	}
 	
 	// returns: # of bytes sent
-	int send(const void *buf, int len) {
-		if (len < 0 || len > 1500) {
+	int send_sg_q(int queue, const NetworkDriver::Fragment *frags, int n, uint32_t /* csum */,
+		void (*done)(void *), void *arg) {
+		if (queue < 0 || queue >= n_pairs || n <= 0 || n > NetworkDriver::MAX_FRAGMENTS) {
 			return -1;
 		}
 		
-		// LINFO("send len %d", len);
-		
-		static char buffer[sizeof(VirtIONetHeader) + 1500] __attribute__((aligned(16)));
+		int len = 0;
+		for (int i = 0; i < n; i++) {
+			len += frags[i].len;
+		}
+		if (len > NetworkDriver::MAX_FRAME_LEN) {
+			return -1;
+		}
 		
-		VirtIONetHeader *net_header = (VirtIONetHeader *) buffer;
-		net_header->flags = 0;
-		net_header->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-		// net_header->csum_start = 0;
-		// net_header->csum_offset = len;
-		memcpy(buffer + sizeof(VirtIONetHeader), buf, len);
+		// LINFO("send len %d", len);
 		
-		bool r = transmit_queue.send(buffer, sizeof(VirtIONetHeader) + len);
+		bool r = use_packed
+			? packed_tx[queue].send_chain(frags, n, done, arg)
+			: split_tx[queue].send_chain(frags, n, done, arg);
 		// printf("r = %d\n", r);
 		return r ? len : -1;
 	}
 	
-	// returns: # of bytes received
-	int receive(void *buf) {
-		int len = receive_queue.recv(buf, sizeof(VirtIONetHeader));
-		// if (len != -1) LINFO("recv len %d", len);
-		return len;
+	int rx_burst_q(int queue, NetworkDriver::PacketRef *pkts, int max) {
+		if (queue < 0 || queue >= n_pairs) {
+			return 0;
+		}
+		
+		int n = use_packed
+			? packed_rx[queue].recv_burst(pkts, max, net_hdr_len)
+			: split_rx[queue].recv_burst(pkts, max, net_hdr_len);
+		// if (n) LINFO("rx_burst %d", n);
+		return n;
+	}
+	
+	void rx_release_q(int queue, int n) {
+		if (queue < 0 || queue >= n_pairs) {
+			return;
+		}
+		
+		if (use_packed) {
+			packed_rx[queue].release(n);
+		} else {
+			split_rx[queue].release(n);
+		}
+	}
+	
+	// returns: zero
+	int flush_q(int queue) {
+		if (queue < 0 || queue >= n_pairs) {
+			return 0;
+		}
+		
+		if (use_packed) {
+			packed_tx[queue].reclaim();
+		} else {
+			split_tx[queue].reclaim();
+		}
+		return 0;
+	}
+	
+	int send_sg(const NetworkDriver::Fragment *frags, int n, uint32_t csum,
+		void (*done)(void *), void *arg) {
+		return send_sg_q(0, frags, n, csum, done, arg);
 	}
 	
+	int rx_burst(NetworkDriver::PacketRef *pkts, int max) {
+		return rx_burst_q(0, pkts, max);
+	}
+	
+	void rx_release(int n) {
+		rx_release_q(0, n);
+	}
+	
+	// Reclaims on every TX queue, the TX buffer pool relies on it
 	// returns: zero
 	int flush() {
-		// unimplemented();
-		// TODO
+		for (int i = 0; i < n_pairs; i++) {
+			flush_q(i);
+		}
 		return 0;
 	}
+	
+	bool has_rx_wakeup() {
+		return msix_enabled;
+	}
+	
+	bool rx_wakeup_arm() {
+		bool none_waiting = true;
+		for (int i = 0; i < n_pairs; i++) {
+			none_waiting &= use_packed
+				? packed_rx[i].enable_interrupt()
+				: split_rx[i].enable_interrupt();
+		}
+		return none_waiting;
+	}
+	
+	void rx_wakeup_disarm() {
+		for (int i = 0; i < n_pairs; i++) {
+			if (use_packed) {
+				packed_rx[i].disable_interrupt();
+			} else {
+				split_rx[i].disable_interrupt();
+			}
+		}
+	}
+	
+	const volatile uint32_t *rx_wait_addr() {
+		return use_packed ? packed_rx[0].wait_addr() : split_rx[0].wait_addr();
+	}
 }
@@ -14,4 +14,7 @@
 
 #define MEM_SIZE (1024 * 1024)
 
+// The NIC may compute or verify checksums, set per frame by Contestant
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
 #endif